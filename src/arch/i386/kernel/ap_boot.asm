@@ -25,6 +25,7 @@
 ; Constants. These should match the ones in smp.h.
 SMP_PAGING_ADDRESS equ 0x500
 SMP_PAGING_PAE_ADDRESS equ 0x510
+SMP_AP_LOCK_ADDRESS equ 0x520
 SMP_GDT32_ADDRESS equ 0x5A0
 
 _ap_bootstrap_protected_real equ _ap_bootstrap_protected - 0xC0000000
@@ -47,6 +48,18 @@ _ap_bootstrap_init:
     ; Ensure interrupts are disabled.
     cli
 
+    ; APs are started together but share the real mode and temporary stacks, so only
+    ; one may run the bootstrap at a time. The lock is released once on its own stack.
+    xor ax, ax
+    mov ds, ax
+_ap_bootstrap_lock:
+    lock bts word [SMP_AP_LOCK_ADDRESS], 0
+    jnc _ap_bootstrap_locked
+    pause
+    jmp _ap_bootstrap_lock
+
+_ap_bootstrap_locked:
+
     ; Check if A20 line is enabled.
     call _check_a20
 
@@ -203,12 +216,7 @@ _ap_bootstrap_higherhalf:
     ; Set up temporary stack.
     mov esp, ap_bootstrap_stack_end
 
-    ; Get the ID for this processor's LAPIC. ID is placed in EAX.
-    extern lapic_id
-    call lapic_id
-
-    ; Get stack address. Address is placed in EAX.
-    push eax
+    ; Get stack address for this processor. Address is placed in EAX.
     extern smp_ap_get_stack
     call smp_ap_get_stack
 
@@ -217,6 +225,9 @@ _ap_bootstrap_higherhalf:
     add esp, 0x4000
     mov ebp, esp
 
+    ; Let the next AP in. Low memory is still identity mapped.
+    mov dword [SMP_AP_LOCK_ADDRESS], 0
+
     ; Pop into C code.
     extern smp_ap_main
     call smp_ap_main
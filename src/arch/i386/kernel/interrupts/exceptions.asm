@@ -205,6 +205,9 @@ exception_common_stub:
     mov ds, ax
     mov es, ax
     mov fs, ax
+
+    ; Point GS at this processor's data.
+    mov ax, 0x30
     mov gs, ax
 
     ; Push stack for use in C handler.
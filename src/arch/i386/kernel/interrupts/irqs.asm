@@ -26,16 +26,33 @@
 [bits 32]
 section .text
 
+; Constants. These should match the ones in irqs.h.
+IRQ_VECTOR_FIRST equ 32
+IRQ_VECTOR_COUNT equ 224
+IRQ_STUB_SIZE equ 16
+
 ; Empty IRQ handler for spurious IRQs.
 global _irq_empty
 _irq_empty:
     iretd
 
+; Entry stubs, one for each vector above the exceptions. Each pushes its vector
+; and joins the common handler, so the handler doesn't have to go looking for it.
+global _irq_stubs
+align IRQ_STUB_SIZE
+_irq_stubs:
+%assign vector IRQ_VECTOR_FIRST
+%rep IRQ_VECTOR_COUNT
+    push dword vector
+    jmp _irq_common
+    align IRQ_STUB_SIZE
+%assign vector vector+1
+%endrep
+
 ; IRQ common handler. This calls the handler defined in irqs.c.
 extern irqs_handler
-global _irq_common
 _irq_common:
-    ; The processor has already pushed SS, ESP, EFLAGS, CS, and EIP to the stack.
+    ; The processor has already pushed SS, ESP, EFLAGS, CS, and EIP to the stack, and the stub the vector.
     ; Push general registers (EAX, EBX, ECX, EDX, EBP, ESI, and EDI) to stack.
     push eax
     push ebx
@@ -45,6 +62,12 @@ _irq_common:
     push esi
     push edi
 
+    ; Timestamp entry with the TSC, passed to the C handler for interrupt statistics.
+    ; ESI and EDI are already saved, so hold the timestamp there.
+    rdtsc
+    mov esi, eax
+    mov edi, edx
+
     ; Push segments to stack.
     push ds
     push es
@@ -56,15 +79,20 @@ _irq_common:
     mov ds, ax
     mov es, ax
     mov fs, ax
+
+    ; Point GS at this processor's data.
+    mov ax, 0x30
     mov gs, ax
 
-    ; Push stack for use in C handler.
+    ; Push entry timestamp and stack for use in C handler.
     mov eax, esp
+    push edi
+    push esi
     push eax
 
     ; Call IRQ C handler.
     call irqs_handler
-    pop eax
+    add esp, 12
 
 global _irq_exit
 _irq_exit:
@@ -83,5 +111,8 @@ _irq_exit:
     pop ebx
     pop eax
 
+    ; Skip vector.
+    add esp, 4
+
     ; Continue execution. This restores EIP, CS, EFLAGS, ESP, and SS, and re-enables interrupts.
     iretd
@@ -182,7 +182,7 @@ void paging_unmap(uintptr_t virtual) {
     paging_flush_tlb_address(virtual);
 }
 
-static bool paging_get_phys_std(uintptr_t virtual, uint64_t *physOut) {
+static bool paging_get_phys_std(uintptr_t virtual, uint64_t *physOut, uint32_t flags) {
     // Get pointer to page directory.
     uint32_t *directory = (uint32_t*)(PAGE_DIR_ADDRESS);
 
@@ -193,13 +193,13 @@ static bool paging_get_phys_std(uintptr_t virtual, uint64_t *physOut) {
     // Get address of table from directory.
     // If there isn't one, no virtual to physical mapping exists.
     // Pages will never be located at 0x0, so its safe to assume a value of 0 = no table defined.
-    if (MASK_PAGE_4K(directory[tableIndex]) == 0) {
+    if (MASK_PAGE_4K(directory[tableIndex]) == 0 || (directory[tableIndex] & flags) != flags) {
         return false;
     }
     uint32_t *table = (uint32_t*)(PAGE_TABLES_ADDRESS + (tableIndex * PAGE_SIZE_4K));
 
     // Is page present?
-    if (!(table[entryIndex] & PAGING_PAGE_PRESENT))
+    if (!(table[entryIndex] & PAGING_PAGE_PRESENT) || (table[entryIndex] & flags) != flags)
         return false;
 
     // Get address from table.
@@ -207,7 +207,7 @@ static bool paging_get_phys_std(uintptr_t virtual, uint64_t *physOut) {
     return true;
 }
 
-static bool paging_get_phys_pae(uintptr_t virtual, uint64_t *physOut) {
+static bool paging_get_phys_pae(uintptr_t virtual, uint64_t *physOut, uint64_t flags) {
     // Get pointer to PDPT.
     uint64_t *directoryPointerTable = (uint64_t*)(PAGE_PAE_PDPT_ADDRESS);
 
@@ -227,11 +227,11 @@ static bool paging_get_phys_pae(uintptr_t virtual, uint64_t *physOut) {
     // If there isn't one, no mapping exists.
     // Pages will never be located at 0x0, so its safe to assume a value of 0 = no table defined.
     uint64_t *table = (uint64_t*)(paging_get_pae_tables_address(dirIndex) + (tableIndex * PAGE_SIZE_4K)); 
-    if (MASK_PAGE_4K_64BIT(directory[tableIndex]) == 0)
+    if (MASK_PAGE_4K_64BIT(directory[tableIndex]) == 0 || (directory[tableIndex] & flags) != flags)
         return false;
 
     // Is page present?
-    if (!(table[entryIndex] & PAGING_PAGE_PRESENT))
+    if (!(table[entryIndex] & PAGING_PAGE_PRESENT) || (table[entryIndex] & flags) != flags)
         return false;
     
     // Get address from table.
@@ -242,9 +242,19 @@ static bool paging_get_phys_pae(uintptr_t virtual, uint64_t *physOut) {
 bool paging_get_phys(uintptr_t virtual, uint64_t *physOut) {
     // Are we in PAE mode?
     if (memInfo.paeEnabled)
-        return paging_get_phys_pae(virtual, physOut);
+        return paging_get_phys_pae(virtual, physOut, 0);
     else
-        return paging_get_phys_std(virtual, physOut);
+        return paging_get_phys_std(virtual, physOut, 0);
+}
+
+bool paging_get_phys_user(uintptr_t virtual, uint64_t *physOut) {
+    // Only the lower 3GB belongs to user mode, and the page itself must be user accessible.
+    if (virtual >= PAGE_3GB_ADDRESS)
+        return false;
+    if (memInfo.paeEnabled)
+        return paging_get_phys_pae(virtual, physOut, PAGING_PAGE_USER);
+    else
+        return paging_get_phys_std(virtual, physOut, PAGING_PAGE_USER);
 }
 
 uintptr_t paging_create_app_copy(void) {
@@ -304,6 +314,68 @@ uintptr_t paging_create_app_copy(void) {
     return (uintptr_t)appDirPage;
 }
 
+static void paging_free_app_table_std(uint32_t tablePhys) {
+    // Free the app's pages, then the table itself.
+    uint32_t *table = (uint32_t*)paging_device_alloc(tablePhys, tablePhys);
+    for (uint16_t i = 0; i < PAGE_TABLE_SIZE; i++) {
+        if ((table[i] & PAGING_PAGE_PRESENT) && MASK_PAGE_4K(table[i]) != 0)
+            pmm_push_frame(MASK_PAGE_4K(table[i]));
+    }
+    paging_device_free((uintptr_t)table, (uintptr_t)table);
+    pmm_push_frame(tablePhys);
+}
+
+static void paging_free_app_table_pae(uint64_t tablePhys) {
+    // Free the app's pages, then the table itself.
+    uint64_t *table = (uint64_t*)paging_device_alloc(tablePhys, tablePhys);
+    for (uint16_t i = 0; i < PAGE_PAE_TABLE_SIZE; i++) {
+        if ((table[i] & PAGING_PAGE_PRESENT) && MASK_FRAME_64BIT(table[i]) != 0)
+            pmm_push_frame(MASK_FRAME_64BIT(table[i]));
+    }
+    paging_device_free((uintptr_t)table, (uintptr_t)table);
+    pmm_push_frame(tablePhys);
+}
+
+/**
+ * Frees an app's paging structures and the pages mapped below the kernel.
+ * The structure must not be loaded on any processor.
+ */
+void paging_free_app_copy(uintptr_t directoryPhys) {
+    // Are we in PAE mode?
+    if (memInfo.paeEnabled) {
+        // PAE mode.
+        uint64_t *appPointerTable = (uint64_t*)paging_device_alloc(directoryPhys, directoryPhys);
+        uint32_t kernelDirIndex = paging_pae_calculate_directory(memInfo.kernelVirtualOffset);
+        for (uint32_t d = 0; d < kernelDirIndex; d++) {
+            uint64_t appDirPhys = MASK_FRAME_64BIT(appPointerTable[d]);
+            if (!(appPointerTable[d] & PAGING_PAGE_PRESENT) || appDirPhys == 0)
+                continue;
+
+            // The last four entries of the 2GB directory map the paging structures themselves.
+            uint64_t *appDirectory = (uint64_t*)paging_device_alloc(appDirPhys, appDirPhys);
+            uint32_t tableCount = (d == 2) ? (PAGE_PAE_DIRECTORY_SIZE - 4) : PAGE_PAE_DIRECTORY_SIZE;
+            for (uint32_t t = 0; t < tableCount; t++) {
+                if ((appDirectory[t] & PAGING_PAGE_PRESENT) && MASK_FRAME_64BIT(appDirectory[t]) != 0)
+                    paging_free_app_table_pae(MASK_FRAME_64BIT(appDirectory[t]));
+            }
+            paging_device_free((uintptr_t)appDirectory, (uintptr_t)appDirectory);
+            pmm_push_frame(appDirPhys);
+        }
+        paging_device_free((uintptr_t)appPointerTable, (uintptr_t)appPointerTable);
+    }
+    else {
+        // Standard mode. Tables from the kernel's onwards are shared, including the recursive entry.
+        uint32_t *appPageDir = (uint32_t*)paging_device_alloc(directoryPhys, directoryPhys);
+        for (uint16_t i = 0; i < paging_calculate_table(memInfo.kernelVirtualOffset); i++) {
+            if ((appPageDir[i] & PAGING_PAGE_PRESENT) && MASK_PAGE_4K(appPageDir[i]) != 0)
+                paging_free_app_table_std(MASK_PAGE_4K(appPageDir[i]));
+        }
+        paging_device_free((uintptr_t)appPageDir, (uintptr_t)appPageDir);
+    }
+
+    pmm_push_frame(directoryPhys);
+}
+
 void paging_late_std() {
     kprintf("PAGING: Initializing standard 32-bit paging!\n");
 
@@ -70,6 +70,9 @@ _syscalls_sysenter_handler:
     mov ds, ax
     mov es, ax
     mov fs, ax
+
+    ; Point GS at this processor's data.
+    mov ax, 0x30
     mov gs, ax
 
     ; Push caller's ESP (in ECX), EBP, EAX, EBX, ESI, and EDI to stack.
@@ -148,6 +151,9 @@ _syscalls_interrupt_handler:
     mov ds, ax
     mov es, ax
     mov fs, ax
+
+    ; Point GS at this processor's data.
+    mov ax, 0x30
     mov gs, ax
 
     ; Get caller's ESP from our stack.
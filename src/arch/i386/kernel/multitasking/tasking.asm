@@ -22,6 +22,9 @@
 ; SOFTWARE.
 ;
 
+; Constants. These should match the ones in tasking.h.
+TASKING_YIELD_INTERRUPT equ 0x81
+
 ; 32-bit code.
 [bits 32]
 section .text
@@ -51,3 +54,66 @@ _tasking_thread_exec:
     call tasking_kill_thread
 .loop:
     jmp .loop
+
+; Switches to a thread's stack and returns into it.
+; Args: stack pointer, run queue lock to release once off the old stack.
+extern spinlock_release
+extern _irq_exit
+global _tasking_exec_stack
+_tasking_exec_stack:
+    ; Get args.
+    mov eax, [esp+4]
+    mov edx, [esp+8]
+
+    ; Move to new stack.
+    mov esp, eax
+
+    ; Release run queue lock.
+    push edx
+    call spinlock_release
+    add esp, 4
+
+    ; Restore thread's registers.
+    jmp _irq_exit
+
+; Yield interrupt handler. This calls the handler defined in tasking.c.
+extern tasking_yield_handler
+global _tasking_yield_interrupt
+_tasking_yield_interrupt:
+    ; The processor has already pushed SS, ESP, EFLAGS, CS, and EIP to the stack.
+    ; Push vector, so the frame matches the one IRQs build.
+    push dword TASKING_YIELD_INTERRUPT
+
+    ; Push general registers (EAX, EBX, ECX, EDX, EBP, ESI, and EDI) to stack.
+    push eax
+    push ebx
+    push ecx
+    push edx
+    push ebp
+    push esi
+    push edi
+
+    ; Push segments to stack.
+    push ds
+    push es
+    push fs
+    push gs
+
+    ; Set up kernel segments.
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+
+    ; Point GS at this processor's data.
+    mov ax, 0x30
+    mov gs, ax
+
+    ; Push stack for use in C handler.
+    mov eax, esp
+    push eax
+
+    ; Call yield C handler. If we switched threads, this doesn't return.
+    call tasking_yield_handler
+    pop eax
+    jmp _irq_exit
@@ -23,6 +23,7 @@
 ;
 
 ; Constants. These should match the ones in smp.h.
+SMP_AP_LOCK_ADDRESS equ 0x520
 SMP_GDT32_ADDRESS equ 0x5A0
 SMP_GDT64_ADDRESS equ 0x600
 SMP_PAGING_PML4   equ 0x7000
@@ -49,6 +50,18 @@ _ap_bootstrap_init:
     ; Ensure interrupts are disabled.
     cli
 
+    ; APs are started together but share the real mode and temporary stacks, so only
+    ; one may run the bootstrap at a time. The lock is released once on its own stack.
+    xor ax, ax
+    mov ds, ax
+_ap_bootstrap_lock:
+    lock bts word [SMP_AP_LOCK_ADDRESS], 0
+    jnc _ap_bootstrap_locked
+    pause
+    jmp _ap_bootstrap_lock
+
+_ap_bootstrap_locked:
+
     ; Check if A20 line is enabled.
     call _check_a20
 
@@ -224,12 +237,7 @@ _ap_bootstrap_higherhalf:
     mov rsp, ap_bootstrap_stack_end
     mov rbp, ap_bootstrap_stack_end
 
-    ; Get the ID for this processor's LAPIC. ID is placed in RAX.
-    extern lapic_id
-    call lapic_id
-
-    ; Get stack address. Address is placed in RAX.
-    mov rdi, rax
+    ; Get stack address for this processor. Address is placed in RAX.
     extern smp_ap_get_stack
     call smp_ap_get_stack
 
@@ -238,6 +246,9 @@ _ap_bootstrap_higherhalf:
     add rsp, 0x4000
     mov rbp, rsp
 
+    ; Let the next AP in. Low memory is still identity mapped.
+    mov dword [SMP_AP_LOCK_ADDRESS], 0
+
     ; Pop into C code.
     extern smp_ap_main
     call smp_ap_main
@@ -190,6 +190,11 @@ extern exceptions_handler
 exception_common_stub:
     ; The processor has already pushed SS, RSP, RFLAGS, CS, and RIP to the stack.
     ; The interrupt-specific handler also pushed the interrupt number, and an empty error code if needed.
+    ; Coming from user mode, swap in this processor's GS base.
+    test qword [rsp+24], 3
+    jz .kernel
+    swapgs
+.kernel:
 
     ; Push general registers (RAX, RCX, RDX, RBX, RBP, RSI, and RDI) to stack.
     push rax
@@ -224,7 +229,6 @@ exception_common_stub:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
 
     ; Call C exceptions handler.
     mov rdi, rsp
@@ -232,7 +236,8 @@ exception_common_stub:
 
     ; Restore segments.
     ; DS and ES cannot be directly restored, so we must copy them to RAX first.
-    pop gs
+    ; Skip GS, as loading it would clobber the base swapgs looks after.
+    add rsp, 8
     pop fs
     pop rax
     mov es, ax
@@ -258,6 +263,14 @@ exception_common_stub:
     pop rcx
     pop rax
 
-    ; Move past the error code and exception number, and continue execution.
+    ; Move past the error code and exception number.
     add rsp, 16
+
+    ; Going back to user mode, swap the user's GS base back in.
+    test qword [rsp+8], 3
+    jz .kernel_exit
+    swapgs
+.kernel_exit:
+
+    ; Continue execution.
     iretq
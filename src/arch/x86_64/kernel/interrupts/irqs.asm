@@ -26,16 +26,39 @@
 [bits 64]
 section .text
 
+; Constants. These should match the ones in irqs.h.
+IRQ_VECTOR_FIRST equ 32
+IRQ_VECTOR_COUNT equ 224
+IRQ_STUB_SIZE equ 16
+
 ; Empty IRQ handler for spurious IRQs.
 global _irq_empty
 _irq_empty:
     iretq
 
+; Entry stubs, one for each vector above the exceptions. Each pushes its vector
+; and joins the common handler, so the handler doesn't have to go looking for it.
+global _irq_stubs
+align IRQ_STUB_SIZE
+_irq_stubs:
+%assign vector IRQ_VECTOR_FIRST
+%rep IRQ_VECTOR_COUNT
+    push qword vector
+    jmp _irq_common
+    align IRQ_STUB_SIZE
+%assign vector vector+1
+%endrep
+
 ; IRQ common handler. This calls the handler defined in irqs.c.
 extern irqs_handler
-global _irq_common
 _irq_common:
-    ; The processor has already pushed SS, RSP, RFLAGS, CS, and RIP to the stack.
+    ; The processor has already pushed SS, RSP, RFLAGS, CS, and RIP to the stack, and the stub the vector.
+    ; Coming from user mode, swap in this processor's GS base.
+    test qword [rsp+16], 3
+    jz .kernel
+    swapgs
+.kernel:
+
     ; Push general registers (RAX, RBX, RCX, RDX, RBP, RSI, and RDI) to stack.
     push rax
     push rbx
@@ -55,6 +78,12 @@ _irq_common:
     push r9
     push r8
 
+    ; Timestamp entry with the TSC, passed to the C handler for interrupt statistics.
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov rsi, rax
+
     ; Push segments to stack.
     ; DS and ES cannot be directly pushed, so we must copy them to RAX first.
     mov rax, ds
@@ -69,17 +98,20 @@ _irq_common:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
 
-    ; Call IRQ C handler.
+    ; Call IRQ C handler. The vector leaves the stack misaligned, so realign it for the call.
     mov rdi, rsp
+    mov rbx, rsp
+    and rsp, -16
     call irqs_handler
+    mov rsp, rbx
 
 global _irq_exit
 _irq_exit:
     ; Restore segments.
     ; DS and ES cannot be directly restored, so we must copy them to RAX first.
-    pop gs
+    ; Skip GS, as loading it would clobber the base swapgs looks after.
+    add rsp, 8
     pop fs
     pop rax
     mov es, ax
@@ -105,5 +137,14 @@ _irq_exit:
     pop rbx
     pop rax
 
+    ; Skip vector.
+    add rsp, 8
+
+    ; Going back to user mode, swap the user's GS base back in.
+    test qword [rsp+8], 3
+    jz .kernel
+    swapgs
+.kernel:
+
     ; Continue execution.
     iretq
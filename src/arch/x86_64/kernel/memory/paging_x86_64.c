@@ -147,7 +147,7 @@ void paging_unmap(uintptr_t virtual) {
     paging_flush_tlb_address(virtual);
 }
 
-bool paging_get_phys(uintptr_t virtual, uint64_t *physOut) {
+static bool paging_get_phys_long(uintptr_t virtual, uint64_t *physOut, uint64_t flags) {
     // If the address is canonical, strip off the leading 0xFFFF.
     if (virtual & 0xFFFF000000000000)
         virtual &= 0x0000FFFFFFFFFFFF;
@@ -165,25 +165,25 @@ bool paging_get_phys(uintptr_t virtual, uint64_t *physOut) {
     // If there isn't one, no mapping exists.
     // Pages will never be located at 0x0, so its safe to assume a value of 0 = no directory defined.
     uint64_t* directoryPointerTable = (uint64_t*)PAGE_LONG_PDPT_ADDRESS(pdptIndex);
-    if (MASK_PAGE_4K(pml4Table[pdptIndex]) == 0)
+    if (MASK_PAGE_4K(pml4Table[pdptIndex]) == 0 || (pml4Table[pdptIndex] & flags) != flags)
         return false;
 
     // Get address of directory from PDPT.
     // If there isn't one, no mapping exists.
     // Pages will never be located at 0x0, so its safe to assume a value of 0 = no directory defined.
     uint64_t* directory = (uint64_t*)PAGE_LONG_DIR_ADDRESS(pdptIndex, dirIndex);
-    if (MASK_PAGE_4K(directoryPointerTable[dirIndex]) == 0)
+    if (MASK_PAGE_4K(directoryPointerTable[dirIndex]) == 0 || (directoryPointerTable[dirIndex] & flags) != flags)
         return false;
 
     // Get address of table from directory.
     // If there isn't one, no mapping exists.
     // Pages will never be located at 0x0, so its safe to assume a value of 0 = no table defined.
     uint64_t *table = (uint64_t*)(PAGE_LONG_TABLE_ADDRESS(pdptIndex, dirIndex, tableIndex)); 
-    if (MASK_PAGE_4K(directory[tableIndex]) == 0)
+    if (MASK_PAGE_4K(directory[tableIndex]) == 0 || (directory[tableIndex] & flags) != flags)
         return false;
     
     // Is page present?
-    if (!(table[entryIndex] & PAGING_PAGE_PRESENT))
+    if (!(table[entryIndex] & PAGING_PAGE_PRESENT) || (table[entryIndex] & flags) != flags)
         return false;
 
     // Get address from table.
@@ -191,6 +191,17 @@ bool paging_get_phys(uintptr_t virtual, uint64_t *physOut) {
     return true;
 }
 
+bool paging_get_phys(uintptr_t virtual, uint64_t *physOut) {
+    return paging_get_phys_long(virtual, physOut, 0);
+}
+
+bool paging_get_phys_user(uintptr_t virtual, uint64_t *physOut) {
+    // Only the canonical lower half belongs to user mode, and the page itself must be user accessible.
+    if (virtual >= 0x0000800000000000)
+        return false;
+    return paging_get_phys_long(virtual, physOut, PAGING_PAGE_USER);
+}
+
 uintptr_t paging_create_app_copy(void) {
     // Create a new PML4 table.
     uint64_t appPml4Page = pmm_pop_frame();
@@ -212,6 +223,33 @@ uintptr_t paging_create_app_copy(void) {
     return appPml4Page;
 }
 
+static void paging_free_app_table(uint64_t tablePhys, uint8_t level) {
+    // Only the lower half of the PML4 table belongs to the app, the rest is shared with the kernel.
+    uint64_t *table = (uint64_t*)paging_device_alloc(tablePhys, tablePhys);
+    uint32_t count = (level == 4) ? (PAGE_LONG_STRUCT_SIZE / 2) : PAGE_LONG_STRUCT_SIZE;
+
+    // Free everything below this table. Entries in the last level are the app's own pages.
+    for (uint32_t i = 0; i < count; i++) {
+        if (!(table[i] & PAGING_PAGE_PRESENT) || MASK_FRAME_64BIT(table[i]) == 0)
+            continue;
+        if (level == 1)
+            pmm_push_frame(MASK_FRAME_64BIT(table[i]));
+        else
+            paging_free_app_table(MASK_FRAME_64BIT(table[i]), level - 1);
+    }
+
+    paging_device_free((uintptr_t)table, (uintptr_t)table);
+    pmm_push_frame(tablePhys);
+}
+
+/**
+ * Frees an app's paging structures and the pages mapped into its lower half.
+ * The structure must not be loaded on any processor.
+ */
+void paging_free_app_copy(uintptr_t directoryPhys) {
+    paging_free_app_table(directoryPhys, 4);
+}
+
 /**
  * Sets up 4-level paging.
  */
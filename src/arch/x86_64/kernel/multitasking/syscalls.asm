@@ -76,9 +76,12 @@ _syscalls_syscall:
 
 global _syscalls_syscall_handler
 _syscalls_syscall_handler:
-    ; Disable interrupts.
+    ; Disable interrupts. SFMASK already clears IF on entry, so nothing can come in before GS is swapped.
     cli
 
+    ; SYSCALL only comes from user mode, so swap in this processor's GS base.
+    swapgs
+
     ; Push caller's RIP (in RCX) and RFLAGS (in R11) to caller's stack.
     push rcx
     push r11
@@ -127,7 +130,8 @@ _syscalls_syscall_handler:
     ; Restore caller's RSP.
     pop rsp
 
-    ; Restore control back to the calling code.
+    ; Swap the user's GS base back in and restore control back to the calling code.
+    swapgs
     o64 sysret
 
 global _syscalls_interrupt
@@ -140,6 +144,12 @@ _syscalls_interrupt:
 global _syscalls_interrupt_handler
 _syscalls_interrupt_handler:
     ; The processor has already pushed SS, RSP, RFLAGS, CS, and RIP to the stack.
+    ; Coming from user mode, swap in this processor's GS base.
+    test qword [rsp+8], 3
+    jz .kernel
+    swapgs
+.kernel:
+
     ; Push unused general registers (RBX and RBP) to stack.
     push rbx
     push rbp
@@ -166,7 +176,6 @@ _syscalls_interrupt_handler:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
 
     ; Get caller's RSP from our stack.
     ; 120 = number of bytes to go up stack until we get the RSP that was pushed prior.
@@ -182,7 +191,8 @@ _syscalls_interrupt_handler:
 
     ; Restore segments.
     ; DS and ES cannot be directly restored, so we must copy them to RAX first.
-    pop gs
+    ; Skip GS, as loading it would clobber the base swapgs looks after.
+    add rsp, 8
     pop fs
     pop rbx
     mov es, bx
@@ -201,6 +211,12 @@ _syscalls_interrupt_handler:
     pop rbp
     pop rbx
 
+    ; Going back to user mode, swap the user's GS base back in.
+    test qword [rsp+8], 3
+    jz .kernel_exit
+    swapgs
+.kernel_exit:
+
     ; Continue execution. This restores RIP, CS, RFLAGS, RSP, and SS, and re-enables interrupts.
     ; Return value from handler is in RAX.
     iretq
@@ -22,6 +22,9 @@
 ; SOFTWARE.
 ;
 
+; Constants. These should match the ones in tasking.h.
+TASKING_YIELD_INTERRUPT equ 0x81
+
 ; 64-bit code.
 [bits 64]
 section .text
@@ -49,3 +52,75 @@ _tasking_thread_exec:
     call tasking_kill_thread
 .loop:
     jmp .loop
+
+; Switches to a thread's stack and returns into it.
+; Args: stack pointer, run queue lock to release once off the old stack.
+extern spinlock_release
+extern _irq_exit
+global _tasking_exec_stack
+_tasking_exec_stack:
+    ; Move to new stack.
+    mov rsp, rdi
+
+    ; Release run queue lock.
+    mov rdi, rsi
+    call spinlock_release
+
+    ; Restore thread's registers.
+    jmp _irq_exit
+
+; Yield interrupt handler. This calls the handler defined in tasking.c.
+extern tasking_yield_handler
+global _tasking_yield_interrupt
+_tasking_yield_interrupt:
+    ; The processor has already pushed SS, RSP, RFLAGS, CS, and RIP to the stack.
+    ; Push vector, so the frame matches the one IRQs build.
+    push qword TASKING_YIELD_INTERRUPT
+
+    ; Coming from user mode, swap in this processor's GS base. _irq_exit swaps it back.
+    test qword [rsp+16], 3
+    jz .kernel
+    swapgs
+.kernel:
+
+    ; Push general registers (RAX, RBX, RCX, RDX, RBP, RSI, and RDI) to stack.
+    push rax
+    push rbx
+    push rcx
+    push rdx
+    push rbp
+    push rsi
+    push rdi
+
+    ; Push x64 registers (R15, R14, R13, R12, R11, R10, R9, and R8) to stack.
+    push r15
+    push r14
+    push r13
+    push r12
+    push r11
+    push r10
+    push r9
+    push r8
+
+    ; Push segments to stack.
+    ; DS and ES cannot be directly pushed, so we must copy them to RAX first.
+    mov rax, ds
+    push rax
+    mov rax, es
+    push rax
+    push fs
+    push gs
+
+    ; Set up kernel segments.
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+
+    ; Call yield C handler on an aligned stack. If we switched threads, this doesn't return.
+    mov rdi, rsp
+    mov rbx, rsp
+    and rsp, -16
+    call tasking_yield_handler
+    mov rsp, rbx
+    jmp _irq_exit
@@ -33,6 +33,8 @@
 #include <kernel/memory/kheap.h>
 #include <kernel/memory/pmm.h>
 #include <kernel/interrupts/irqs.h>
+#include <kernel/timer.h>
+#include <kernel/hrtimer.h>
 
 #include <kernel/networking/networking.h>
 
@@ -96,15 +98,14 @@ static inline uint32_t e1000e_phy_read(e1000e_t *e1000eDevice, uint16_t reg) {
     uint32_t mdi = (2 << 26) | (2 << 21) | (reg << 16);
     e1000e_write(e1000eDevice, E1000E_REG_MDIC, mdi);
     
-    // Wait for PHY.
-    uint32_t timeout = 100;
+    // Wait for PHY, polling every 10us for up to 100ms.
+    uint64_t deadline = timer_now_ns() + 100 * TIMER_NS_PER_MS;
     while (!(e1000e_read(e1000eDevice, E1000E_REG_MDIC) & E1000E_PHY_READY)) {
-        if (!timeout) {
+        if (timer_now_ns() >= deadline) {
             kprintf("E1000E: PHY read timeout!\n");
             break;
         }
-        sleep(1);
-        timeout--;
+        hrtimer_sleep(10 * TIMER_NS_PER_US);
     }
     return e1000e_read(e1000eDevice, E1000E_REG_MDIC);
 }
@@ -158,20 +159,16 @@ void e1000e_reset(e1000e_t *e1000eDevice) {
     sleep(20);
 }
 
-static bool e1000e_callback(pci_device_t *pciDevice) {
-    // Get value of interrupt register.
-    uint32_t intReg = e1000e_read((e1000e_t*)pciDevice->DriverObject, E1000E_REG_ICR);
-
-    // If no interrupt bits are set, this device wasn't the one that raised the interrupt.
-    if (intReg == 0)
-        return false;
-
+static void e1000e_interrupt_work(void *context) {
+    // Get interrupt causes saved since the last run.
+    e1000e_t *e1000eDevice = (e1000e_t*)context;
+    uint32_t intReg = __sync_lock_test_and_set(&e1000eDevice->PendingInterrupts, 0);
     kprintf("E1000E: IRQ raised (0x%X)!\n", intReg);
 
     // Link change.
     if (intReg & E1000E_INT_LSC) {
         // Get status register.
-        uint32_t status = e1000e_read((e1000e_t*)pciDevice->DriverObject, E1000E_REG_STATUS);
+        uint32_t status = e1000e_read(e1000eDevice, E1000E_REG_STATUS);
         if (status & E1000E_STATUS_LU) {
             char *speed = "10 Mbps";    
             if (status & E1000E_STATUS_SPEED_100)
@@ -189,12 +186,40 @@ static bool e1000e_callback(pci_device_t *pciDevice) {
     if (intReg & E1000E_INT_RXT0) {
 
     }
+}
+
+static bool e1000e_callback(pci_device_t *pciDevice) {
+    // Get value of interrupt register.
+    e1000e_t *e1000eDevice = (e1000e_t*)pciDevice->DriverObject;
+    uint32_t intReg = e1000e_read(e1000eDevice, E1000E_REG_ICR);
+
+    // If no interrupt bits are set, this device wasn't the one that raised the interrupt.
+    if (intReg == 0)
+        return false;
 
-    // Clear interrupt bits.
-    e1000e_write((e1000e_t*)pciDevice->DriverObject, E1000E_REG_ICR, -1);
+    // Clear interrupt bits, and leave the rest to a worker thread.
+    e1000e_write(e1000eDevice, E1000E_REG_ICR, -1);
+    __sync_fetch_and_or(&e1000eDevice->PendingInterrupts, intReg);
+    workqueue_submit(workqueue_get_system(), &e1000eDevice->InterruptWork);
     return true;
 }
 
+static bool e1000e_msi_callback(pci_device_t *pciDevice, uint16_t index) {
+    // Causes are read back from ICR, so every vector is handled the same way as the line interrupt.
+    return e1000e_callback(pciDevice);
+}
+
+static void e1000e_msix_init(e1000e_t *e1000eDevice, pci_device_t *pciDevice) {
+    // Route each cause to its own vector. If fewer vectors were granted, the remaining causes share the last one.
+    uint32_t last = pciDevice->MessageCount - 1;
+    uint32_t rx = E1000E_MSIX_VECTOR_RX < last ? E1000E_MSIX_VECTOR_RX : last;
+    uint32_t tx = E1000E_MSIX_VECTOR_TX < last ? E1000E_MSIX_VECTOR_TX : last;
+    uint32_t other = E1000E_MSIX_VECTOR_OTHER < last ? E1000E_MSIX_VECTOR_OTHER : last;
+    e1000e_write(e1000eDevice, E1000E_REG_IVAR, ((rx | E1000E_IVAR_VALID) << E1000E_IVAR_RXQ0_SHIFT)
+        | ((tx | E1000E_IVAR_VALID) << E1000E_IVAR_TXQ0_SHIFT) | ((other | E1000E_IVAR_VALID) << E1000E_IVAR_OTHER_SHIFT));
+    e1000e_write(e1000eDevice, E1000E_REG_CTRL_EXT, e1000e_read(e1000eDevice, E1000E_REG_CTRL_EXT) | E1000E_CTRL_EXT_PBA_SUPPORT);
+}
+
 bool e1000e_init(pci_device_t *pciDevice) {
     // Is the PCI device an Intel networking device?
     if (!(pciDevice->Class == PCI_CLASS_NETWORK && pciDevice->Subclass == PCI_SUBCLASS_NETWORK_ETHERNET
@@ -211,6 +236,8 @@ bool e1000e_init(pci_device_t *pciDevice) {
     // Create E1000e object.
     e1000e_t *e1000eDevice = (e1000e_t*)kheap_alloc(sizeof(e1000e_t));
     memset(e1000eDevice, 0, sizeof(e1000e_t));
+    spinlock_set_name(&e1000eDevice->TransmitIndexLock, "e1000e TransmitIndexLock");
+    work_init(&e1000eDevice->InterruptWork, e1000e_interrupt_work, e1000eDevice);
     e1000eDevice->BasePointer = paging_device_alloc(pciDevice->BaseAddresses[0].BaseAddress, pciDevice->BaseAddresses[0].BaseAddress + 0x1F000);
     kprintf("E1000E: Matched %s!\n", e1000eDevices[idIndex].DeviceString);
     
@@ -218,6 +245,12 @@ bool e1000e_init(pci_device_t *pciDevice) {
     pciDevice->DriverObject = e1000eDevice;
     pciDevice->InterruptHandler = e1000e_callback;
 
+    // Use message signalled interrupts if the device supports them, otherwise the shared line is used.
+    // Messages are writes from the device, so it needs to be a bus master.
+    pci_enable_busmaster(pciDevice);
+    if (!pci_enable_msi(pciDevice, E1000E_MSIX_VECTOR_COUNT, e1000e_msi_callback))
+        kprintf("E1000E: Using IRQ %u.\n", pciDevice->InterruptNo);
+
     // REset.
    // uint32_t *bdd = (uint32_t*)(e1000eDevice->BasePointer + 0x00);
   //  *bdd |= (1 << 2);
@@ -231,6 +264,8 @@ bool e1000e_init(pci_device_t *pciDevice) {
     //while (*(uint32_t*)(buffer + 0x05B54) & 0x40);
     kprintf("E1000E: Resetting card...\n");
     e1000e_reset(e1000eDevice);
+    if (pciDevice->InterruptMode == PCI_INTERRUPT_MODE_MSIX)
+        e1000e_msix_init(e1000eDevice, pciDevice);
 
     // Get MAC address.
     e1000e_get_mac_addr(e1000eDevice);
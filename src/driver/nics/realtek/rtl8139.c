@@ -140,6 +140,10 @@ bool rtl8139_send_bytes(rtl8139_t *rtlDevice, const void *data, uint16_t length)
     return true;
 }
 
+static void rtl8139_rx_tasklet(uintptr_t data) {
+    rtl8139_receive_bytes((rtl8139_t*)data);
+}
+
 static bool rtl8139_callback(pci_device_t *dev) {
     // If no interrupts were raised by the card, don't handle it.
     rtl8139_t *rtlDevice = (rtl8139_t*)dev->DriverObject;
@@ -147,16 +151,19 @@ static bool rtl8139_callback(pci_device_t *dev) {
     if (isrStatus == 0)
         return false;
 
-    kprintf("RTL8139: Current interrupt bits: 0x%X\n", isrStatus);
+    // Acknowledge interrupt.
+    outw(rtlDevice->BaseAddress + 0x3E, 0xFFFF);
 
-    // Did we receive a packet?
+    // Copy received packets out of the buffer once the IRQ is done.
     if (isrStatus & RTL8139_INT_ROK)
-        rtl8139_receive_bytes(rtlDevice);
-
-    outw(rtlDevice->BaseAddress + 0x3E, 0xFFFF);
+        tasklet_schedule(&rtlDevice->RxTasklet);
     return true;
 }
 
+static bool rtl8139_msi_callback(pci_device_t *pciDevice, uint16_t index) {
+    return rtl8139_callback(pciDevice);
+}
+
 static bool rtl8139_net_send(net_device_t *netDevice, void *data, uint16_t length) {
     rtl8139_send_bytes((rtl8139_t*)netDevice->Device, data, length);
 }
@@ -174,6 +181,7 @@ bool rtl8139_init(pci_device_t *pciDevice) {
     rtl8139_t *rtlDevice = (rtl8139_t*)kheap_alloc(sizeof(rtl8139_t));
     memset(rtlDevice, 0, sizeof(rtl8139_t));
     rtlDevice->PciDevice = pciDevice;
+    tasklet_init(&rtlDevice->RxTasklet, rtl8139_rx_tasklet, (uintptr_t)rtlDevice);
     pciDevice->DriverObject = rtlDevice;
     kprintf("\e[35mRTL8139: Pointed RTL struct to DriverObject\n");
     pciDevice->InterruptHandler = rtl8139_callback;
@@ -194,6 +202,10 @@ bool rtl8139_init(pci_device_t *pciDevice) {
     pci_enable_busmaster(pciDevice);
     kprintf("RTL8139: Enabled PCI busmastering\n");
 
+    // Use a message signalled interrupt if the card has one.
+    if (pci_enable_msi(pciDevice, 1, rtl8139_msi_callback))
+        kprintf("RTL8139: Using message signalled interrupts.\n");
+
     // Bring card out of low power mode.
     rtl8139_writeb(rtlDevice, RTL8139_REG_CONFIG1, 0x00);
     kprintf("RTL8139: Brought card out of low power mode.\n");
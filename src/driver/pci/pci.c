@@ -27,33 +27,58 @@
 #include <kprint.h>
 #include <driver/pci.h>
 
+#include <kernel/percpu.h>
 #include <kernel/memory/kheap.h>
+#include <kernel/memory/paging.h>
 #include <kernel/interrupts/ioapic.h>
+#include <kernel/interrupts/smp.h>
 #include <driver/vga.h>
 
 #include <kernel/interrupts/irqs.h>
+#include <kernel/multitasking/rcu.h>
 
 #include <acpi.h>
 
 // PCI devices.
 pci_device_t *PciDevices = NULL;
 
-static bool pci_irq_callback(irq_regs_t *regs, uint8_t irqNum) {
-    kprintf("PCI: IRQ %u raised!\n", irqNum);
+// Devices using message signalled interrupts, by IRQ. Each vector belongs to one device.
+typedef struct {
+    pci_device_t *Device;
+    uint16_t Index;
+} pci_msi_irq_t;
+static pci_msi_irq_t pciMsiIrqs[IRQ_VECTOR_COUNT];
 
-    // Call handlers of devices that are on the raised IRQ, until the IRQ is handled.
-    pci_device_t *pciDevice = PciDevices;
+// Next processor to target a message signalled interrupt at.
+static uint32_t pciMsiNextProc = 0;
+
+// Lines that have the PCI IRQ thread installed.
+static bool pciIrqsInstalled[IRQ_MAX_COUNT];
+
+static void pci_irq_thread(uint8_t irqNum) {
+    // Call handlers of devices that are on the raised IRQ, until the IRQ is handled. This runs in the
+    // IRQ's thread with the line masked, so device handlers can take their time.
+    rcu_read_lock();
+    pci_device_t *pciDevice = rcu_dereference(PciDevices);
     while (pciDevice != NULL) {
-        // Ensure device's IRQ matches and there is an interrupt handler.
-        if (pciDevice->InterruptNo == irqNum) {
-            kprintf("Checking device %X:%X, status: 0x%X\n", pciDevice->VendorId, pciDevice->DeviceId, pci_config_read_word(pciDevice, PCI_REG_STATUS));
+        // Ensure device's IRQ matches, it is still using the line, and there is an interrupt handler.
+        if (pciDevice->InterruptNo == irqNum && pciDevice->InterruptMode == PCI_INTERRUPT_MODE_INTX) {
             if ((pciDevice->InterruptHandler != NULL) && pciDevice->InterruptHandler(pciDevice))
-                return true;
+                break;
         }
 
         // Move to next device.
-        pciDevice = pciDevice->Next;
+        pciDevice = rcu_dereference(pciDevice->Next);
     }
+    rcu_read_unlock();
+}
+
+static bool pci_msi_callback(irq_regs_t *regs, uint8_t irqNum, uint32_t procIndex) {
+    // The vector maps straight to its device, no other devices need checking.
+    pci_device_t *pciDevice = pciMsiIrqs[irqNum].Device;
+    if (pciDevice == NULL || pciDevice->MessageHandler == NULL)
+        return false;
+    return pciDevice->MessageHandler(pciDevice, pciMsiIrqs[irqNum].Index);
 }
 
 uint32_t pci_config_read_dword(pci_device_t *pciDevice, uint8_t reg) {
@@ -117,6 +142,187 @@ void pci_enable_busmaster(pci_device_t *pciDevice) {
     pci_config_write_word(pciDevice, PCI_REG_COMMAND, pci_config_read_word(pciDevice, PCI_REG_COMMAND) | PCI_CMD_BUSMASTER);
 }
 
+uint8_t pci_find_capability(pci_device_t *pciDevice, uint8_t capId) {
+    // Ensure device has a capabilities list.
+    if (!(pci_config_read_word(pciDevice, PCI_REG_STATUS) & PCI_STATUS_CAPABILITIES))
+        return 0;
+
+    // Walk list until the capability is found. The count guards against malformed lists that loop.
+    uint8_t offset = pci_config_read_byte(pciDevice, PCI_REG_CAPABILITIES) & 0xFC;
+    for (uint8_t i = 0; offset != 0 && i < PCI_CAP_MAX_COUNT; i++) {
+        if (pci_config_read_byte(pciDevice, offset + PCI_CAP_REG_ID) == capId)
+            return offset;
+        offset = pci_config_read_byte(pciDevice, offset + PCI_CAP_REG_NEXT) & 0xFC;
+    }
+    return 0;
+}
+
+static bool pci_msi_get_target(uint32_t *procIndexOut) {
+    // Spread vectors across processors. Processors whose APIC ID doesn't fit in a message address are skipped.
+    uint32_t procCount = smp_get_proc_count();
+    for (uint32_t i = 0; i < procCount; i++) {
+        percpu_t *percpu = percpu_get_proc(pciMsiNextProc++ % procCount);
+        if (percpu != NULL && percpu->ApicId <= PCI_MSI_DEST_MAX) {
+            *procIndexOut = percpu->Index;
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline uint32_t pci_msi_address(uint32_t procIndex) {
+    // Get message address targeting processor.
+    return PCI_MSI_ADDRESS_BASE | (percpu_get_proc(procIndex)->ApicId << PCI_MSI_ADDRESS_DEST_SHIFT);
+}
+
+static volatile uint32_t *pci_msix_map_table(pci_device_t *pciDevice, uint16_t tableSize) {
+    // Get BAR and offset the table is in.
+    uint32_t table = pci_config_read_dword(pciDevice, pciDevice->MsixCapability + PCI_MSIX_REG_TABLE);
+    pci_base_register_t *bar = &pciDevice->BaseAddresses[table & PCI_MSIX_TABLE_BIR_MASK];
+    if (bar->PortMapped || bar->BaseAddress == 0)
+        return NULL;
+
+    // Map table.
+    uint64_t tablePhys = (uint64_t)bar->BaseAddress + (table & ~PCI_MSIX_TABLE_BIR_MASK);
+    uint64_t tableEndPhys = tablePhys + (tableSize * PCI_MSIX_ENTRY_SIZE) - 1;
+    return (volatile uint32_t*)((uintptr_t)paging_device_alloc(MASK_PAGE_4K(tablePhys), MASK_PAGE_4K(tableEndPhys))
+        + MASK_PAGEFLAGS_4K(tablePhys));
+}
+
+static bool pci_msi_route(uint8_t irq, uint32_t procIndex) {
+    // Ensure processor can be targeted.
+    pci_device_t *pciDevice = pciMsiIrqs[irq].Device;
+    percpu_t *percpu = percpu_get_proc(procIndex);
+    if (pciDevice == NULL || percpu == NULL || percpu->ApicId > PCI_MSI_DEST_MAX)
+        return false;
+
+    // Rewrite message address. MSI-X entries are masked while they change.
+    uint16_t index = pciMsiIrqs[irq].Index;
+    if (pciDevice->InterruptMode == PCI_INTERRUPT_MODE_MSIX) {
+        volatile uint32_t *entry = pciDevice->MsixTable + (index * (PCI_MSIX_ENTRY_SIZE / sizeof(uint32_t)));
+        entry[PCI_MSIX_ENTRY_CONTROL] |= PCI_MSIX_ENTRY_MASKED;
+        entry[PCI_MSIX_ENTRY_ADDRESS] = pci_msi_address(procIndex);
+        entry[PCI_MSIX_ENTRY_CONTROL] &= ~PCI_MSIX_ENTRY_MASKED;
+    }
+    else
+        pci_config_write_dword(pciDevice, pciDevice->MsiCapability + PCI_MSI_REG_ADDRESS, pci_msi_address(procIndex));
+    pciDevice->MessageVectors[index].ProcessorIndex = procIndex;
+    return true;
+}
+
+uint16_t pci_enable_msi(pci_device_t *pciDevice, uint16_t count, pci_msi_handler_t handler) {
+    // Only one set of vectors can be in use.
+    if (pciDevice->InterruptMode != PCI_INTERRUPT_MODE_INTX || count == 0 || handler == NULL)
+        return 0;
+
+    // Prefer MSI-X, which has a table entry for each vector. Multiple MSI messages need an aligned block
+    // of vectors all going to the same processor, so only one is used there.
+    uint8_t mode;
+    uint16_t tableSize = 0;
+    if (pciDevice->MsixCapability) {
+        mode = PCI_INTERRUPT_MODE_MSIX;
+        tableSize = (pci_config_read_word(pciDevice, pciDevice->MsixCapability + PCI_MSIX_REG_CONTROL) & PCI_MSIX_CONTROL_SIZE_MASK) + 1;
+        if (count > tableSize)
+            count = tableSize;
+        pciDevice->MsixTable = pci_msix_map_table(pciDevice, tableSize);
+        if (pciDevice->MsixTable == NULL)
+            return 0;
+    }
+    else if (pciDevice->MsiCapability) {
+        mode = PCI_INTERRUPT_MODE_MSI;
+        count = 1;
+    }
+    else
+        return 0;
+
+    // Allocate vectors and install handlers on the processors they target.
+    pci_msi_vector_t *vectors = (pci_msi_vector_t*)kheap_alloc(sizeof(pci_msi_vector_t) * count);
+    memset(vectors, 0, sizeof(pci_msi_vector_t) * count);
+    pciDevice->MessageHandler = handler;
+    uint16_t allocated = 0;
+    while (allocated < count) {
+        uint32_t procIndex;
+        if (!pci_msi_get_target(&procIndex))
+            break;
+        uint8_t vector = irqs_alloc_vector();
+        if (vector == 0)
+            break;
+
+        vectors[allocated].Vector = vector;
+        vectors[allocated].ProcessorIndex = procIndex;
+        pciMsiIrqs[vector - IRQ_OFFSET].Device = pciDevice;
+        pciMsiIrqs[vector - IRQ_OFFSET].Index = allocated;
+        irqs_install_handler_proc(vector - IRQ_OFFSET, pci_msi_callback, procIndex);
+        allocated++;
+    }
+
+    // If nothing could be allocated, leave device on its interrupt line.
+    if (allocated == 0) {
+        kheap_free(vectors);
+        pciDevice->MessageHandler = NULL;
+        if (pciDevice->MsixTable != NULL) {
+            paging_device_free(MASK_PAGE_4K((uintptr_t)pciDevice->MsixTable),
+                MASK_PAGE_4K((uintptr_t)pciDevice->MsixTable + (tableSize * PCI_MSIX_ENTRY_SIZE) - 1));
+            pciDevice->MsixTable = NULL;
+        }
+        return 0;
+    }
+
+    if (mode == PCI_INTERRUPT_MODE_MSIX) {
+        // Enable with all vectors masked while the table is filled in.
+        uint8_t cap = pciDevice->MsixCapability;
+        pci_config_write_word(pciDevice, cap + PCI_MSIX_REG_CONTROL,
+            pci_config_read_word(pciDevice, cap + PCI_MSIX_REG_CONTROL) | PCI_MSIX_CONTROL_ENABLE | PCI_MSIX_CONTROL_MASK_ALL);
+
+        // Program table. Entries not in use stay masked.
+        for (uint16_t i = 0; i < tableSize; i++) {
+            volatile uint32_t *entry = pciDevice->MsixTable + (i * (PCI_MSIX_ENTRY_SIZE / sizeof(uint32_t)));
+            if (i < allocated) {
+                entry[PCI_MSIX_ENTRY_ADDRESS] = pci_msi_address(vectors[i].ProcessorIndex);
+                entry[PCI_MSIX_ENTRY_ADDRESS_HIGH] = 0;
+                entry[PCI_MSIX_ENTRY_DATA] = vectors[i].Vector;
+                entry[PCI_MSIX_ENTRY_CONTROL] &= ~PCI_MSIX_ENTRY_MASKED;
+            }
+            else
+                entry[PCI_MSIX_ENTRY_CONTROL] |= PCI_MSIX_ENTRY_MASKED;
+        }
+
+        // Unmask function.
+        pci_config_write_word(pciDevice, cap + PCI_MSIX_REG_CONTROL,
+            pci_config_read_word(pciDevice, cap + PCI_MSIX_REG_CONTROL) & ~PCI_MSIX_CONTROL_MASK_ALL);
+    }
+    else {
+        // Program message address and data. Data sits after the high address on 64-bit capable devices.
+        uint8_t cap = pciDevice->MsiCapability;
+        uint16_t control = pci_config_read_word(pciDevice, cap + PCI_MSI_REG_CONTROL);
+        pci_config_write_dword(pciDevice, cap + PCI_MSI_REG_ADDRESS, pci_msi_address(vectors[0].ProcessorIndex));
+        if (control & PCI_MSI_CONTROL_64BIT) {
+            pci_config_write_dword(pciDevice, cap + PCI_MSI_REG_ADDRESS_HIGH, 0);
+            pci_config_write_word(pciDevice, cap + PCI_MSI_REG_DATA64, vectors[0].Vector);
+        }
+        else
+            pci_config_write_word(pciDevice, cap + PCI_MSI_REG_DATA32, vectors[0].Vector);
+
+        // Enable a single message.
+        pci_config_write_word(pciDevice, cap + PCI_MSI_REG_CONTROL, (control & ~PCI_MSI_CONTROL_MULTI_MASK) | PCI_MSI_CONTROL_ENABLE);
+    }
+
+    // Stop device from asserting its interrupt line.
+    pci_config_write_word(pciDevice, PCI_REG_COMMAND, pci_config_read_word(pciDevice, PCI_REG_COMMAND) | PCI_CMD_INTX_DISABLE);
+    pciDevice->MessageVectors = vectors;
+    pciDevice->MessageCount = allocated;
+    pciDevice->InterruptMode = mode;
+
+    // Vectors can now be moved between processors.
+    for (uint16_t i = 0; i < allocated; i++)
+        irqs_set_route(vectors[i].Vector - IRQ_OFFSET, pci_msi_route, vectors[i].ProcessorIndex);
+
+    for (uint16_t i = 0; i < allocated; i++)
+        kprintf("PCI: %4X:%4X %s vector %u is 0x%X on processor %u.\n", pciDevice->VendorId, pciDevice->DeviceId,
+            mode == PCI_INTERRUPT_MODE_MSIX ? "MSI-X" : "MSI", i, vectors[i].Vector, vectors[i].ProcessorIndex);
+    return allocated;
+}
+
 /**
  * Print the description for a PCI device
  * @param dev PCIDevice struct with PCI device info
@@ -139,6 +345,8 @@ void pci_print_info(pci_device_t *pciDevice) {
     if(pciDevice->InterruptNo != 0) { 
         kprintf("  - Interrupt %u (Pin %u Line %u\e[0m\n", pciDevice->InterruptNo, pciDevice->InterruptPin, pciDevice->InterruptLine);
     }
+    if (pciDevice->MsiCapability || pciDevice->MsixCapability)
+        kprintf("  - Message signalled interrupts:%s%s\e[0m\n", pciDevice->MsiCapability ? " MSI" : "", pciDevice->MsixCapability ? " MSI-X" : "");
 }
 
 /**
@@ -185,6 +393,8 @@ pci_device_t *pci_get_device(uint8_t bus, uint8_t device, uint8_t function, ACPI
     // Get interrupt info.
     pciDevice->InterruptPin = pci_config_read_byte(pciDevice, PCI_REG_INTERRUPT_PIN);
     pciDevice->InterruptLine = pci_config_read_byte(pciDevice, PCI_REG_INTERRUPT_LINE);
+    pciDevice->MsiCapability = pci_find_capability(pciDevice, PCI_CAP_ID_MSI);
+    pciDevice->MsixCapability = pci_find_capability(pciDevice, PCI_CAP_ID_MSIX);
 
     // Get base address registers.
     for (uint8_t i = 0; i < PCI_BAR_COUNT; i++) {
@@ -234,24 +444,29 @@ pci_device_t *pci_get_device(uint8_t bus, uint8_t device, uint8_t function, ACPI
 }
 
 static void pci_add_device(pci_device_t *pciDevice, pci_device_t *parentPciDevice) {
+    // Publish device at the end of the list. Devices are only added during enumeration, so there's only one writer.
     pciDevice->Parent = parentPciDevice;
     if (PciDevices != NULL) {
         pci_device_t *lastDevice = PciDevices;
         while (lastDevice->Next != NULL)
             lastDevice = lastDevice->Next;
-        lastDevice->Next = pciDevice;
+        rcu_assign_pointer(lastDevice->Next, pciDevice);
     }
     else
-        PciDevices = pciDevice;
+        rcu_assign_pointer(PciDevices, pciDevice);
 
     // Enable interrupt.
-    if ((pciDevice->InterruptNo > 0) && !(irqs_handler_mapped(pciDevice->InterruptNo, pci_irq_callback))) {
+    if ((pciDevice->InterruptNo > 0) && !pciIrqsInstalled[pciDevice->InterruptNo]) {
         // Open up the interrupt in the APIC if needed.
         if (pciDevice->InterruptNo >= IRQ_ISA_COUNT)
             ioapic_enable_interrupt_pci(ioapic_remap_interrupt(pciDevice->InterruptNo), IRQ_OFFSET + pciDevice->InterruptNo);
 
-        // Install our PCI handler for the IRQ. This handler calls device handlers as required.
-        irqs_install_handler(pciDevice->InterruptNo, pci_irq_callback);
+        // Install our PCI handler for the IRQ. Device handlers are called from its thread as required, and
+        // there's no top half as only the device handlers know how to check for and acknowledge their devices.
+        pciIrqsInstalled[pciDevice->InterruptNo] = true;
+        irqs_install_threaded(pciDevice->InterruptNo, NULL, pci_irq_thread, "pci_irq");
+        if (pciDevice->InterruptNo >= IRQ_ISA_COUNT)
+            irqs_set_route(pciDevice->InterruptNo, irqs_route_ioapic, percpu_index());
     }
 }
 
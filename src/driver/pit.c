@@ -59,6 +59,18 @@ void pit_startcounter(uint32_t freq, uint8_t counter, uint8_t mode) {
 	}
 }
 
+// Starts channel 2 counting down once, to time a 1/freq second window without interrupts.
+void pit_oneshot_start(uint32_t freq) {
+	// Enable the gate, but keep the speaker disconnected.
+	outb(PIT_PORT_SPEAKER, (inb(PIT_PORT_SPEAKER) & ~PIT_SPEAKER_DATA) | PIT_SPEAKER_GATE2);
+	pit_startcounter(freq, PIT_CMD_COUNTER2, PIT_CMD_MODE_TERMINALCOUNT);
+}
+
+// Returns true once channel 2 has counted down.
+bool pit_oneshot_expired(void) {
+	return (inb(PIT_PORT_SPEAKER) & PIT_SPEAKER_OUT2) != 0;
+}
+
 // Initialize the PIT.
 void pit_init(void) {
 	// Start main timer at 1 tick = 1 ms.
@@ -236,8 +236,9 @@ static bool ps2_keyboard_callback(irq_regs_t *regs, uint8_t irqNum)
         }
     }
     else { // Make code.
-        // Save key.
+        // Save key and wake anyone waiting for input.
         lastKeyCode = key;
+        keyboard_input_signal();
 
         // Handle special keys.
         switch (key) {
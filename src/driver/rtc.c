@@ -106,5 +106,5 @@ void rtc_init() {
 	rtc_get_time();
 
 	// Add poll thread.
-	tasking_thread_schedule_proc(tasking_thread_create_kernel("rtc_worker", rtc_thread, 0, 0, 0), 0);
+	tasking_thread_schedule(tasking_thread_create_kernel("rtc_worker", rtc_thread, 0, 0, 0));
 }
\ No newline at end of file
@@ -28,6 +28,9 @@
 #include <string.h>
 #include <driver/serial.h>
 
+#include <libs/keyboard.h>
+#include <kernel/interrupts/irqs.h>
+
 #define PORT 0x3f8   /* COM1 */
 
 static bool serialPresent = true;
@@ -71,6 +74,20 @@ int is_transmit_empty() {
    return inb(SERIAL_REG_LSR(PORT)) & SERIAL_LSR_EMPTY_TRANS_HOLDING;
 }
  
+// Writes a byte as-is, for binary data.
+void serial_write_byte(uint8_t b) {
+   while (is_transmit_empty() == 0) { };
+
+   outb(PORT,b);
+}
+
+// Writes a buffer as-is, for binary data.
+void serial_write_bytes(const void *data, size_t length) {
+   const uint8_t *bytes = (const uint8_t*)data;
+   for (size_t i = 0; i < length; i++)
+      serial_write_byte(bytes[i]);
+}
+
 void serial_write(char a) {
   while (is_transmit_empty() == 0) { };
  
@@ -98,4 +115,22 @@ char serial_read() {
    while (serial_received() == 0);
  
    return inb(PORT);
+}
+
+// Callback for COM1 on IRQ4.
+static bool serial_callback(irq_regs_t *regs, uint8_t irqNum, uint32_t procIndex) {
+    // Data is left in the FIFO for the reader, which drains it before waiting again.
+    if (serial_received() == 0)
+        return false;
+    keyboard_input_signal();
+    return true;
+}
+
+void serial_enable_interrupts() {
+    if (!serialPresent)
+        return;
+
+    // Only received data raises an interrupt. The line drops once the FIFO is read empty.
+    irqs_install_handler(IRQ_COM1, serial_callback);
+    outb(SERIAL_REG_IER(PORT), SERIAL_IER_DATA_AVAILABLE);
 }
\ No newline at end of file
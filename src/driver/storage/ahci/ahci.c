@@ -32,6 +32,8 @@
 #include <kernel/memory/kheap.h>
 #include <driver/storage/storage.h>
 #include <kernel/memory/paging.h>
+#include <kernel/timer.h>
+#include <kernel/hrtimer.h>
 #include <driver/pci.h>
 
 #include <driver/storage/ata/ata.h>
@@ -113,16 +115,15 @@ static bool ahci_port_reset(ahci_port_t *ahciPort) {
     portMemory->SataControl.DeviceDetectionInitialization = AHCI_SATA_STATUS_DETECT_INIT_NO_ACTION;
 
     // Wait for port to be ready.
-    uint32_t timeout = 1000;
+    uint64_t deadline = timer_now_ns() + 1000 * TIMER_NS_PER_MS;
     while (portMemory->SataStatus.Data.DeviceDetection != AHCI_SATA_STATUS_DETECT_CONNECTED) {
         // Was the timeout reached?
-        if (timeout == 0) {
+        if (timer_now_ns() >= deadline) {
             kprintf("AHCI: Timeout waiting for port %u to reset!\n", ahciPort->Number);
             return false;
         }
 
-        sleep(1);
-        timeout--;
+        hrtimer_sleep(100 * TIMER_NS_PER_US);
     }
 
     // Restart port.
@@ -132,17 +133,16 @@ static bool ahci_port_reset(ahci_port_t *ahciPort) {
     portMemory->SataError.RawValue = -1;
 
     // Wait for device to be ready.
-    timeout = 1000;
+    deadline = timer_now_ns() + 1000 * TIMER_NS_PER_MS;
     while (portMemory->TaskFileData.Status.Data.Busy || portMemory->TaskFileData.Status.Data.DataRequest
         || portMemory->TaskFileData.Status.Data.Error) {
         // Was the timeout reached?
-        if (timeout == 0) {
+        if (timer_now_ns() >= deadline) {
             kprintf("AHCI: Timeout waiting for driver on port %u to be ready!\n", ahciPort->Number);
             return false;
         }
 
-        sleep(1);
-        timeout--;
+        hrtimer_sleep(100 * TIMER_NS_PER_US);
     }
     return true;
 }
@@ -200,6 +200,26 @@ static bool ahci_take_ownership(ahci_controller_t *ahciController) {
     return true;
 }
 
+static bool ahci_callback(pci_device_t *pciDevice) {
+    // Get ports with pending interrupts. If there are none, this controller didn't raise the interrupt.
+    ahci_controller_t *ahciController = (ahci_controller_t*)pciDevice->DriverObject;
+    uint32_t pending = ahciController->Memory->InterruptStatus;
+    if (pending == 0)
+        return false;
+
+    // Clear port status first, as the global bits are set again while a port still has status pending.
+    for (uint32_t port = 0; port < ahciController->PortCount; port++) {
+        if (pending & (1 << port))
+            ahciController->Memory->Ports[port].InterruptsStatus.RawValue = ahciController->Memory->Ports[port].InterruptsStatus.RawValue;
+    }
+    ahciController->Memory->InterruptStatus = pending;
+    return true;
+}
+
+static bool ahci_msi_callback(pci_device_t *pciDevice, uint16_t index) {
+    return ahci_callback(pciDevice);
+}
+
 bool ahci_init(pci_device_t *pciDevice) {
     // ICheck that the device is an AHCI controller, and that the BAR is correct.
     if (!(pciDevice->Class == PCI_CLASS_MASS_STORAGE && pciDevice->Subclass == PCI_SUBCLASS_MASS_STORAGE_SATA && pciDevice->Interface == PCI_INTERFACE_MASS_STORAGE_SATA_VENDOR_AHCI))
@@ -231,6 +251,14 @@ bool ahci_init(pci_device_t *pciDevice) {
     // Enable AHCI on controller.
     ahciController->Memory->GlobalControl.AhciEnabled = true;
 
+    // Register interrupt handler, using a message signalled interrupt if the controller has one.
+    pciDevice->DriverObject = ahciController;
+    pciDevice->InterruptHandler = ahci_callback;
+    pci_enable_busmaster(pciDevice);
+    if (pci_enable_msi(pciDevice, 1, ahci_msi_callback))
+        kprintf("AHCI: Using message signalled interrupts.\n");
+    ahciController->Memory->GlobalControl.InterruptsEnabled = true;
+
     // Get port count and create port pointer array.
     ahciController->PortCount = ahciController->Memory->Capabilities.Data.PortCount + 1;
     ahciController->Ports = (ahci_port_t**)kheap_alloc(sizeof(ahci_port_t*) * ahciController->PortCount);
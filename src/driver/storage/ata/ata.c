@@ -58,13 +58,13 @@ int16_t ata_check_status(ata_channel_t *channel, bool master) {
     return ATA_CHK_STATUS_OK;
 }
 
-static bool ata_callback_isa(irq_regs_t *regs, uint8_t irqNum) {
+static void ata_irq_thread_isa(uint8_t irqNum) {
+    // Runs in the IRQ's thread, the channel's waiter reads status which acknowledges the drive.
     kprintf("ATA: ISA IRQ%u raised!\n", irqNum);
     if (irqNum == IRQ_PRI_ATA)
-        isaPrimary->InterruptTriggered = true;
+        semaphore_signal(&isaPrimary->InterruptSemaphore, 1);
     else if (irqNum == IRQ_SEC_ATA)
-        isaSecondary->InterruptTriggered = true;
-    return true;
+        semaphore_signal(&isaSecondary->InterruptSemaphore, 1);
 }
 
 static bool ata_callback_pci(pci_device_t *device) {
@@ -77,7 +77,7 @@ static bool ata_callback_pci(pci_device_t *device) {
         if (ataDevice->Primary.BusMasterCapable) {
             // Check if interrupt bit is set.
             if (inb(ataDevice->Primary.BusMasterStatusPort) & ATA_PCI_BUSMASTER_STATUS_INTERRUPT)
-                ataDevice->Primary.InterruptTriggered = true;
+                semaphore_signal(&ataDevice->Primary.InterruptSemaphore, 1);
 
             // Reset interrupt bit.
             outb(ataDevice->Primary.BusMasterStatusPort, ATA_PCI_BUSMASTER_STATUS_INTERRUPT);
@@ -87,7 +87,7 @@ static bool ata_callback_pci(pci_device_t *device) {
         if (ataDevice->Secondary.BusMasterCapable) {
             // Check if interrupt bit is set.
             if (inb(ataDevice->Secondary.BusMasterStatusPort) & ATA_PCI_BUSMASTER_STATUS_INTERRUPT)
-                ataDevice->Secondary.InterruptTriggered = true;
+                semaphore_signal(&ataDevice->Secondary.InterruptSemaphore, 1);
 
             // Reset interrupt bit.
             outb(ataDevice->Secondary.BusMasterStatusPort, ATA_PCI_BUSMASTER_STATUS_INTERRUPT);
@@ -102,29 +102,12 @@ static bool ata_callback_pci(pci_device_t *device) {
 }
 
 int16_t ata_wait_for_irq(ata_channel_t *channel, bool master) {
-    // Wait until IRQ is triggered or we time out.
-    uint16_t timeout = 200;
-	bool ret = false;
-	while (!channel->InterruptTriggered) {
-		if(!timeout)
-			break;
-		timeout--;
-		sleep(10);
-	}
-
-	// Did we hit the IRQ?
-
-	if(channel->InterruptTriggered)
-		ret = true;
-	else
-		kprintf("ATA: IRQ timeout for channel 0x%X!\n", channel->CommandPort);
-
-	// Reset triggered value.
-	channel->InterruptTriggered = false;
-	if (ret)
-        return ata_check_status(channel, master);
-    else
+    // Block until IRQ is triggered or we time out.
+    if (!semaphore_wait(&channel->InterruptSemaphore, 1, ATA_IRQ_TIMEOUT)) {
+        kprintf("ATA: IRQ timeout for channel 0x%X!\n", channel->CommandPort);
         return -1;
+    }
+    return ata_check_status(channel, master);
 }
 
 uint16_t ata_read_data_word(uint16_t portCommand) {
@@ -451,6 +434,10 @@ bool ata_init(pci_device_t *pciDevice) {
     kprintf("ATA: Primary channel mode: %s\n", pi & ATA_PCI_PIF_PRI_NATIVE_MODE ? "native" : "compatibility");
     kprintf("ATA: Secondary channel mode: %s\n", pi & ATA_PCI_PIF_SEC_NATIVE_MODE ? "native" : "compatibility");
 
+    // Only one IRQ can be outstanding per channel.
+    semaphore_init(&ataDevice->Primary.InterruptSemaphore, 0, 1);
+    semaphore_init(&ataDevice->Secondary.InterruptSemaphore, 0, 1);
+
     // Get primary channel ports.
     if ((pi & ATA_PCI_PIF_PRI_NATIVE_MODE) && pciDevice->BaseAddresses[0].PortMapped && pciDevice->BaseAddresses[0].BaseAddress != 0
         && pciDevice->BaseAddresses[1].PortMapped && pciDevice->BaseAddresses[1].BaseAddress != 0) {
@@ -464,10 +451,8 @@ bool ata_init(pci_device_t *pciDevice) {
         ataDevice->Primary.ControlPort = ATA_PRI_CONTROL_PORT;
         ataDevice->Primary.Interrupt = IRQ_PRI_ATA;
         isaPrimary = &ataDevice->Primary;
-        irqs_install_handler(IRQ_PRI_ATA, ata_callback_isa);
+        irqs_install_threaded(IRQ_PRI_ATA, NULL, ata_irq_thread_isa, "ata_irq");
     }
-    ataDevice->Primary.InterruptTriggered = false;
-
     // Get secondary channel ports.
     if ((pi & ATA_PCI_PIF_SEC_NATIVE_MODE) && pciDevice->BaseAddresses[2].PortMapped && pciDevice->BaseAddresses[2].BaseAddress != 0
         && pciDevice->BaseAddresses[3].PortMapped && pciDevice->BaseAddresses[3].BaseAddress != 0) {
@@ -481,10 +466,8 @@ bool ata_init(pci_device_t *pciDevice) {
         ataDevice->Secondary.ControlPort = ATA_SEC_CONTROL_PORT;
         ataDevice->Secondary.Interrupt = IRQ_SEC_ATA;
         isaSecondary = &ataDevice->Secondary;
-        irqs_install_handler(IRQ_SEC_ATA, ata_callback_isa);
+        irqs_install_threaded(IRQ_SEC_ATA, NULL, ata_irq_thread_isa, "ata_irq");
     }
-    ataDevice->Secondary.InterruptTriggered = false;
-
     // Print ports.
     kprintf("ATA: Primary channel ports: 0x%X and 0x%X\n", ataDevice->Primary.CommandPort, ataDevice->Primary.ControlPort);
     kprintf("ATA: Secondary channel ports: 0x%X and 0x%X\n", ataDevice->Secondary.CommandPort, ataDevice->Secondary.ControlPort);
@@ -34,8 +34,9 @@
 #include <kernel/memory/paging.h>
 #include <kernel/memory/kheap.h>
 #include <kernel/interrupts/irqs.h>
+#include <kernel/multitasking/sync.h>
 
-static bool irqTriggered = false;
+static semaphore_t irqSemaphore;
 static bool implied_seeks = false;
 
 extern bool floppy_init_dma();
@@ -47,8 +48,8 @@ static char *driveTypes[6] = { "no floppy drive", "360KB 5.25\" floppy drive",
  * Handles IRQ6 firings
  */
 static bool floppy_callback(irq_regs_t* regs, uint8_t irq) {
-	// Set our trigger value.
-	irqTriggered = true;
+	// Wake up anyone waiting on the IRQ.
+	semaphore_signal(&irqSemaphore, 1);
 	return true;
 }
 
@@ -57,24 +58,12 @@ static bool floppy_callback(irq_regs_t* regs, uint8_t irq) {
  * @return True if the IRQ was triggered; otherwise false if it timed out.
  */
 bool floppy_wait_for_irq(uint16_t timeout) {
-	// Wait until IRQ is triggered or we time out.
-	uint8_t ret = false;
-	while (!irqTriggered) {
-		if(!timeout)
-			break;
-		timeout--;
-		sleep(10);
-	}
+	// Block until IRQ is triggered or we time out. Timeout is in 10ms units.
+	if (semaphore_wait(&irqSemaphore, 1, timeout * 10))
+		return true;
 
-	// Did we hit the IRQ?
-	if(irqTriggered)
-		ret = true;
-	else
-		kprintf("FLOPPY: IRQ timeout!\n");
-
-	// Reset triggered value.
-	irqTriggered = false;
-	return ret;
+	kprintf("FLOPPY: IRQ timeout!\n");
+	return false;
 }
 
 
@@ -554,7 +543,8 @@ bool floppy_init(void) {
 		return false;
 	}
 
-	// Install hander for IRQ6.
+	// Install hander for IRQ6. Only one IRQ can be outstanding at a time.
+	semaphore_init(&irqSemaphore, 0, 1);
 	irqs_install_handler(FLOPPY_IRQ, floppy_callback);
 
 	// Reset controller and get version.
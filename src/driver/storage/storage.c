@@ -27,24 +27,29 @@
 #include <kprint.h>
 #include <driver/storage/storage.h>
 
+#include <kernel/lock.h>
 #include <kernel/memory/kheap.h>
+#include <kernel/multitasking/rcu.h>
 
-// Storage device list.
+// Storage device list. Readers walk it under RCU, the lock only serializes registration.
 storage_device_t *storageDevices;
+static lock_t storageDevicesLock = LOCK_INIT_NAMED(LOCK_TYPE_SPIN, "storageDevicesLock");
 
 void storage_register(storage_device_t *device) {
-
+    // Links are set up before the device is published.
+    spinlock_lock(&storageDevicesLock);
     if (storageDevices != NULL) {
         // Add device to end of list.
         device->Next = storageDevices;
-        storageDevices->Prev->Next = device;
         device->Prev = storageDevices->Prev;
+        rcu_assign_pointer(storageDevices->Prev->Next, device);
         storageDevices->Prev = device;
     }
     else {
         // First device.
-        storageDevices = device;
-        storageDevices->Next = storageDevices;
-        storageDevices->Prev = storageDevices;
+        device->Next = device;
+        device->Prev = device;
+        rcu_assign_pointer(storageDevices, device);
     }
+    spinlock_release(&storageDevicesLock);
 }
\ No newline at end of file
@@ -96,8 +96,10 @@ void usb_keyboard_boop(void) {
     usb_keyboard_input_report_t report = {};
     while (true) {
         if (usb_uhci_device_interrupt_in_poll(usbKeyboard->Device, usbKeyboard->DataEndpoint, &report, sizeof(usb_keyboard_input_report_t))) {
-            if (report.Keycode1 >= USB_KEYBOARD_KEY_A)
+            if (report.Keycode1 >= USB_KEYBOARD_KEY_A) {
                 usbKeyboard->LastKeyCode = UsbKeyboardScancodes[report.Keycode1];
+                keyboard_input_signal();
+            }
             else 
                 usbKeyboard->LastKeyCode = KEYBOARD_KEY_UNKNOWN;
             // Handle LEDs.
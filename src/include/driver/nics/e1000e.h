@@ -28,6 +28,7 @@
 #include <main.h>
 #include <kernel/lock.h>
 #include <driver/pci.h>
+#include <kernel/multitasking/workqueue.h>
 
 #define E1000E_VENDOR_ID                0x8086
 
@@ -60,6 +61,7 @@
 #define E1000E_REG_IMS          0x000D0
 #define E1000E_REG_IMC          0x000D8
 #define E1000E_REG_IAM          0x000E0
+#define E1000E_REG_IVAR         0x000E4
 #define E1000E_REG_RCTL         0x00100
 #define E1000E_REG_RCTL1        0x00104
 #define E1000E_REG_ERT          0x02008
@@ -247,6 +249,21 @@
 #define E1000E_INT_EPRST        (1 << 20) // ME reset event.
 #define E1000E_INT_ASSERTED     (1 << 31) // Interrupt Asserted.
 
+// Extended control bits.
+#define E1000E_CTRL_EXT_PBA_SUPPORT (1 << 31) // PBA support, required for MSI-X.
+
+// Interrupt vector allocation bits. Each cause takes a 3-bit MSI-X vector index and a valid bit.
+#define E1000E_IVAR_VALID           (1 << 3)
+#define E1000E_IVAR_RXQ0_SHIFT      0
+#define E1000E_IVAR_TXQ0_SHIFT      8
+#define E1000E_IVAR_OTHER_SHIFT     16
+
+// MSI-X vectors used, one each for receive, transmit and other causes.
+#define E1000E_MSIX_VECTOR_RX       0
+#define E1000E_MSIX_VECTOR_TX       1
+#define E1000E_MSIX_VECTOR_OTHER    2
+#define E1000E_MSIX_VECTOR_COUNT    3
+
 
 
 
@@ -304,6 +321,10 @@ typedef struct {
 
     lock_t TransmitIndexLock;
     uint8_t CurrentTransmitDesc;
+
+    // Interrupt causes saved by the IRQ handler, for the work item to handle.
+    volatile uint32_t PendingInterrupts;
+    work_item_t InterruptWork;
 } e1000e_t;
 
 extern bool e1000e_init(pci_device_t *pciDevice);
@@ -28,6 +28,7 @@
 #include <main.h>
 #include <driver/pci.h>
 #include <kernel/networking/networking.h>
+#include <kernel/interrupts/softirq.h>
 
 // Registers
 #define RTL8139_REG_IDR0    0x00
@@ -133,6 +134,9 @@ typedef struct {
 
     bool UsesEeprom;
 
+    // Empties the receive buffer outside of the IRQ handler.
+    tasklet_t RxTasklet;
+
     // Network stack object.
     net_device_t *NetDevice;
 } rtl8139_t;
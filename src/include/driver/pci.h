@@ -84,6 +84,56 @@
 #define PCI_BAR_PREFETCHABLE		0x8
 
 #define PCI_CMD_BUSMASTER           0x04
+#define PCI_CMD_INTX_DISABLE        0x400
+
+#define PCI_STATUS_CAPABILITIES     0x10
+
+// Capability list. Each capability starts with its ID and a pointer to the next one.
+#define PCI_CAP_REG_ID              0x00 // 1
+#define PCI_CAP_REG_NEXT            0x01 // 1
+#define PCI_CAP_MAX_COUNT           48
+
+#define PCI_CAP_ID_MSI              0x05
+#define PCI_CAP_ID_MSIX             0x11
+
+// MSI capability registers, relative to the capability.
+#define PCI_MSI_REG_CONTROL         0x02 // 2
+#define PCI_MSI_REG_ADDRESS         0x04 // 4
+#define PCI_MSI_REG_ADDRESS_HIGH    0x08 // 4
+#define PCI_MSI_REG_DATA32          0x08 // 2
+#define PCI_MSI_REG_DATA64          0x0C // 2
+
+#define PCI_MSI_CONTROL_ENABLE      0x0001
+#define PCI_MSI_CONTROL_MULTI_MASK  0x0070
+#define PCI_MSI_CONTROL_64BIT       0x0080
+
+// MSI-X capability registers, relative to the capability.
+#define PCI_MSIX_REG_CONTROL        0x02 // 2
+#define PCI_MSIX_REG_TABLE          0x04 // 4
+
+#define PCI_MSIX_CONTROL_SIZE_MASK  0x07FF
+#define PCI_MSIX_CONTROL_MASK_ALL   0x4000
+#define PCI_MSIX_CONTROL_ENABLE     0x8000
+#define PCI_MSIX_TABLE_BIR_MASK     0x7
+
+// MSI-X table entries, as 32-bit words.
+#define PCI_MSIX_ENTRY_SIZE         16
+#define PCI_MSIX_ENTRY_ADDRESS      0
+#define PCI_MSIX_ENTRY_ADDRESS_HIGH 1
+#define PCI_MSIX_ENTRY_DATA         2
+#define PCI_MSIX_ENTRY_CONTROL      3
+#define PCI_MSIX_ENTRY_MASKED       0x1
+
+// Message address targeting a LAPIC. Only 8 bits of destination APIC ID fit.
+#define PCI_MSI_ADDRESS_BASE        0xFEE00000
+#define PCI_MSI_ADDRESS_DEST_SHIFT  12
+#define PCI_MSI_DEST_MAX            0xFF
+
+enum {
+    PCI_INTERRUPT_MODE_INTX     = 0,
+    PCI_INTERRUPT_MODE_MSI      = 1,
+    PCI_INTERRUPT_MODE_MSIX     = 2
+};
 
 typedef struct {
     bool PortMapped;
@@ -93,6 +143,15 @@ typedef struct {
     uint32_t BaseAddress;
 } pci_base_register_t;
 
+// Message signalled interrupt vector, and the processor it is targeted at.
+typedef struct {
+    uint8_t Vector;
+    uint32_t ProcessorIndex;
+} pci_msi_vector_t;
+
+struct pci_device_t;
+typedef bool (*pci_msi_handler_t)(struct pci_device_t *pciDevice, uint16_t index);
+
 // PCI device structure.
 typedef struct pci_device_t {
     // Relations to other devices.
@@ -124,6 +183,17 @@ typedef struct pci_device_t {
     // Actual interrupt number in use by device.
     uint8_t InterruptNo;
 
+    // Message signalled interrupt capabilities, 0 if not present.
+    uint8_t MsiCapability;
+    uint8_t MsixCapability;
+
+    // Message signalled interrupts in use, if any. The handler is passed the index of the vector raised.
+    uint8_t InterruptMode;
+    uint16_t MessageCount;
+    pci_msi_vector_t *MessageVectors;
+    volatile uint32_t *MsixTable;
+    pci_msi_handler_t MessageHandler;
+
     // Interrupt handler.
     bool (*InterruptHandler)(struct pci_device_t *pciDevice);
     void *DriverObject;
@@ -151,6 +221,8 @@ extern void pci_config_write_word(pci_device_t *pciDevice, uint8_t reg, uint16_t
 extern void pci_config_write_byte(pci_device_t *pciDevice, uint8_t reg, uint8_t value);
 
 extern void pci_enable_busmaster(pci_device_t *pciDevice);
+extern uint8_t pci_find_capability(pci_device_t *pciDevice, uint8_t capId);
+extern uint16_t pci_enable_msi(pci_device_t *pciDevice, uint16_t count, pci_msi_handler_t handler);
 
 extern void pci_init(void);
 
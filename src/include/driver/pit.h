@@ -32,7 +32,15 @@ enum {
     PIT_PORT_CHANNEL0               = 0x40, // Channel 0 port (read/write). Tied to IRQ0.
     PIT_PORT_CHANNEL1               = 0x41, // Channel 1 port (read/write). Tied to DRAM (doesn't exist now).
     PIT_PORT_CHANNEL2               = 0x42, // Channel 2 port (read/write). Tied to PC speaker.
-    PIT_PORT_COMMAND                = 0x43  // Mode/command register (write only).
+    PIT_PORT_COMMAND                = 0x43, // Mode/command register (write only).
+    PIT_PORT_SPEAKER                = 0x61  // Keyboard controller port B, holds channel 2 gate and output.
+};
+
+// Port B bits for channel 2.
+enum {
+    PIT_SPEAKER_GATE2               = 0x01, // Channel 2 gate.
+    PIT_SPEAKER_DATA                = 0x02, // Speaker data enable.
+    PIT_SPEAKER_OUT2                = 0x20  // Channel 2 output (read only).
 };
 
 // PIT counters.
@@ -77,6 +85,8 @@ enum {
 #define PIT_BASE_FREQ 1193182
 
 extern void pit_startcounter(uint32_t freq, uint8_t counter, uint8_t mode);
+extern void pit_oneshot_start(uint32_t freq);
+extern bool pit_oneshot_expired(void);
 extern void pit_init(void);
 
 #endif
@@ -37,6 +37,14 @@
 #define SERIAL_REG_MSR(port)        (port+6)
 #define SERIAL_REG_SCRATCH(port)    (port+7)
 
+// Interrupt Enable Register bits.
+enum {
+    SERIAL_IER_DATA_AVAILABLE           = 0x01, // Received data available.
+    SERIAL_IER_TRANS_EMPTY              = 0x02, // Transmitter holding register empty.
+    SERIAL_IER_LINE_STATUS              = 0x04, // Receiver line status.
+    SERIAL_IER_MODEM_STATUS             = 0x08  // Modem status.
+};
+
 // Modem Control Register bits.
 enum {
     SERIAL_MCR_FORCE_DATA_TERMINAL      = 0x01, // Force Data Terminal Ready.
@@ -74,7 +82,11 @@ enum {
 extern bool serial_present();
 extern void serial_init();
 extern void serial_write(char a);
+extern void serial_write_byte(uint8_t b);
+extern void serial_write_bytes(const void *data, size_t length);
 extern void serial_writes(const char* data);
+extern int serial_received();
 extern char serial_read();
+extern void serial_enable_interrupts();
 
 #endif
\ No newline at end of file
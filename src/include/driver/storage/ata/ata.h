@@ -27,6 +27,7 @@
 
 #include <main.h>
 #include <driver/pci.h>
+#include <kernel/multitasking/sync.h>
 
 // Primary PATA interface ports.
 #define ATA_PRI_COMMAND_PORT    0x1F0
@@ -101,6 +102,9 @@ enum {
 #define ATA_CHK_STATUS_DEVICE_MISMATCH  -10
 #define ATA_CHK_STATUS_ERROR            1
 
+// Time in milliseconds to wait for a channel IRQ.
+#define ATA_IRQ_TIMEOUT                 2000
+
 
 
 // PCI ATA controller bits
@@ -127,7 +131,7 @@ typedef struct {
     uint16_t CommandPort;
     uint16_t ControlPort;
     uint8_t Interrupt;
-    bool InterruptTriggered;
+    semaphore_t InterruptSemaphore;
 
     bool BusMasterCapable;
     uint16_t BusMasterCommandPort;
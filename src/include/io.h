@@ -7,6 +7,7 @@ extern uint8_t inb(uint16_t);
 extern void io_wait();
 extern uint64_t cpu_msr_read(uint32_t msr);
 extern void cpu_msr_write(uint32_t msr, uint64_t value);
+extern uint64_t cpu_tsc_read(void);
 
 extern void outw(uint16_t port, uint16_t data);
 extern uint16_t inw(uint16_t);
@@ -36,12 +36,15 @@ enum cpuid_requests {
   CPUID_GETSERIAL,
   CPUID_GETTHREAD,
   CPUID_GETEXTENDEDFEATURES,
+  CPUID_GETXSAVESTATE=0xD,
+  CPUID_GETTSCFREQUENCY=0x15,
  
   CPUID_INTELEXTENDED=0x80000000,
   CPUID_INTELFEATURES,
   CPUID_INTELBRANDSTRING,
   CPUID_INTELBRANDSTRINGMORE,
   CPUID_INTELBRANDSTRINGEND,
+  CPUID_INTELADVANCEDPOWER=0x80000007,
 };
 
 enum {
@@ -200,7 +203,10 @@ enum {
     CPUID_FEAT_ECX_BPEXT        = 1 << 26, // Data breakpoint extensions.
     CPUID_FEAT_ECX_PTSC         = 1 << 27, // Performance TSC.
     CPUID_FEAT_ECX_PERFCTR_L2   = 1 << 28, // L2I perf counter extensions.
-    CPUID_FEAT_ECX_MWAITX       = 1 << 29  // MWAIT extensions.
+    CPUID_FEAT_ECX_MWAITX       = 1 << 29, // MWAIT extensions.
+
+    // Advanced power management features.
+    CPUID_FEAT_EDX_INVARIANT_TSC= 1 << 8   // TSC runs at a constant rate in all power states.
 };
 
 extern bool cpuid_query(uint32_t function, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx);
@@ -32,7 +32,7 @@
 #define GDT32_ENTRIES 5
 #define GDT64_ENTRIES 7
 #else
-#define GDT32_ENTRIES 6
+#define GDT32_ENTRIES 7
 #endif
 
 #define GDT_PRIVILEGE_KERNEL    0x0
@@ -103,6 +103,11 @@ typedef struct {
 
 #define GDT_TSS_INDEX           5
 
+// On 32-bit, GS uses its own segment based at the processor's per-CPU data.
+#ifndef X86_64
+#define GDT_PERCPU_INDEX        6
+#endif
+
 // GDT offsets. SYSCALL requires user code to be after user data for some reason.
 #define GDT_NULL_OFFSET         (uint8_t)(GDT_NULL_INDEX * sizeof(gdt_entry_t))
 #define GDT_KERNEL_CODE_OFFSET  (uint8_t)(GDT_KERNEL_CODE_INDEX * sizeof(gdt_entry_t))
@@ -110,6 +115,9 @@ typedef struct {
 #define GDT_USER_DATA_OFFSET    (uint8_t)(GDT_USER_DATA_INDEX * sizeof(gdt_entry_t))
 #define GDT_USER_CODE_OFFSET    (uint8_t)(GDT_USER_CODE_INDEX * sizeof(gdt_entry_t))
 #define GDT_TSS_OFFSET          (uint8_t)(GDT_TSS_INDEX * sizeof(gdt_entry_t))
+#ifndef X86_64
+#define GDT_PERCPU_OFFSET       (uint8_t)(GDT_PERCPU_INDEX * sizeof(gdt_entry_t))
+#endif
 
 extern gdt_entry_t *gdt_get_bsp32(void);
 #ifdef X86_64
@@ -127,6 +135,9 @@ extern gdt_entry_t *gdt_get(void);
 extern tss_t *gdt_tss_get(void);
 
 extern void gdt_fill(gdt_entry_t gdt[], bool is64Bits, tss_t *tss);
+#ifndef X86_64
+extern void gdt_set_percpu(gdt_entry_t gdt[], uintptr_t base, uint32_t size);
+#endif
 extern void gdt_init_bsp(void);
 
 #endif
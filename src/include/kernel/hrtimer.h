@@ -0,0 +1,101 @@
+/*
+ * File: hrtimer.h
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef HRTIMER_H
+#define HRTIMER_H
+
+#include <main.h>
+#include <kernel/lock.h>
+
+// Timer wheel slots, one per tick. Timers further out than this share slots with nearer ones.
+#define HRTIMER_WHEEL_SLOTS     256
+
+#define HRTIMER_HEAP_SIZE       16
+#define HRTIMER_NO_PROCESSOR    0xFFFFFFFF
+#define HRTIMER_NO_DEADLINE     0xFFFFFFFFFFFFFFFF
+
+// Timer flags.
+enum {
+    HRTIMER_FLAG_PRECISE    = 0x1, // Keep in the heap and fire at the exact deadline, instead of rounding up to the next tick.
+    HRTIMER_FLAG_HARD       = 0x2  // Run callback from the timer interrupt instead of the timer softirq.
+};
+
+// Timer states.
+enum {
+    HRTIMER_STATE_IDLE      = 0,
+    HRTIMER_STATE_WHEEL     = 1,
+    HRTIMER_STATE_HEAP      = 2,
+    HRTIMER_STATE_EXPIRED   = 3  // Waiting for its callback to be run.
+};
+
+struct hrtimer_t;
+typedef void (*hrtimer_func_t)(struct hrtimer_t *timer, void *arg);
+
+// Timer owned by the caller. Deadlines are in nanoseconds since boot, as returned by timer_now_ns().
+typedef struct hrtimer_t {
+    struct hrtimer_t *Next;
+    struct hrtimer_t *Prev;
+    uint64_t Deadline;
+    hrtimer_func_t Func;
+    void *Arg;
+    uint8_t Flags;
+
+    // Processor whose base holds the timer, and its wheel slot or position in the heap plus one.
+    volatile uint32_t ProcessorIndex;
+    uint32_t Index;
+    volatile uint8_t State;
+} hrtimer_t;
+
+// Per-processor timer base. Timers are added to the base of the processor that adds them.
+typedef struct {
+    lock_t Lock;
+
+    // Wheel of coarse timers, by deadline tick. WheelTick is the last tick processed.
+    hrtimer_t *Wheel[HRTIMER_WHEEL_SLOTS];
+    uint64_t WheelTick;
+    uint32_t WheelCount;
+    uint64_t WheelEarliest;
+
+    // Min-heap of precise timers, ordered by deadline.
+    hrtimer_t **Heap;
+    uint32_t HeapCount;
+    uint32_t HeapCapacity;
+
+    // Expired timers waiting for the interrupt or softirq to run them, and the timer whose callback is running.
+    hrtimer_t *HardExpired;
+    hrtimer_t *SoftExpired;
+    hrtimer_t *volatile Running;
+} hrtimer_base_t;
+
+extern void hrtimer_setup(hrtimer_t *timer, hrtimer_func_t func, void *arg, uint8_t flags);
+extern bool hrtimer_add(hrtimer_t *timer, uint64_t deadlineNs);
+extern bool hrtimer_rearm(hrtimer_t *timer, uint64_t intervalNs);
+extern bool hrtimer_cancel(hrtimer_t *timer);
+extern bool hrtimer_pending(hrtimer_t *timer);
+extern uint64_t hrtimer_next_deadline(uint32_t procIndex);
+extern void hrtimer_sleep(uint64_t ns);
+extern void hrtimer_run(uint32_t procIndex);
+extern void hrtimer_init(void);
+
+#endif
@@ -28,6 +28,35 @@
 #include <main.h>
 #include <kernel/interrupts/idt.h>
 
+// Interrupt flag in FLAGS.
+#define INTERRUPTS_FLAG 0x200
+
+// Saves the interrupt flag and disables interrupts. Unlike interrupts_disable(), these don't print,
+// so they are safe for hot paths.
+static inline uintptr_t interrupts_save_disable(void) {
+    uintptr_t flags;
+#ifdef X86_64
+    asm volatile ("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+#else
+    asm volatile ("pushfl; pop %0; cli" : "=r"(flags) : : "memory");
+#endif
+    return flags & INTERRUPTS_FLAG;
+}
+
+// Enables interrupts again if they were on when saved.
+static inline void interrupts_restore(uintptr_t flags) {
+    if (flags)
+        asm volatile ("sti" : : : "memory");
+}
+
+static inline void interrupts_enable_quiet(void) {
+    asm volatile ("sti" : : : "memory");
+}
+
+static inline void interrupts_disable_quiet(void) {
+    asm volatile ("cli" : : : "memory");
+}
+
 extern void interrupts_enable(void);
 extern void interrupts_disable(void);
 extern bool interrupts_enabled(void);
@@ -37,6 +37,9 @@
 #define IOAPIC_REG_ARB      0x02
 #define IOAPIC_REG_REDTBL   0x10
 
+// Highest APIC ID a redirection entry can target in physical mode.
+#define IOAPIC_DEST_MAX     0xFF
+
 // Delivery mode.
 enum IOAPIC_DELIVERY_MODE {
     IOAPIC_DELIVERY_FIXED   = 0x0,
@@ -102,6 +105,11 @@ extern uint8_t ioapic_id(void);
 extern uint8_t ioapic_version(void);
 extern uint8_t ioapic_max_interrupts(void);
 extern void ioapic_enable_interrupt(uint8_t interrupt, uint8_t vector);
+extern void ioapic_enable_interrupt_pci(uint8_t interrupt, uint8_t vector);
+extern void ioapic_set_destination(uint8_t interrupt, uint8_t apicId);
+extern void ioapic_set_masked(uint8_t interrupt, bool masked);
+extern bool ioapic_is_level_triggered(uint8_t interrupt);
+extern void ioapic_disable_interrupt(uint8_t interrupt);
 extern void ioapic_init(void);
 
 #endif
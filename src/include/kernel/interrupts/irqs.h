@@ -27,10 +27,27 @@
 
 #include <main.h>
 #include <kernel/interrupts/idt.h>
+#include <kernel/multitasking/rcu.h>
+#include <kernel/interrupts/smpcall.h>
 
 #define IRQ_OFFSET      32
 #define IRQ_ISA_COUNT       16
 
+// Vectors with entry stubs, which is everything above the exceptions. Each stub is the same size.
+#define IRQ_VECTOR_FIRST    IRQ_OFFSET
+#define IRQ_VECTOR_COUNT    (256 - IRQ_OFFSET)
+#define IRQ_STUB_SIZE       16
+
+// I/O APIC inputs are kept below the system call vector.
+#define IRQ_MAX_COUNT       (0x80 - IRQ_OFFSET)
+
+// Vectors handed out on demand, for message signalled interrupts. These sit above the system call vectors.
+#define IRQ_VECTOR_DYNAMIC_FIRST    0x90
+#define IRQ_VECTOR_DYNAMIC_LAST     0xEF
+
+// Vectors for inter-processor interrupts. These sit above any I/O APIC input and below the spurious vector.
+#define IRQ_VECTOR_IPI_CALL     0xF0
+
 // Common IRQs.
 // https://wiki.osdev.org/Interrupts#General_IBM-PC_Compatible_Interrupt_Information
 enum {
@@ -98,6 +115,9 @@ typedef struct {
     // Base, data, counter, and accumulator registers.
     uintptr_t DX, CX, BX, AX;
 
+    // Vector the interrupt came in on, pushed by the entry stub.
+    uintptr_t Vector;
+
     // Instruction pointer and code segment.
     uintptr_t IP, CS;
 
@@ -111,23 +131,54 @@ typedef struct {
 
 typedef bool (*irq_handler_func_t)(irq_regs_t *regs, uint8_t irqNum, uint32_t procIndex);
 
+// Bottom half of a threaded IRQ, run in the IRQ's own kernel thread with interrupts enabled.
+typedef void (*irq_thread_func_t)(uint8_t irqNum);
+
+// Priority of the threads running threaded IRQ bottom halves.
+#define IRQ_THREAD_PRIORITY     TASKING_PRIORITY_HIGHEST
+
+// Thread state for a threaded IRQ handler.
+struct irq_thread_t;
+
 typedef struct irq_handler_t {
     // Pointer to next handler.
     struct irq_handler_t *Next;
 
-    // Handler function.
+    // Handler function. For threaded handlers this is the optional top half.
     irq_handler_func_t HandlerFunc;
 
+    // Thread the bottom half runs in, or NULL if the handler runs entirely in the IRQ.
+    struct irq_thread_t *Thread;
+
     // Processor index the handler belongs to.
     uint32_t ProcessorIndex;
+
+    // Used to free the handler once no IRQ can still be walking past it.
+    rcu_head_t Rcu;
 } irq_handler_t;
 
+// Moves delivery of an IRQ to a processor. Returns false if the processor can't be targeted.
+typedef bool (*irq_route_func_t)(uint8_t irq, uint32_t procIndex);
+
 extern uint8_t irqs_get_count(void);
 extern bool irqs_irq_executing(void);
 extern void irqs_eoi(uint8_t irq);
+extern uint8_t irqs_alloc_vector(void);
+extern void irqs_free_vector(uint8_t vector);
+extern uint64_t irqs_get_irq_count(uint8_t irq);
+
+extern bool irqs_route_ioapic(uint8_t irq, uint32_t procIndex);
+extern void irqs_set_route(uint8_t irq, irq_route_func_t routeFunc, uint32_t procIndex);
+extern bool irqs_routable(uint8_t irq);
+extern bool irqs_set_target(uint8_t irq, uint32_t procIndex);
+extern uint32_t irqs_get_target(uint8_t irq);
+extern bool irqs_set_affinity(uint8_t irq, smp_cpumask_t mask);
+extern smp_cpumask_t irqs_get_affinity(uint8_t irq);
+extern void irqs_print_affinity(void);
 
 extern void irqs_install_handler_proc(uint8_t irq, irq_handler_func_t handlerFunc, uint32_t procIndex);
 extern void irqs_install_handler(uint8_t irq, irq_handler_func_t handlerFunc);
+extern void irqs_install_threaded(uint8_t irq, irq_handler_func_t topHalfFunc, irq_thread_func_t threadFunc, char *name);
 extern void irqs_remove_handler_proc(uint8_t irq, irq_handler_func_t handlerFunc, uint32_t procIndex);
 extern void irqs_remove_handler(uint8_t irq, irq_handler_func_t handlerFunc);
 extern bool irqs_handler_mapped_proc(uint8_t irq, irq_handler_func_t handlerFunc, uint32_t procIndex);
@@ -0,0 +1,82 @@
+/*
+ * File: irqstat.h
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef IRQSTAT_H
+#define IRQSTAT_H
+
+#include <main.h>
+#include <kernel/interrupts/irqs.h>
+
+#define IRQSTAT_EXPORT_MAGIC    "SYDIRQST"
+#define IRQSTAT_EXPORT_VERSION  1
+
+// Statistics for a vector on one processor. Cycles are from entry into _irq_common until the handlers are done and EOI is sent.
+// Count never goes backwards, as IRQ balancing works on its deltas. A reset only moves CountAtReset up to it.
+typedef struct {
+    volatile uint64_t Count;
+    uint64_t CountAtReset;
+    uint64_t HandlerCycles;
+    uint64_t MaxHandlerCycles;
+} irqstat_vector_t;
+
+// Per-processor statistics. Only written by its own processor with interrupts off.
+typedef struct {
+    uint64_t EntryTsc;
+    uint16_t EntryIrq;
+    bool InIrq;
+    irqstat_vector_t Vectors[IRQ_VECTOR_COUNT];
+} irqstat_proc_t;
+
+// Header that starts a serial export. Each processor follows as an export_proc header and its records, for vectors that fired.
+typedef struct {
+    char Magic[8];
+    uint32_t Version;
+    uint32_t ProcessorCount;
+    uint64_t TscPerMs;
+    uint32_t RecordSize;
+    uint32_t IrqOffset;
+} __attribute__((packed)) irqstat_export_header_t;
+
+typedef struct {
+    uint32_t Processor;
+    uint32_t RecordCount;
+} __attribute__((packed)) irqstat_export_proc_t;
+
+typedef struct {
+    uint32_t Vector;
+    uint32_t Reserved;
+    uint64_t Count;
+    uint64_t HandlerCycles;
+    uint64_t MaxHandlerCycles;
+} __attribute__((packed)) irqstat_export_record_t;
+
+extern void irqstat_enter(uint32_t procIndex, uint8_t irq, uint64_t entryTsc);
+extern void irqstat_exit(uint32_t procIndex);
+extern uint64_t irqstat_get_count(uint8_t irq);
+extern void irqstat_reset(void);
+extern void irqstat_print(void);
+extern void irqstat_export(void);
+extern void irqstat_init(void);
+
+#endif
@@ -39,6 +39,11 @@
 #define IA32_APIC_BASE_MSR              0x1B
 #define IA32_APIC_BASE_MSR_X2APIC       0x400
 #define IA32_APIC_BASE_MSR_ENABLE       0x800
+#define IA32_TSC_DEADLINE_MSR           0x6E0
+
+// In x2APIC mode each register is an MSR, at the MMIO offset divided by 16.
+#define IA32_X2APIC_MSR_BASE            0x800
+#define IA32_X2APIC_MSR(reg)            (IA32_X2APIC_MSR_BASE + ((reg) >> 4))
 
 // LAPIC registers.
 #define LAPIC_REG_ID                    0x20
@@ -184,18 +189,26 @@ typedef struct {
 
 extern bool lapic_supported(void);
 extern bool lapic_x2apic(void);
+extern bool lapic_x2apic_enabled(void);
 extern bool lapic_enabled(void);
-extern void lapic_send_init(uint8_t apic);
-extern void lapic_send_startup(uint8_t apic, uint8_t vector);
-
-extern uint32_t lapic_timer_get_rate(void);
+extern void lapic_send_init(uint32_t apic);
+extern void lapic_send_startup(uint32_t apic, uint8_t vector);
+extern void lapic_send_init_all(void);
+extern void lapic_send_startup_all(uint8_t vector);
+extern void lapic_send_ipi(uint32_t apic, uint8_t vector);
+
+extern void lapic_timer_count_start(void);
+extern uint32_t lapic_timer_count_stop(void);
 extern void lapic_timer_start(uint32_t rate);
+extern void lapic_timer_start_oneshot(bool tscDeadline);
+extern void lapic_timer_arm(uint32_t count);
+extern void lapic_timer_arm_deadline(uint64_t tsc);
 
 extern uint32_t lapic_id(void);
 extern uint8_t lapic_version(void);
 extern uint8_t lapic_max_lvt(void);
 extern void lapic_eoi(void);
-extern int16_t lapic_get_irq(void);
+extern void lapic_mode_init(void);
 extern void lapic_setup(void);
 extern void lapic_init(void);
 
@@ -33,6 +33,10 @@
 #define PIC2_CMD        0xA0
 #define PIC2_DATA       0xA1
 
+// Edge/level control registers, one bit per IRQ. Set bits are level triggered.
+#define PIC_ELCR1       0x4D0
+#define PIC_ELCR2       0x4D1
+
 // PIC commands.
 #define PIC_CMD_8086    0x01
 #define PIC_CMD_IRR     0x0A
@@ -44,6 +48,8 @@
 extern void pic_enable(void);
 extern void pic_disable(void);
 
+extern void pic_set_masked(uint8_t irq, bool masked);
+extern bool pic_is_level_triggered(uint8_t irq);
 extern void pic_eoi(uint32_t irq);
 extern uint16_t pic_get_irr(void);
 extern uint16_t pic_get_isr(void);
@@ -29,6 +29,7 @@
 
 #define SMP_PAGING_ADDRESS          0x500
 #define SMP_PAGING_PAE_ADDRESS      0x510
+#define SMP_AP_LOCK_ADDRESS         0x520
 #define SMP_GDT32_ADDRESS           0x5A0
 #define SMP_GDT64_ADDRESS           0x600
 #define SMP_PAGING_PML4             0x7000
@@ -37,6 +38,9 @@
 
 #define SMP_AP_STACK_SIZE           0x4000
 
+// How long to wait for all APs to come up.
+#define SMP_AP_START_TIMEOUT        1000
+
 // Struct for mapping APIC IDs to a 0-based index.
 typedef struct smp_proc_t {
     // Link to next processor.
@@ -47,11 +51,12 @@ typedef struct smp_proc_t {
     uint32_t Index;
 
     // Set once processor is started up.
-    bool Started;
+    volatile bool Started;
 } smp_proc_t;
 
 extern uint32_t smp_get_proc_count(void);
 extern smp_proc_t *smp_get_proc(uint32_t apicId);
+extern smp_proc_t *smp_get_proc_index(uint32_t index);
 extern void smp_init(void);
 
 #endif
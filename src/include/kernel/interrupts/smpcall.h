@@ -0,0 +1,82 @@
+/*
+ * File: smpcall.h
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SMPCALL_H
+#define SMPCALL_H
+
+#include <main.h>
+
+// Masks of processor indexes. Processors past the end of the mask can only be reached with the single and all-processor calls.
+typedef uint64_t smp_cpumask_t;
+#define SMP_CPUMASK_MAX         64
+#define SMP_CPUMASK(index)      (1ULL << (index))
+
+typedef void (*smp_call_func_t)(uintptr_t data);
+
+// Request queued on a target processor. Each sender owns one slot for every target, so no
+// allocation is needed, and a slot is only reused once the target has taken the previous request.
+typedef struct smp_call_slot_t {
+    struct smp_call_slot_t *Next;
+    smp_call_func_t Func;
+    uintptr_t Data;
+
+    // Remaining targets for a synchronous call, or NULL if the sender isn't waiting.
+    volatile uint32_t *Pending;
+
+    // TSC when queued, for latency statistics.
+    uint64_t QueuedTsc;
+
+    // Set from queueing until the target has taken the request.
+    volatile bool Busy;
+} smp_call_slot_t;
+
+typedef struct {
+    // Requests waiting to run, newest first. Requests queued before the IPI is taken run off a single IPI.
+    smp_call_slot_t *volatile Queue;
+
+    // This processor's slots for sending, one for each target.
+    smp_call_slot_t *Slots;
+
+    // Set once the processor can take call IPIs.
+    volatile bool Online;
+
+    // Statistics.
+    uint64_t CallsSent;
+    uint64_t IpisSent;
+    uint64_t CallsRun;
+    uint64_t IpisReceived;
+    uint64_t LatencyCycles;
+    uint64_t MaxLatencyCycles;
+} smp_call_proc_t;
+
+extern bool smp_call_function_single(uint32_t procIndex, smp_call_func_t func, uintptr_t data, bool wait);
+extern void smp_call_function_mask(smp_cpumask_t mask, smp_call_func_t func, uintptr_t data, bool wait);
+extern void smp_call_function_all(smp_call_func_t func, uintptr_t data, bool wait);
+extern void smp_call_function_others(smp_call_func_t func, uintptr_t data, bool wait);
+extern void smp_call_ipi(uint32_t procIndex);
+extern void smp_call_print_stats(void);
+extern void smp_call_init_ap(void);
+extern void smp_call_init(void);
+
+#endif
@@ -0,0 +1,85 @@
+/*
+ * File: softirq.h
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include <main.h>
+
+// Softirq vectors, run in order of priority on IRQ exit.
+enum {
+    SOFTIRQ_HI_TASKLET  = 0,
+    SOFTIRQ_TIMER       = 1,
+    SOFTIRQ_TASKLET     = 2,
+    SOFTIRQ_RCU         = 3,
+    SOFTIRQ_COUNT
+};
+
+// Number of times pending softirqs are rerun on one IRQ exit. Anything left runs on the next exit or when idle.
+#define SOFTIRQ_MAX_RESTART     10
+
+typedef void (*softirq_handler_t)(uint32_t procIndex);
+typedef void (*tasklet_func_t)(uintptr_t data);
+
+// Short piece of deferred work that runs once on the processor that scheduled it.
+typedef struct tasklet_t {
+    struct tasklet_t *Next;
+    tasklet_func_t Func;
+    uintptr_t Data;
+    volatile bool Scheduled;
+
+    // Set while the function runs, so a tasklet never runs on two processors at once.
+    volatile bool Running;
+} tasklet_t;
+
+typedef struct {
+    tasklet_t *Head;
+    tasklet_t *Tail;
+} tasklet_list_t;
+
+typedef struct {
+    // Bitmap of raised vectors.
+    volatile uint32_t Pending;
+
+    // Set while softirqs are running. Threads aren't switched out during this.
+    bool Active;
+
+    // Tasklets waiting to run.
+    tasklet_list_t HiTasklets;
+    tasklet_list_t Tasklets;
+} softirq_proc_t;
+
+extern void softirq_register(uint8_t vector, softirq_handler_t handler);
+extern void softirq_raise(uint8_t vector);
+extern bool softirq_active(uint32_t procIndex);
+extern bool softirq_pending(uint32_t procIndex);
+extern void softirq_run(uint32_t procIndex);
+
+extern void tasklet_init(tasklet_t *tasklet, tasklet_func_t func, uintptr_t data);
+extern void tasklet_schedule(tasklet_t *tasklet);
+extern void tasklet_hi_schedule(tasklet_t *tasklet);
+
+extern void softirq_init(void);
+
+#endif
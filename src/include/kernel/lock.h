@@ -27,11 +27,67 @@
 
 #include <main.h>
 
-typedef volatile struct {
+// Spinlock variants, selectable per lock. Zeroed locks are test-and-set locks.
+// Ticket locks are fair, and MCS locks also have each waiter spin on its own cache line.
+#define LOCK_TYPE_SPIN      0
+#define LOCK_TYPE_TICKET    1
+#define LOCK_TYPE_MCS       2
+
+// Static initializers for each variant.
+#define LOCK_INIT_SPIN      { .Type = LOCK_TYPE_SPIN }
+#define LOCK_INIT_TICKET    { .Type = LOCK_TYPE_TICKET }
+#define LOCK_INIT_MCS       { .Type = LOCK_TYPE_MCS }
+#define LOCK_INIT_NAMED(type, name) { .Type = (type), .Name = (name) }
+
+// MCS queue nodes each processor has, which limits how many MCS locks it can hold or wait on at once.
+// MCS locks need per-CPU data, so they can't be taken before it's set up on a processor.
+#define LOCK_MCS_NODE_COUNT     8
+#define LOCK_CACHE_LINE_SIZE    64
+
+// Interrupt flag in EFLAGS/RFLAGS.
+#define LOCK_FLAGS_INTERRUPTS   0x200
+
+// Place in an MCS lock's queue. Waiters spin on their own node until the previous holder hands over the lock.
+typedef struct lock_mcs_node_t {
+    struct lock_mcs_node_t *volatile Next;
+    volatile uint32_t Locked;
+} __attribute__((aligned(LOCK_CACHE_LINE_SIZE))) lock_mcs_node_t;
+
+typedef volatile struct lock_t {
+    // Lock bit for test-and-set locks, or the last queued node for MCS locks.
     uintptr_t Lock;
+
+    // Interrupt state of the holder. Only written once the lock is taken, so waiters can't clobber it.
     uintptr_t InterruptState;
-} __attribute__((packed)) lock_t;
+    uint32_t Type;
+
+    // Ticket lock counters. The holder's ticket is the one being served.
+    uint32_t NextTicket;
+    uint32_t ServingTicket;
+
+    // Queue node of the MCS lock holder.
+    lock_mcs_node_t *Holder;
+
+    // Name shown in lock statistics. Named locks are listed once first taken, so they must never be freed.
+    // Locks that share a name, such as one per processor, are told apart by NameIndex, which is the index plus one.
+    const char *Name;
+    uint32_t NameIndex;
+
+#ifdef LOCKSTAT
+    // Lock statistics, only updated by the holder. Times are in TSC cycles.
+    volatile struct lock_t *StatsNext;
+    bool StatsRegistered;
+    uint64_t Acquisitions;
+    uint64_t Contentions;
+    uint64_t SpinCycles;
+    uint64_t MaxHoldCycles;
+    uint64_t AcquiredTsc;
+#endif
+} lock_t;
 
+extern void spinlock_init(lock_t *lockObject, uint32_t type);
+extern void spinlock_set_name(lock_t *lockObject, const char *name);
+extern void spinlock_set_name_index(lock_t *lockObject, const char *name, uint32_t index);
 extern void spinlock_lock(lock_t *lockObject);
 extern void spinlock_release(lock_t *lockObject);
 
@@ -76,6 +76,7 @@
 #define MASK_DIRECTORY_PAE(addr)        ((uint64_t)(addr) & 0xFFFFFFF0)     // Get only the PDPT address.
 #define MASK_PAGE_4K_64BIT(size)        ((uint64_t)(size) & 0xFFFFF000)     // Get only the page address.
 #define MASK_PAGEFLAGS_4K_64BIT(size)   ((uint64_t)(size) & ~0xFFFFF000)    // Get only the page flags.
+#define MASK_FRAME_64BIT(entry)         ((uint64_t)(entry) & 0x000FFFFFFFFFF000)    // Get only the frame address, without NX.
 
 // Alignments.
 #define ALIGN_4K(size)          	(((uint32_t)(size) + (uint32_t)PAGE_SIZE_4K) & 0xFFFFF000)
@@ -118,7 +119,9 @@ extern void paging_flush_tlb_address(uintptr_t address);
 extern void paging_map(uintptr_t virt, uint64_t phys, bool kernel, bool writeable);
 extern void paging_unmap(uintptr_t virtual);
 extern bool paging_get_phys(uintptr_t virtual, uint64_t *physOut);
+extern bool paging_get_phys_user(uintptr_t virtual, uint64_t *physOut);
 extern uintptr_t paging_create_app_copy(void);
+extern void paging_free_app_copy(uintptr_t directoryPhys);
 
 extern void paging_map_region(uintptr_t startAddress, uintptr_t endAddress, bool kernel, bool writeable);
 extern void paging_map_region_phys(uintptr_t startAddress, uintptr_t endAddress, uint64_t startPhys, bool kernel, bool writeable);
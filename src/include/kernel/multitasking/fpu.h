@@ -0,0 +1,72 @@
+/*
+ * File: fpu.h
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FPU_H
+#define FPU_H
+
+#include <main.h>
+
+// Control register bits.
+#define FPU_CR0_MP              0x2
+#define FPU_CR0_EM              0x4
+#define FPU_CR0_TS              0x8
+#define FPU_CR0_NE              0x20
+#define FPU_CR4_OSFXSR          0x200
+#define FPU_CR4_OSXMMEXCPT      0x400
+#define FPU_CR4_OSXSAVE         0x40000
+
+// XCR0 state components.
+#define FPU_XCR0_X87            0x1
+#define FPU_XCR0_SSE            0x2
+#define FPU_XCR0_AVX            0x4
+
+// Alignment needed for the XSAVE area, which also satisfies FXSAVE.
+#define FPU_STATE_ALIGNMENT     64
+
+// Size of the FNSAVE area, used when FXSAVE isn't supported.
+#define FPU_FNSAVE_SIZE         108
+#define FPU_FXSAVE_SIZE         512
+
+// Default MXCSR value, with all SIMD exceptions masked.
+#define FPU_MXCSR_DEFAULT       0x1F80
+
+// Processor index for a thread whose FPU state isn't loaded anywhere.
+#define FPU_NO_PROCESSOR        0xFFFFFFFF
+
+// Instructions used to save and restore state.
+enum {
+    FPU_SAVE_FNSAVE,
+    FPU_SAVE_FXSAVE,
+    FPU_SAVE_XSAVE
+};
+
+extern void *fpu_state_create(void);
+extern void fpu_state_free(void *state);
+extern void fpu_save(void *state);
+extern void fpu_restore(void *state);
+extern void fpu_trap_next_use(void);
+extern void fpu_allow_use(void);
+extern void fpu_init(void);
+
+#endif
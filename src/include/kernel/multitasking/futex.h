@@ -0,0 +1,46 @@
+/*
+ * File: futex.h
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <main.h>
+
+// Operations for SYSCALL_FUTEX.
+#define FUTEX_WAIT      0
+#define FUTEX_WAKE      1
+
+// Number of hashed wait queues shared by all futexes.
+#define FUTEX_BUCKET_COUNT  256
+
+// Values returned from futex_wait() and futex_wake(). Non-negative wake results are the number of threads woken.
+#define FUTEX_OK            0
+#define FUTEX_ERR_FAULT     -1
+#define FUTEX_ERR_AGAIN     -2
+#define FUTEX_ERR_TIMEOUT   -3
+
+extern int32_t futex_wait(volatile uint32_t *address, uint32_t value, uint32_t timeoutMs);
+extern int32_t futex_wake(volatile uint32_t *address, uint32_t count);
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * File: rcu.h
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef RCU_H
+#define RCU_H
+
+#include <main.h>
+#include <kernel/percpu.h>
+
+// Callback run once every reader that could see an old object is done with it.
+struct rcu_head_t;
+typedef void (*rcu_callback_t)(struct rcu_head_t *head);
+
+// Embedded in objects freed through RCU.
+typedef struct rcu_head_t {
+    struct rcu_head_t *Next;
+    rcu_callback_t Func;
+} rcu_head_t;
+
+// Gets the object an rcu_head_t is embedded in.
+#define rcu_container(head, type, member)   ((type*)((uint8_t*)(head) - offsetof(type, member)))
+
+// Reads a pointer to an RCU-protected object. x86 doesn't reorder dependent loads, so only the compiler is held back.
+#define rcu_dereference(p) ({ \
+    typeof(p) _rcuValue = *(typeof(p) volatile*)&(p); \
+    asm volatile ("" : : : "memory"); \
+    _rcuValue; })
+
+// Publishes a pointer to an initialized object. Stores aren't reordered with older stores on x86.
+#define rcu_assign_pointer(p, v) do { \
+    asm volatile ("" : : : "memory"); \
+    *(typeof(p) volatile*)&(p) = (v); } while (0)
+
+// Marks a read-side section. Readers may not block, and the thread isn't preempted until the section ends.
+// IRQ handlers run with interrupts off, which already holds off grace periods, so they don't need this.
+static inline void rcu_read_lock(void) {
+    asm volatile ("incl %%gs:%c0" : : "i"(offsetof(percpu_t, RcuNesting)) : "memory");
+}
+
+static inline void rcu_read_unlock(void) {
+    asm volatile ("decl %%gs:%c0" : : "i"(offsetof(percpu_t, RcuNesting)) : "memory");
+}
+
+extern void rcu_call(rcu_head_t *head, rcu_callback_t func);
+extern void rcu_note_qs(void);
+extern void rcu_irq_enter(void);
+extern void rcu_idle_enter(void);
+extern void rcu_idle_exit(void);
+extern void rcu_init(void);
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * File: schedtrace.h
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SCHEDTRACE_H
+#define SCHEDTRACE_H
+
+#include <main.h>
+
+#define SCHEDTRACE_BUFFER_EVENTS    2048
+#define SCHEDTRACE_HIST_BUCKETS     40
+
+#define SCHEDTRACE_EXPORT_MAGIC     "SYDSCHED"
+#define SCHEDTRACE_EXPORT_VERSION   1
+
+// Trace event types.
+enum {
+    SCHEDTRACE_EVENT_SWITCH     = 1, // ThreadId switched out for NextThreadId.
+    SCHEDTRACE_EVENT_WAKEUP     = 2, // ThreadId made runnable on TargetProcessor.
+    SCHEDTRACE_EVENT_MIGRATE    = 3, // ThreadId moved from Processor to TargetProcessor.
+    SCHEDTRACE_EVENT_BLOCK      = 4  // ThreadId stopped running with State.
+};
+
+// Histograms. Bucket n counts intervals of 2^n to 2^(n+1) - 1 TSC cycles.
+enum {
+    SCHEDTRACE_HIST_WAKEUP_LATENCY  = 0, // Time from wakeup until the thread runs.
+    SCHEDTRACE_HIST_RUN_LENGTH      = 1, // Time a thread runs before switching away.
+    SCHEDTRACE_HIST_SWITCH_COST     = 2, // Time spent in the scheduler picking and switching threads.
+    SCHEDTRACE_HIST_COUNT
+};
+
+// Event as stored in the ring buffers and sent by the serial export.
+typedef struct {
+    uint64_t Tsc;
+    uint32_t ThreadId;
+    uint32_t NextThreadId;
+    uint8_t Type;
+    uint8_t State;
+    uint16_t Processor;
+    uint16_t TargetProcessor;
+    uint16_t Reserved;
+} __attribute__((packed)) schedtrace_event_t;
+
+// Header that starts a serial export. Each processor's events follow as an export_proc header and its events, oldest first.
+typedef struct {
+    char Magic[8];
+    uint32_t Version;
+    uint32_t ProcessorCount;
+    uint64_t TscPerMs;
+    uint32_t EventSize;
+    uint32_t BufferEvents;
+} __attribute__((packed)) schedtrace_export_header_t;
+
+typedef struct {
+    uint32_t Processor;
+    uint32_t EventCount;
+    uint64_t Dropped;
+} __attribute__((packed)) schedtrace_export_proc_t;
+
+// Per-processor trace state. Only written by its own processor with interrupts off.
+typedef struct {
+    schedtrace_event_t Events[SCHEDTRACE_BUFFER_EVENTS];
+    uint64_t Written;
+    uint64_t Histograms[SCHEDTRACE_HIST_COUNT][SCHEDTRACE_HIST_BUCKETS];
+} schedtrace_buffer_t;
+
+struct thread_t;
+
+extern void schedtrace_switch(uint32_t procIndex, struct thread_t *prevThread, struct thread_t *nextThread, uint64_t scheduleTsc);
+extern void schedtrace_wakeup(struct thread_t *thread, uint32_t targetIndex);
+extern void schedtrace_migrate(struct thread_t *thread, uint32_t fromIndex, uint32_t toIndex);
+extern void schedtrace_set_enabled(bool enabled);
+extern void schedtrace_clear(void);
+extern void schedtrace_print(void);
+extern void schedtrace_export(void);
+extern void schedtrace_init(void);
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * File: stacks.h
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef STACKS_H
+#define STACKS_H
+
+#include <main.h>
+#include <kernel/lock.h>
+#include <kernel/memory/paging.h>
+
+// Virtual region kernel stacks are mapped into. Each stack has an unmapped guard page below it.
+#ifdef X86_64
+#define STACKS_REGION_START     0xFFFF809000000000
+#define STACKS_REGION_END       0xFFFF809FFFFFFFFF
+#else
+#define STACKS_REGION_START     0xE0000000
+#define STACKS_REGION_END       0xEFFFFFFF
+#endif
+
+// Number of default sized stacks kept mapped and ready on each processor.
+#define STACKS_CACHE_SIZE       8
+
+// Gets the number of pages needed for a stack of the specified size.
+#define STACKS_PAGES(size)      (((size) + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K)
+
+// Free virtual range, including the guard page.
+typedef struct stacks_range_t {
+    struct stacks_range_t *Next;
+    uintptr_t Start;
+    uint32_t PageCount;
+} stacks_range_t;
+
+// Per-processor cache of ready-to-use stacks.
+typedef struct {
+    uintptr_t Stacks[STACKS_CACHE_SIZE];
+    uint32_t Count;
+    lock_t Lock;
+} stacks_cache_t;
+
+extern uintptr_t stacks_alloc(size_t size);
+extern void stacks_free(uintptr_t stackBottom, size_t size);
+extern void stacks_init(void);
+
+#endif
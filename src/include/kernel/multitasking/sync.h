@@ -0,0 +1,95 @@
+/*
+ * File: sync.h
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <main.h>
+#include <kernel/lock.h>
+#include <kernel/tasking.h>
+
+// Timeout value for waits that never time out.
+#define SYNC_WAIT_FOREVER       0xFFFFFFFF
+
+// Number of times a mutex waiter checks a running owner before going to sleep.
+#define MUTEX_SPIN_LIMIT        1000
+
+// Owner of mutexes taken before tasking is up.
+#define MUTEX_OWNER_BOOT        ((thread_t*)1)
+
+// Waiter on a wait queue, kept on the waiting thread's stack. Key lets several objects share a queue.
+typedef struct waitqueue_entry_t {
+    struct waitqueue_entry_t *Next;
+    struct waitqueue_entry_t *Prev;
+    thread_t *Thread;
+    uint64_t Key;
+    volatile bool Woken;
+} waitqueue_entry_t;
+
+// FIFO list of threads waiting for something.
+typedef struct {
+    lock_t Lock;
+    waitqueue_entry_t *Head;
+    waitqueue_entry_t *Tail;
+} waitqueue_t;
+
+typedef struct {
+    thread_t *volatile Owner;
+    waitqueue_t Waiters;
+} mutex_t;
+
+typedef struct {
+    volatile uint32_t Count;
+    uint32_t MaxCount;
+    waitqueue_t Waiters;
+} semaphore_t;
+
+typedef struct {
+    waitqueue_t Waiters;
+} condvar_t;
+
+extern void waitqueue_init(waitqueue_t *queue);
+extern bool waitqueue_wait_locked(waitqueue_t *queue, uint32_t timeoutMs);
+extern bool waitqueue_wait_key_locked(waitqueue_t *queue, uint64_t key, uint32_t timeoutMs);
+extern void waitqueue_wake_one_locked(waitqueue_t *queue);
+extern uint32_t waitqueue_wake_key_locked(waitqueue_t *queue, uint64_t key, uint32_t count);
+extern void waitqueue_wake_all_locked(waitqueue_t *queue);
+extern void waitqueue_wake_one(waitqueue_t *queue);
+extern void waitqueue_wake_all(waitqueue_t *queue);
+
+extern void mutex_init(mutex_t *mutex);
+extern bool mutex_try_lock(mutex_t *mutex);
+extern void mutex_lock(mutex_t *mutex);
+extern void mutex_unlock(mutex_t *mutex);
+
+extern void semaphore_init(semaphore_t *semaphore, uint32_t count, uint32_t maxCount);
+extern bool semaphore_wait(semaphore_t *semaphore, uint32_t units, uint32_t timeoutMs);
+extern void semaphore_signal(semaphore_t *semaphore, uint32_t units);
+
+extern void condvar_init(condvar_t *condvar);
+extern bool condvar_wait(condvar_t *condvar, mutex_t *mutex, uint32_t timeoutMs);
+extern void condvar_signal(condvar_t *condvar);
+extern void condvar_broadcast(condvar_t *condvar);
+
+#endif
@@ -40,9 +40,14 @@
 #define SYSCALL_MSR_SYSENTER_EIP    0x176
 
 #define SYSCALL_UPTIME 0x15
+#define SYSCALL_FUTEX 0x16
 
 extern uintptr_t syscalls_syscall(uintptr_t arg0, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3, uintptr_t arg4, uintptr_t arg5, uintptr_t index);
 
 extern void syscalls_kprintf(const char *format, ...);
 
+extern void syscalls_set_kernel_stack(uintptr_t stack);
+extern void syscalls_init_ap(void);
+extern void syscalls_init(void);
+
 #endif
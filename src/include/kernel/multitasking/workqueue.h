@@ -0,0 +1,64 @@
+/*
+ * File: workqueue.h
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <main.h>
+#include <kernel/lock.h>
+#include <kernel/multitasking/sync.h>
+
+typedef void (*work_func_t)(void *context);
+
+// Work to run on a workqueue thread. Owned by the submitter, and may be resubmitted once it starts running.
+typedef struct work_item_t {
+    struct work_item_t *Next;
+    work_func_t Func;
+    void *Context;
+    uint64_t DueTick;
+    volatile bool Queued;
+} work_item_t;
+
+typedef struct {
+    char *Name;
+    lock_t Lock;
+
+    // Items ready to run in FIFO order, and delayed items sorted by due tick.
+    work_item_t *Head;
+    work_item_t *Tail;
+    work_item_t *Delayed;
+
+    // Wakes worker threads when work is submitted.
+    semaphore_t WorkSignal;
+    uint32_t ThreadCount;
+} workqueue_t;
+
+extern void work_init(work_item_t *item, work_func_t func, void *context);
+extern workqueue_t *workqueue_create(char *name, uint32_t threadCount);
+extern workqueue_t *workqueue_get_system(void);
+extern bool workqueue_submit(workqueue_t *queue, work_item_t *item);
+extern bool workqueue_submit_delayed(workqueue_t *queue, work_item_t *item, uint32_t delayMs);
+extern void workqueue_init(void);
+
+#endif
@@ -27,6 +27,7 @@
 
 #include <main.h>
 #include <kernel/lock.h>
+#include <kernel/multitasking/sync.h>
 
 typedef struct net_packet_t {
     // Next packet in linked list, or NULL for last packet.
@@ -55,8 +56,9 @@ typedef struct net_device_t {
     net_packet_t *CurrentRxPacket;
     net_packet_t *LastRxPacket;
 
-    // Lock.
+    // Lock, and count of queued packets for the worker to wait on. A zeroed semaphore is empty with no limit.
     lock_t CurrentRxPacketLock;
+    semaphore_t RxPacketSemaphore;
 } net_device_t;
 
 // Linked list of networking devices.
@@ -0,0 +1,102 @@
+/*
+ * File: percpu.h
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PERCPU_H
+#define PERCPU_H
+
+#include <main.h>
+#include <kernel/lock.h>
+
+// MSRs holding the GS base in 64-bit mode, and the one swapgs exchanges it with.
+#define PERCPU_MSR_GS_BASE          0xC0000101
+#define PERCPU_MSR_KERNEL_GS_BASE   0xC0000102
+
+struct thread_t;
+struct tasking_proc_t;
+
+// Data private to each processor. GS always points here while in the kernel, with the
+// block's own address at offset 0 so it can be fetched with a single load. On x86_64,
+// entry from user mode swaps it in with swapgs.
+typedef struct percpu_t {
+    struct percpu_t *Self;
+
+    // Processor index and LAPIC ID.
+    uint32_t Index;
+    uint32_t ApicId;
+
+    // Thread running on this processor, and its scheduler state.
+    struct thread_t *CurrentThread;
+    struct tasking_proc_t *Tasking;
+
+    // Stack ring 3 code enters the kernel on when the current thread has none of its own.
+    uintptr_t KernelStack;
+
+    // Number of IRQ handlers currently running on this processor.
+    uint32_t IrqDepth;
+
+    // RCU state. RcuNesting counts read-side sections, RcuQsNeeded is set while the grace period in
+    // progress waits on this processor, and RcuIdle while halted in the idle loop.
+    uint32_t RcuNesting;
+    volatile bool RcuQsNeeded;
+    volatile bool RcuIdle;
+
+    // Queue nodes for MCS locks being held or waited on, with a bit set in LockNodesUsed for each one in use.
+    lock_mcs_node_t LockNodes[LOCK_MCS_NODE_COUNT];
+    uint32_t LockNodesUsed;
+
+    // Time in nanoseconds the tickless timer is armed for, or 0 if it's periodic or not armed.
+    uint64_t TimerDeadline;
+
+    // Statistics.
+    uint64_t IrqCount;
+    uint64_t ContextSwitches;
+} percpu_t;
+
+// Gets the current processor's data block.
+static inline percpu_t *percpu_get(void) {
+    percpu_t *percpu;
+    asm volatile ("mov %%gs:0, %0" : "=r"(percpu));
+    return percpu;
+}
+
+// Gets the current processor's index.
+static inline uint32_t percpu_index(void) {
+    uint32_t index;
+    asm volatile ("movl %%gs:%c1, %0" : "=r"(index) : "i"(offsetof(percpu_t, Index)));
+    return index;
+}
+
+// Gets the thread running on the current processor.
+static inline struct thread_t *percpu_current_thread(void) {
+    struct thread_t *thread;
+    asm volatile ("mov %%gs:%c1, %0" : "=r"(thread) : "i"(offsetof(percpu_t, CurrentThread)));
+    return thread;
+}
+
+extern percpu_t *percpu_get_proc(uint32_t index);
+extern void percpu_init_ap(uint32_t index, uint32_t apicId);
+extern void percpu_init_smp(void);
+extern void percpu_init_bsp(void);
+
+#endif
@@ -26,6 +26,7 @@
 #define TASKING_H
 
 #include <kernel/interrupts/irqs.h>
+#include <kernel/lock.h>
 
 #define PROCESS_STATE_ALIVE 0
 #define PROCESS_STATE_ZOMBIE 1
@@ -35,7 +36,41 @@
 #define SIG_TERM 2
 #define SIG_SEGV 3
 
-#define THREAD_STACK_SIZE	4096
+#define THREAD_STATE_RUNNABLE   0
+#define THREAD_STATE_BLOCKED    1
+#define THREAD_STATE_SLEEPING   2
+#define THREAD_STATE_DEAD       3
+
+#define THREAD_STACK_SIZE	0x4000
+
+// Scheduler priorities. Lower values are scheduled first.
+#define TASKING_PRIORITY_COUNT          32
+#define TASKING_PRIORITY_HIGHEST        0
+#define TASKING_PRIORITY_INTERACTIVE    8
+#define TASKING_PRIORITY_NORMAL         16
+#define TASKING_PRIORITY_BATCH          24
+#define TASKING_PRIORITY_LOWEST         (TASKING_PRIORITY_COUNT - 1)
+
+// How far a thread's dynamic priority may move from its base priority.
+#define TASKING_PRIORITY_BONUS_MAX      4
+#define TASKING_PRIORITY_PENALTY_MAX    4
+
+// Time slice lengths in timer ticks. Higher priorities get shorter slices.
+#define TASKING_TIMESLICE_MIN   2
+#define TASKING_TIMESLICE_MAX   20
+
+// Processor affinity masks. Processors past the width of the mask can only run threads allowed everywhere.
+#define TASKING_AFFINITY_ALL        0xFFFFFFFFFFFFFFFF
+#define TASKING_AFFINITY_PROC(i)    (1ULL << (i))
+
+// Ticks between each processor checking whether it should pull work from a busier one.
+#define TASKING_BALANCE_INTERVAL    100
+
+// Milliseconds between reaper passes. Zombies are freed one pass after they are collected, so this is also the grace period.
+#define TASKING_REAPER_INTERVAL     100
+
+// Software interrupt used by threads to give up the processor.
+#define TASKING_YIELD_INTERRUPT 0x81
 
 // Thread entry function.
 typedef void (*thread_entry_func_t)(uintptr_t arg0, uintptr_t arg1, uintptr_t arg2);
@@ -44,6 +79,13 @@ typedef void (*thread_entry_func_t)(uintptr_t arg0, uintptr_t arg1, uintptr_t ar
 struct thread_t;
 struct process_t;
 
+// Priority array. Each priority level has a circular list of threads, with a bit set in the bitmap if the list is non-empty.
+typedef struct tasking_runqueue_t {
+	struct thread_t *Threads[TASKING_PRIORITY_COUNT];
+	uint32_t Bitmap;
+	uint32_t Count;
+} tasking_runqueue_t;
+
 typedef struct thread_t {
 	// Relationship to other threads and parent process.
 	struct thread_t *Next;
@@ -55,13 +97,43 @@ typedef struct thread_t {
 	uint32_t ThreadId;
 	thread_entry_func_t EntryFunc;
 
-	// Stack.
+	// Stack. Kernel stacks come from the stack pool, user stacks are a single page.
+	// User threads also get a pool stack that interrupts and system calls from ring 3 run on.
 	uint64_t StackPage;
+	uintptr_t StackBottom;
+	size_t StackSize;
 	uintptr_t StackPointer;
 
-	// Scheduling relationship to other threads.
+	// Scheduling state.
+	uint8_t State;
+	uint8_t BasePriority;
+	uint8_t Priority;
+	uint32_t TimeSlice;
+	uint32_t TimeSliceRemaining;
+	uint32_t ProcessorIndex;
+	uint64_t AffinityMask;
+	bool Migrating;
+	bool Killed;
+
+	// Scheduling relationship to other threads. RunQueue is NULL if the thread is not queued.
+	tasking_runqueue_t *RunQueue;
 	struct thread_t *SchedNext;
 	struct thread_t *SchedPrev;
+
+	// Sleep state. SleepIndex is the thread's position in the sleep heap plus one, or 0 if not sleeping.
+	uint64_t WakeTick;
+	uint32_t SleepIndex;
+
+	// FPU state, allocated on first use. FpuProcessorIndex is the processor whose registers last held it.
+	void *FpuState;
+	uint32_t FpuProcessorIndex;
+
+	// Scheduler trace timestamps. TraceWakeTsc is set from wakeup until the thread runs, TraceRunTsc while it runs.
+	uint64_t TraceWakeTsc;
+	uint64_t TraceRunTsc;
+
+	// Threads may still be looked at by lockless readers such as mutex spinning, so they are freed through RCU.
+	rcu_head_t Rcu;
 } thread_t;
 
 typedef struct process_t {
@@ -75,17 +147,65 @@ typedef struct process_t {
 	uintptr_t PagingTablePhys;
 	bool UserMode;
 
+	// Threads not yet reaped. The process is freed along with its last thread.
 	thread_t *MainThread;
+	uint32_t ThreadCount;
 } process_t;
 
-typedef struct {
+typedef struct tasking_proc_t {
 	thread_t *CurrentThread;
+	thread_t *IdleThread;
+
+	// Active and expired priority arrays. Threads that use up their time slice move to the
+	// expired array, and the two are swapped once the active array runs dry.
+	tasking_runqueue_t RunQueues[2];
+	tasking_runqueue_t *ActiveQueue;
+	tasking_runqueue_t *ExpiredQueue;
+	lock_t RunQueueLock;
+
+	// Sleeping threads, as a min-heap ordered by wake tick. Protected by the run queue lock.
+	thread_t **SleepHeap;
+	uint32_t SleepCount;
+	uint32_t SleepCapacity;
+
+	// Running threads waiting to move off this processor after an affinity change.
+	thread_t *MigrateThreads;
+	uint32_t BalanceTicks;
+
+	// Threads that died on this processor, waiting for the reaper. Protected by the run queue lock.
+	thread_t *ZombieThreads;
 
+	// Tick count at the last timer interrupt. With a tickless timer, interrupts may be several ticks apart.
+	uint64_t LastTick;
+
+	// Timer ticks spent in the idle thread versus other threads.
+	uint64_t IdleTicks;
+	uint64_t BusyTicks;
+
+	// Thread whose state is in this processor's FPU registers, and whether it used them this slice.
+	thread_t *FpuOwner;
+	bool FpuActive;
+
+	bool NeedsReschedule;
 	bool TaskingEnabled;
 } tasking_proc_t;
 
+extern thread_t *tasking_thread_current(void);
 extern void tasking_kill_thread(void);
-
+extern bool tasking_thread_killed(void);
+extern void tasking_yield(void);
+extern void tasking_thread_block(uint8_t state);
+extern void tasking_thread_wake(thread_t *thread);
+extern bool tasking_thread_can_block(void);
+extern void tasking_thread_prepare_block(uint64_t wakeTick);
+extern void tasking_thread_finish_block(void);
+extern bool tasking_thread_is_running(thread_t *thread);
+extern bool tasking_thread_sleep(uint32_t ms);
+extern void tasking_thread_set_priority(thread_t *thread, uint8_t priority);
+extern uint8_t tasking_thread_get_priority(thread_t *thread);
+
+extern thread_t *tasking_thread_create_stack(process_t *process, char *name, thread_entry_func_t func, size_t stackSize,
+	uintptr_t arg0, uintptr_t arg1, uintptr_t arg2);
 extern thread_t *tasking_thread_create(process_t *process, char *name, thread_entry_func_t func, uintptr_t arg0, uintptr_t arg1, uintptr_t arg2);
 extern process_t *tasking_process_create(process_t *parent, char *name, bool userMode, char *mainThreadName, thread_entry_func_t mainThreadFunc,
 	uintptr_t mainThreadArg0, uintptr_t mainThreadArg1, uintptr_t mainThreadArg2);
@@ -93,9 +213,15 @@ extern process_t *tasking_process_create(process_t *parent, char *name, bool use
 
 extern thread_t *tasking_thread_create_kernel(char *name, thread_entry_func_t func, uintptr_t arg0, uintptr_t arg1, uintptr_t arg2);
 
+extern void tasking_thread_set_affinity(thread_t *thread, uint64_t affinityMask);
+extern void tasking_thread_schedule(thread_t *thread);
 extern void tasking_thread_schedule_proc(thread_t *thread, uint32_t procIndex);
 
+extern void tasking_get_proc_ticks(uint32_t procIndex, uint64_t *idleTicks, uint64_t *busyTicks);
+
+extern void tasking_yield_handler(irq_regs_t *regs);
 extern void tasking_tick(irq_regs_t* regs, uint32_t procIndex);
+extern void tasking_init_ap(void);
 extern void tasking_init(void);
 
 #endif
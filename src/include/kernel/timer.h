@@ -27,7 +27,24 @@
 
 #include <main.h>
 
+// Each tick is one millisecond.
+#define TIMER_NS_PER_MS     1000000ULL
+#define TIMER_NS_PER_US     1000ULL
+
+// Length of the window the LAPIC timer and TSC are calibrated over, against PIT channel 2.
+#define TIMER_CALIBRATE_MS  50
+
+// Longest a single timer event is armed for. Anything further out is rearmed once this passes.
+#define TIMER_MAX_EVENT_NS  (1000 * TIMER_NS_PER_MS)
+
 extern uint64_t timer_ticks(void);
+extern uint64_t timer_now_ns(void);
+extern bool timer_tickless(void);
+extern uint64_t timer_tsc_rate(void);
+extern uint64_t timer_tsc_to_ns(uint64_t cycles);
+extern void timer_set_next_event(uint32_t ms);
+extern void timer_set_next_event_ns(uint64_t deadlineNs);
+extern void timer_init_ap(void);
 extern void timer_init(void);
 
 #endif
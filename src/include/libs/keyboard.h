@@ -113,5 +113,8 @@ enum {
 
 extern uint16_t keyboard_get_last_key(void);
 extern char keyboard_get_ascii(uint16_t key);
+extern void keyboard_input_signal(void);
+extern bool keyboard_input_wait(uint32_t timeoutMs);
+extern void keyboard_init(void);
 
 #endif
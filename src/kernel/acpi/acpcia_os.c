@@ -33,6 +33,8 @@
 #include <kernel/memory/paging.h>
 #include <kernel/memory/kheap.h>
 #include <kernel/tasking.h>
+#include <kernel/multitasking/sync.h>
+#include <kernel/multitasking/workqueue.h>
 #include <driver/pci.h>
 #include <kernel/timer.h>
 
@@ -129,23 +131,36 @@ BOOLEAN AcpiOsWritable(void *Memory, ACPI_SIZE Length) {
 }
 
 ACPI_THREAD_ID AcpiOsGetThreadId() {
-    return 1;
+    // ACPICA tracks mutex ownership by thread, and zero isn't a valid ID.
+    thread_t *thread = tasking_thread_current();
+    return (thread != NULL) ? (thread->ThreadId + 1) : 1;
 }
 
-void acpica_thread(ACPI_OSD_EXEC_CALLBACK functionPtr, void *contextPtr) {
-    // Execute ACPICA function.
-    // = (ACPI_OSD_EXEC_CALLBACK)arg1;
-  //   = (void*)arg2;
+typedef struct {
+    work_item_t Work;
+    ACPI_OSD_EXEC_CALLBACK Function;
+    void *Context;
+} acpica_work_t;
 
-    //kprintf("function 0x%p, context 0x%p\n", arg1, arg2);
-    functionPtr(contextPtr);
-    kprintf("done acpcia handler.\n");
+static void acpica_work(void *context) {
+    // Execute ACPICA function.
+    acpica_work_t *work = (acpica_work_t*)context;
+    work->Function(work->Context);
+    kheap_free(work);
 }
 
 ACPI_STATUS AcpiOsExecute(ACPI_EXECUTE_TYPE Type, ACPI_OSD_EXEC_CALLBACK Function, void *Context) {
-    // Schedule execution by adding a thread. BROKEN
-    //tasking_thread_add_kernel(tasking_thread_create("acpica_worker", (uintptr_t)acpica_thread, (uintptr_t)Function, (uintptr_t)Context, 0));
-    tasking_thread_schedule_proc(tasking_thread_create_kernel("acpica_worker", acpica_thread, (uintptr_t)Function, (uintptr_t)Context, 0), 0);
+    if (Function == NULL)
+        return (AE_BAD_PARAMETER);
+
+    // Schedule execution on the system workqueue.
+    acpica_work_t *work = (acpica_work_t*)kheap_alloc(sizeof(acpica_work_t));
+    if (work == NULL)
+        return (AE_NO_MEMORY);
+    work->Function = Function;
+    work->Context = Context;
+    work_init(&work->Work, acpica_work, work);
+    workqueue_submit(workqueue_get_system(), &work->Work);
     return (AE_OK);
 }
 
@@ -178,37 +193,64 @@ void AcpiOsReleaseMutex(ACPI_MUTEX Handle) {
 }*/
 
 ACPI_STATUS AcpiOsCreateSemaphore(UINT32 MaxUnits, UINT32 InitialUnits, ACPI_SEMAPHORE *OutHandle) {
-    *OutHandle = kheap_alloc(sizeof(ACPI_SEMAPHORE));
+    if (OutHandle == NULL || InitialUnits > MaxUnits)
+        return (AE_BAD_PARAMETER);
+
+    semaphore_t *semaphore = (semaphore_t*)kheap_alloc(sizeof(semaphore_t));
+    if (semaphore == NULL)
+        return (AE_NO_MEMORY);
+    semaphore_init(semaphore, InitialUnits, MaxUnits);
+    *OutHandle = semaphore;
     return (AE_OK);
 }
 
 ACPI_STATUS AcpiOsDeleteSemaphore(ACPI_SEMAPHORE Handle) {
+    if (Handle == NULL)
+        return (AE_BAD_PARAMETER);
     kheap_free(Handle);
     return (AE_OK);
 }
 
 ACPI_STATUS AcpiOsWaitSemaphore(ACPI_SEMAPHORE Handle, UINT32 Units, UINT16 Timeout) {
-    return (AE_OK);
+    if (Handle == NULL)
+        return (AE_BAD_PARAMETER);
+
+    // Block until the units are available or the timeout passes.
+    uint32_t timeoutMs = (Timeout == ACPI_WAIT_FOREVER) ? SYNC_WAIT_FOREVER : Timeout;
+    return semaphore_wait((semaphore_t*)Handle, Units, timeoutMs) ? (AE_OK) : (AE_TIME);
 }
 
 ACPI_STATUS AcpiOsSignalSemaphore(ACPI_SEMAPHORE Handle, UINT32 Units) {
-return (AE_OK);
+    if (Handle == NULL)
+        return (AE_BAD_PARAMETER);
+    semaphore_signal((semaphore_t*)Handle, Units);
+    return (AE_OK);
 }
 
 ACPI_STATUS AcpiOsCreateLock(ACPI_SPINLOCK *OutHandle) {
-return (AE_OK);
+    if (OutHandle == NULL)
+        return (AE_BAD_PARAMETER);
+
+    lock_t *lock = (lock_t*)kheap_alloc(sizeof(lock_t));
+    if (lock == NULL)
+        return (AE_NO_MEMORY);
+    spinlock_init(lock, LOCK_TYPE_SPIN);
+    *OutHandle = (ACPI_SPINLOCK)lock;
+    return (AE_OK);
 }
 
 void AcpiOsDeleteLock(ACPI_HANDLE Handle) {
-return (AE_OK);
+    kheap_free(Handle);
 }
 
 ACPI_CPU_FLAGS AcpiOsAcquireLock(ACPI_SPINLOCK Handle) {
-return (AE_OK);
+    // Interrupt state is kept in the lock itself, so there are no flags to hand back.
+    spinlock_lock((lock_t*)Handle);
+    return 0;
 }
 
 void AcpiOsReleaseLock(ACPI_SPINLOCK Handle, ACPI_CPU_FLAGS Flags) {
-return (AE_OK);
+    spinlock_release((lock_t*)Handle);
 }
 
 static void *context;
@@ -140,6 +140,24 @@ static void gdt_set_tss(gdt_entry_t *gdt, uint8_t num, uintptr_t base, uint32_t
 #endif
 }
 
+#ifndef X86_64
+/**
+ * Points the per-CPU data segment in the GDT at the specified block.
+ */
+void gdt_set_percpu(gdt_entry_t *gdt, uintptr_t base, uint32_t size) {
+    gdt_set_descriptor(gdt, GDT_PERCPU_INDEX, false, false, false);
+
+    // Set base address.
+    gdt[GDT_PERCPU_INDEX].BaseLow = (base & 0xFFFFFF);
+    gdt[GDT_PERCPU_INDEX].BaseHigh = (base >> 24) & 0xFF;
+
+    // Limit is in bytes, covering only the block.
+    gdt[GDT_PERCPU_INDEX].LimitLow = ((size - 1) & 0xFFFF);
+    gdt[GDT_PERCPU_INDEX].LimitHigh = ((size - 1) >> 16) & 0x0F;
+    gdt[GDT_PERCPU_INDEX].IsLimit4K = false;
+}
+#endif
+
 /**
  * Sets the kernel ESP in the TSS.
  */
@@ -260,6 +278,12 @@ void gdt_fill(gdt_entry_t *gdt, bool is64Bits, tss_t *tss) {
     // If a TSS was specified, add it too.
     if (tss != NULL)
         gdt_set_tss(gdt, GDT_TSS_INDEX, (uintptr_t)tss, sizeof(tss_t));
+
+#ifndef X86_64
+    // Per-CPU segment gets its base once the processor's data block exists.
+    if (!is64Bits)
+        gdt_set_descriptor(gdt, GDT_PERCPU_INDEX, false, false, false);
+#endif
 }
 
 /**
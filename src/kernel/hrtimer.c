@@ -0,0 +1,432 @@
+/*
+ * File: hrtimer.c
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <main.h>
+#include <kprint.h>
+#include <string.h>
+#include <kernel/hrtimer.h>
+
+#include <kernel/percpu.h>
+#include <kernel/tasking.h>
+#include <kernel/timer.h>
+#include <kernel/interrupts/interrupts.h>
+#include <kernel/interrupts/smp.h>
+#include <kernel/interrupts/softirq.h>
+#include <kernel/memory/kheap.h>
+
+// Timer bases for each processor, by index.
+static hrtimer_base_t *hrtimerBases = NULL;
+static uint32_t hrtimerBaseCount = 0;
+
+static inline uint64_t hrtimer_deadline_tick(uint64_t deadline) {
+    // Coarse timers fire on the first tick at or after their deadline.
+    return (deadline + TIMER_NS_PER_MS - 1) / TIMER_NS_PER_MS;
+}
+
+static void hrtimer_list_add(hrtimer_t **head, hrtimer_t *timer) {
+    timer->Prev = NULL;
+    timer->Next = *head;
+    if (*head != NULL)
+        (*head)->Prev = timer;
+    *head = timer;
+}
+
+static void hrtimer_list_remove(hrtimer_t **head, hrtimer_t *timer) {
+    if (timer->Prev != NULL)
+        timer->Prev->Next = timer->Next;
+    else
+        *head = timer->Next;
+    if (timer->Next != NULL)
+        timer->Next->Prev = timer->Prev;
+    timer->Next = timer->Prev = NULL;
+}
+
+//
+// Heap of precise timers.
+//
+static void hrtimer_heap_set(hrtimer_base_t *base, uint32_t index, hrtimer_t *timer) {
+    base->Heap[index] = timer;
+    timer->Index = index + 1;
+}
+
+static void hrtimer_heap_up(hrtimer_base_t *base, uint32_t index) {
+    // Move timer up until its parent is due no later than it is.
+    hrtimer_t *timer = base->Heap[index];
+    while (index > 0) {
+        uint32_t parentIndex = (index - 1) / 2;
+        if (base->Heap[parentIndex]->Deadline <= timer->Deadline)
+            break;
+        hrtimer_heap_set(base, index, base->Heap[parentIndex]);
+        index = parentIndex;
+    }
+    hrtimer_heap_set(base, index, timer);
+}
+
+static void hrtimer_heap_down(hrtimer_base_t *base, uint32_t index) {
+    // Move timer down until both children are due no earlier than it is.
+    hrtimer_t *timer = base->Heap[index];
+    while (true) {
+        uint32_t childIndex = (index * 2) + 1;
+        if (childIndex >= base->HeapCount)
+            break;
+        if (childIndex + 1 < base->HeapCount && base->Heap[childIndex + 1]->Deadline < base->Heap[childIndex]->Deadline)
+            childIndex++;
+        if (timer->Deadline <= base->Heap[childIndex]->Deadline)
+            break;
+        hrtimer_heap_set(base, index, base->Heap[childIndex]);
+        index = childIndex;
+    }
+    hrtimer_heap_set(base, index, timer);
+}
+
+static bool hrtimer_heap_add(hrtimer_base_t *base, hrtimer_t *timer) {
+    // Grow heap if needed. The old heap is kept if there is no memory for a bigger one.
+    if (base->HeapCount == base->HeapCapacity) {
+        uint32_t capacity = (base->HeapCapacity > 0) ? base->HeapCapacity * 2 : HRTIMER_HEAP_SIZE;
+        hrtimer_t **heap = (hrtimer_t**)kheap_realloc(base->Heap, sizeof(hrtimer_t*) * capacity);
+        if (heap == NULL)
+            return false;
+        base->Heap = heap;
+        base->HeapCapacity = capacity;
+    }
+
+    // Add timer to the bottom and move it into place.
+    base->Heap[base->HeapCount] = timer;
+    base->HeapCount++;
+    hrtimer_heap_up(base, base->HeapCount - 1);
+    return true;
+}
+
+static void hrtimer_heap_remove(hrtimer_base_t *base, hrtimer_t *timer) {
+    uint32_t index = timer->Index - 1;
+    base->HeapCount--;
+    if (index == base->HeapCount)
+        return;
+
+    // Move last timer into the hole and restore heap order.
+    hrtimer_t *lastTimer = base->Heap[base->HeapCount];
+    hrtimer_heap_set(base, index, lastTimer);
+    hrtimer_heap_up(base, index);
+    hrtimer_heap_down(base, lastTimer->Index - 1);
+}
+
+//
+// Wheel of coarse timers.
+//
+static void hrtimer_wheel_add(hrtimer_base_t *base, hrtimer_t *timer) {
+    // Timers already due go in the next slot to be processed.
+    uint64_t tick = hrtimer_deadline_tick(timer->Deadline);
+    if (tick <= base->WheelTick)
+        tick = base->WheelTick + 1;
+
+    timer->Index = (uint32_t)(tick % HRTIMER_WHEEL_SLOTS);
+    hrtimer_list_add(&base->Wheel[timer->Index], timer);
+    base->WheelCount++;
+    if (timer->Deadline < base->WheelEarliest)
+        base->WheelEarliest = timer->Deadline;
+}
+
+static void hrtimer_wheel_update_earliest(hrtimer_base_t *base) {
+    // Rescan for the earliest deadline. This only happens after timers fire.
+    base->WheelEarliest = HRTIMER_NO_DEADLINE;
+    if (base->WheelCount == 0)
+        return;
+    for (uint32_t slot = 0; slot < HRTIMER_WHEEL_SLOTS; slot++) {
+        for (hrtimer_t *timer = base->Wheel[slot]; timer != NULL; timer = timer->Next) {
+            if (timer->Deadline < base->WheelEarliest)
+                base->WheelEarliest = timer->Deadline;
+        }
+    }
+}
+
+static void hrtimer_remove_locked(hrtimer_base_t *base, hrtimer_t *timer) {
+    // Pull timer from wherever it's waiting. The wheel's earliest deadline is left alone, as it's only a hint.
+    switch (timer->State) {
+        case HRTIMER_STATE_WHEEL:
+            hrtimer_list_remove(&base->Wheel[timer->Index], timer);
+            base->WheelCount--;
+            break;
+
+        case HRTIMER_STATE_HEAP:
+            hrtimer_heap_remove(base, timer);
+            break;
+
+        case HRTIMER_STATE_EXPIRED:
+            hrtimer_list_remove((timer->Flags & HRTIMER_FLAG_HARD) ? &base->HardExpired : &base->SoftExpired, timer);
+            break;
+    }
+    timer->State = HRTIMER_STATE_IDLE;
+    timer->Index = 0;
+}
+
+static void hrtimer_expire(hrtimer_base_t *base, hrtimer_t *timer) {
+    // Hand timer off to be run from the interrupt or the softirq.
+    timer->State = HRTIMER_STATE_EXPIRED;
+    timer->Index = 0;
+    hrtimer_list_add((timer->Flags & HRTIMER_FLAG_HARD) ? &base->HardExpired : &base->SoftExpired, timer);
+}
+
+static uint64_t hrtimer_next_deadline_locked(hrtimer_base_t *base) {
+    // Wheel timers can only fire on a tick after the last one processed.
+    uint64_t deadline = HRTIMER_NO_DEADLINE;
+    if (base->WheelCount > 0 && base->WheelEarliest != HRTIMER_NO_DEADLINE) {
+        uint64_t tick = hrtimer_deadline_tick(base->WheelEarliest);
+        deadline = ((tick > base->WheelTick) ? tick : base->WheelTick + 1) * TIMER_NS_PER_MS;
+    }
+    if (base->HeapCount > 0 && base->Heap[0]->Deadline < deadline)
+        deadline = base->Heap[0]->Deadline;
+    return deadline;
+}
+
+static bool hrtimer_detach(hrtimer_t *timer, bool wait) {
+    bool pending = false;
+    while (true) {
+        // The timer may move to another base until the one it's on is locked.
+        uint32_t procIndex = timer->ProcessorIndex;
+        if (procIndex == HRTIMER_NO_PROCESSOR)
+            return pending;
+        hrtimer_base_t *base = &hrtimerBases[procIndex];
+        spinlock_lock(&base->Lock);
+        if (timer->ProcessorIndex != procIndex) {
+            spinlock_release(&base->Lock);
+            continue;
+        }
+
+        if (timer->State != HRTIMER_STATE_IDLE) {
+            hrtimer_remove_locked(base, timer);
+            pending = true;
+        }
+
+        // A callback running on another processor may still use the timer, so wait for it before the caller frees it.
+        // On this processor, we are being called from the callback itself.
+        bool running = wait && base->Running == timer && procIndex != percpu_index();
+        spinlock_release(&base->Lock);
+        if (!running)
+            return pending;
+
+        // The callback may have added the timer again, so check once more after it finishes.
+        while (base->Running == timer)
+            asm volatile ("pause");
+    }
+}
+
+void hrtimer_setup(hrtimer_t *timer, hrtimer_func_t func, void *arg, uint8_t flags) {
+    memset(timer, 0, sizeof(hrtimer_t));
+    timer->Func = func;
+    timer->Arg = arg;
+    timer->Flags = flags;
+    timer->ProcessorIndex = HRTIMER_NO_PROCESSOR;
+}
+
+bool hrtimer_add(hrtimer_t *timer, uint64_t deadlineNs) {
+    // Returns false if the timer couldn't be armed, in which case it is left idle.
+    if (hrtimerBases == NULL)
+        panic("HRTIMER: Timer added before timers were initialized!\n");
+
+    // Adding a pending timer moves its deadline.
+    hrtimer_detach(timer, false);
+
+    // Lock the current processor's base. Interrupts are off once it's locked, so we can't move after that.
+    uint32_t procIndex;
+    hrtimer_base_t *base;
+    while (true) {
+        procIndex = percpu_index();
+        base = &hrtimerBases[procIndex];
+        spinlock_lock(&base->Lock);
+        if (procIndex == percpu_index())
+            break;
+        spinlock_release(&base->Lock);
+    }
+
+    timer->Deadline = deadlineNs;
+    timer->ProcessorIndex = procIndex;
+    if (timer->Flags & HRTIMER_FLAG_PRECISE) {
+        timer->State = HRTIMER_STATE_HEAP;
+        if (!hrtimer_heap_add(base, timer)) {
+            timer->State = HRTIMER_STATE_IDLE;
+            spinlock_release(&base->Lock);
+            return false;
+        }
+    }
+    else {
+        timer->State = HRTIMER_STATE_WHEEL;
+        hrtimer_wheel_add(base, timer);
+    }
+
+    // Bring the timer interrupt forward if this is due before it fires.
+    uint64_t nextDeadline = hrtimer_next_deadline_locked(base);
+    percpu_t *percpu = percpu_get();
+    if (percpu->TimerDeadline == 0 || nextDeadline < percpu->TimerDeadline)
+        timer_set_next_event_ns(nextDeadline);
+    spinlock_release(&base->Lock);
+    return true;
+}
+
+bool hrtimer_rearm(hrtimer_t *timer, uint64_t intervalNs) {
+    // Move deadline on from the last one, skipping any intervals that were missed.
+    uint64_t deadline = timer->Deadline + intervalNs;
+    uint64_t now = timer_now_ns();
+    if (deadline <= now && intervalNs > 0)
+        deadline += (((now - deadline) / intervalNs) + 1) * intervalNs;
+    return hrtimer_add(timer, deadline);
+}
+
+bool hrtimer_cancel(hrtimer_t *timer) {
+    // Returns true if the timer was pending. Once this returns, its callback isn't running anywhere else.
+    if (hrtimerBases == NULL)
+        return false;
+    return hrtimer_detach(timer, true);
+}
+
+bool hrtimer_pending(hrtimer_t *timer) {
+    return timer->State != HRTIMER_STATE_IDLE;
+}
+
+uint64_t hrtimer_next_deadline(uint32_t procIndex) {
+    if (hrtimerBases == NULL || procIndex >= hrtimerBaseCount)
+        return HRTIMER_NO_DEADLINE;
+
+    hrtimer_base_t *base = &hrtimerBases[procIndex];
+    spinlock_lock(&base->Lock);
+    uint64_t deadline = hrtimer_next_deadline_locked(base);
+    spinlock_release(&base->Lock);
+    return deadline;
+}
+
+static void hrtimer_sleep_wake(hrtimer_t *timer, void *arg) {
+    tasking_thread_wake((thread_t*)arg);
+}
+
+void hrtimer_sleep(uint64_t ns) {
+    uint64_t deadline = timer_now_ns() + ns;
+
+    // Threads that can't block spin until the deadline instead.
+    if (hrtimerBases == NULL || !interrupts_enabled() || !tasking_thread_can_block()) {
+        while (timer_now_ns() < deadline)
+            asm volatile ("pause");
+        return;
+    }
+
+    // The thread is marked blocked before the timer is added, so a wake can't be lost. Early wakes just block again.
+    hrtimer_t timer;
+    hrtimer_setup(&timer, hrtimer_sleep_wake, tasking_thread_current(), HRTIMER_FLAG_PRECISE | HRTIMER_FLAG_HARD);
+    while (timer_now_ns() < deadline && !tasking_thread_killed()) {
+        // If the timer can't be armed, the thread stays runnable and tries again once it's rescheduled.
+        tasking_thread_prepare_block(0);
+        if (!hrtimer_add(&timer, deadline))
+            tasking_thread_wake(timer.Arg);
+        tasking_thread_finish_block();
+    }
+    hrtimer_cancel(&timer);
+
+    // Killed threads are woken early, and exit once the timer is off their stack.
+    if (tasking_thread_killed())
+        tasking_kill_thread();
+}
+
+static void hrtimer_run_expired(hrtimer_base_t *base, hrtimer_t **list) {
+    // Run callbacks one at a time without the lock held, so they can add timers of their own.
+    spinlock_lock(&base->Lock);
+    while (*list != NULL) {
+        hrtimer_t *timer = *list;
+        hrtimer_list_remove(list, timer);
+        timer->State = HRTIMER_STATE_IDLE;
+        base->Running = timer;
+        spinlock_release(&base->Lock);
+
+        timer->Func(timer, timer->Arg);
+
+        spinlock_lock(&base->Lock);
+        base->Running = NULL;
+    }
+    spinlock_release(&base->Lock);
+}
+
+void hrtimer_run(uint32_t procIndex) {
+    // Called from the timer interrupt.
+    if (hrtimerBases == NULL || procIndex >= hrtimerBaseCount)
+        return;
+
+    hrtimer_base_t *base = &hrtimerBases[procIndex];
+    uint64_t now = timer_now_ns();
+    uint64_t nowTick = now / TIMER_NS_PER_MS;
+    spinlock_lock(&base->Lock);
+
+    // Expire precise timers that are due.
+    while (base->HeapCount > 0 && base->Heap[0]->Deadline <= now) {
+        hrtimer_t *timer = base->Heap[0];
+        hrtimer_heap_remove(base, timer);
+        hrtimer_expire(base, timer);
+    }
+
+    // Walk the wheel slots for each tick that has passed. After a long gap, each slot only needs visiting once.
+    if (base->WheelCount > 0 && hrtimer_deadline_tick(base->WheelEarliest) <= nowTick) {
+        uint64_t firstTick = base->WheelTick + 1;
+        if (nowTick >= firstTick + HRTIMER_WHEEL_SLOTS)
+            firstTick = nowTick - HRTIMER_WHEEL_SLOTS + 1;
+
+        for (uint64_t tick = firstTick; tick <= nowTick; tick++) {
+            hrtimer_t *timer = base->Wheel[tick % HRTIMER_WHEEL_SLOTS];
+            while (timer != NULL) {
+                // Slots are shared with timers further out, which stay put.
+                hrtimer_t *nextTimer = timer->Next;
+                if (hrtimer_deadline_tick(timer->Deadline) <= nowTick) {
+                    hrtimer_list_remove(&base->Wheel[timer->Index], timer);
+                    base->WheelCount--;
+                    hrtimer_expire(base, timer);
+                }
+                timer = nextTimer;
+            }
+        }
+        hrtimer_wheel_update_earliest(base);
+    }
+    base->WheelTick = nowTick;
+    bool softExpired = base->SoftExpired != NULL;
+    spinlock_release(&base->Lock);
+
+    // Run hard timers now, and leave the rest for the softirq.
+    hrtimer_run_expired(base, &base->HardExpired);
+    if (softExpired)
+        softirq_raise(SOFTIRQ_TIMER);
+}
+
+static void hrtimer_softirq_handler(uint32_t procIndex) {
+    hrtimer_run_expired(&hrtimerBases[procIndex], &hrtimerBases[procIndex].SoftExpired);
+}
+
+void hrtimer_init(void) {
+    // Create a base for each processor.
+    hrtimerBaseCount = smp_get_proc_count();
+    hrtimer_base_t *bases = (hrtimer_base_t*)kheap_alloc(sizeof(hrtimer_base_t) * hrtimerBaseCount);
+    memset(bases, 0, sizeof(hrtimer_base_t) * hrtimerBaseCount);
+    for (uint32_t i = 0; i < hrtimerBaseCount; i++) {
+        bases[i].WheelTick = timer_now_ns() / TIMER_NS_PER_MS;
+        bases[i].WheelEarliest = HRTIMER_NO_DEADLINE;
+        spinlock_set_name_index(&bases[i].Lock, "hrtimerBaseLock", i);
+    }
+
+    softirq_register(SOFTIRQ_TIMER, hrtimer_softirq_handler);
+    hrtimerBases = bases;
+    kprintf("HRTIMER: Initialized for %u processors.\n", hrtimerBaseCount);
+}
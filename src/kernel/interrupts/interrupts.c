@@ -44,6 +44,13 @@ void interrupts_disable(void) {
     kprintf("\e[97;44m   INTERRUPTS ARE DISABLED   \e[0m\n");
 }
 
+bool interrupts_enabled(void) {
+    // Check the interrupt flag in FLAGS.
+    uintptr_t flags;
+    asm volatile ("pushf\n\tpop %0" : "=r"(flags));
+    return (flags & INTERRUPTS_FLAG) != 0;
+}
+
 /**
  * Enable non-maskable interrupts
  */
@@ -158,6 +158,29 @@ void ioapic_enable_interrupt_pci(uint8_t interrupt, uint8_t vector) {
     kprintf("IOAPIC: Mapped interrupt %u to 0x%X\n", interrupt, vector);
 }
 
+void ioapic_set_destination(uint8_t interrupt, uint8_t apicId) {
+    // Get entry for interrupt and point it at the new LAPIC.
+    ioapic_redirection_entry_t entry = ioapic_get_redirection_entry(interrupt);
+    entry.destinationMode = IOAPIC_DEST_MODE_PHYSICAL;
+    entry.destinationField = apicId;
+
+    // Save entry to I/O APIC.
+    ioapic_set_redirection_entry(interrupt, entry);
+}
+
+void ioapic_set_masked(uint8_t interrupt, bool masked) {
+    // Get entry for interrupt and change only its mask.
+    ioapic_redirection_entry_t entry = ioapic_get_redirection_entry(interrupt);
+    entry.interruptMask = masked;
+
+    // Save entry to I/O APIC.
+    ioapic_set_redirection_entry(interrupt, entry);
+}
+
+bool ioapic_is_level_triggered(uint8_t interrupt) {
+    return ioapic_get_redirection_entry(interrupt).triggerMode;
+}
+
 void ioapic_disable_interrupt(uint8_t interrupt) {
     // Get entry for interrupt and mask it.
     ioapic_redirection_entry_t entry = ioapic_get_redirection_entry(interrupt);
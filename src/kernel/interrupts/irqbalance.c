@@ -0,0 +1,129 @@
+/*
+ * File: irqbalance.c
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <main.h>
+#include <kprint.h>
+#include <tools.h>
+#include <string.h>
+#include <kernel/interrupts/irqbalance.h>
+
+#include <kernel/percpu.h>
+#include <kernel/tasking.h>
+#include <kernel/interrupts/irqs.h>
+#include <kernel/interrupts/smp.h>
+#include <kernel/interrupts/smpcall.h>
+
+// The balancer thread is only created the first time balancing is turned on.
+static volatile bool balanceEnabled = false;
+static thread_t *balanceThread = NULL;
+
+// Counts as of the last pass, so each pass looks at the interrupts since then.
+static uint64_t lastIrqCounts[IRQ_VECTOR_COUNT];
+static uint32_t lastProcCounts[SMP_CPUMASK_MAX];
+
+static void irq_balance_snapshot(uint64_t *irqLoad, uint64_t *procLoad, uint32_t procCount) {
+    // Get interrupts since the last pass for each IRQ and processor.
+    for (uint16_t irq = 0; irq < IRQ_VECTOR_COUNT; irq++) {
+        uint64_t count = irqs_get_irq_count(irq);
+        if (irqLoad != NULL)
+            irqLoad[irq] = count - lastIrqCounts[irq];
+        lastIrqCounts[irq] = count;
+    }
+    for (uint32_t i = 0; i < procCount; i++) {
+        // Other processors bump their 64-bit counts while we read them, which could tear on i386.
+        // Only the low half is read, in one load, and the difference taken mod 2^32, which passes never come near.
+        uint32_t count = *(volatile uint32_t*)&percpu_get_proc(i)->IrqCount;
+        if (procLoad != NULL)
+            procLoad[i] = (uint32_t)(count - lastProcCounts[i]);
+        lastProcCounts[i] = count;
+    }
+}
+
+static void irq_balance_pass(void) {
+    static uint64_t irqLoad[IRQ_VECTOR_COUNT];
+    uint64_t procLoad[SMP_CPUMASK_MAX];
+
+    // Only processors that fit in an affinity mask are balanced across.
+    uint32_t procCount = smp_get_proc_count();
+    if (procCount > SMP_CPUMASK_MAX)
+        procCount = SMP_CPUMASK_MAX;
+    if (procCount < 2)
+        return;
+    irq_balance_snapshot(irqLoad, procLoad, procCount);
+
+    // Find busiest and least busy processors.
+    uint32_t busiest = 0, idlest = 0;
+    for (uint32_t i = 1; i < procCount; i++) {
+        if (procLoad[i] > procLoad[busiest])
+            busiest = i;
+        if (procLoad[i] < procLoad[idlest])
+            idlest = i;
+    }
+    uint64_t difference = procLoad[busiest] - procLoad[idlest];
+    if (difference < IRQ_BALANCE_THRESHOLD)
+        return;
+
+    // Move the busiest IRQ on the busiest processor that is allowed on the least busy one. Its load must be
+    // less than the difference, otherwise moving it just swaps which processor is busier.
+    int16_t bestIrq = -1;
+    for (uint16_t irq = 0; irq < IRQ_VECTOR_COUNT; irq++) {
+        if (!irqs_routable(irq) || irqs_get_target(irq) != busiest || !(irqs_get_affinity(irq) & SMP_CPUMASK(idlest)))
+            continue;
+        if (irqLoad[irq] == 0 || irqLoad[irq] >= difference)
+            continue;
+        if (bestIrq < 0 || irqLoad[irq] > irqLoad[bestIrq])
+            bestIrq = irq;
+    }
+
+    if (bestIrq >= 0 && irqs_set_target(bestIrq, idlest))
+        kprintf("IRQBALANCE: Moved IRQ%u (%llu interrupts) from CPU %u to CPU %u.\n", bestIrq, irqLoad[bestIrq], busiest, idlest);
+}
+
+static void irq_balance_thread(uintptr_t arg0, uintptr_t arg1, uintptr_t arg2) {
+    while (true) {
+        sleep(IRQ_BALANCE_INTERVAL_MS);
+        if (balanceEnabled)
+            irq_balance_pass();
+    }
+}
+
+bool irq_balance_enabled(void) {
+    return balanceEnabled;
+}
+
+void irq_balance_set_enabled(bool enabled) {
+    // Start counting from now, so load from before balancing was on isn't acted on.
+    if (enabled && !balanceEnabled) {
+        uint32_t procCount = smp_get_proc_count();
+        irq_balance_snapshot(NULL, NULL, procCount > SMP_CPUMASK_MAX ? SMP_CPUMASK_MAX : procCount);
+    }
+    balanceEnabled = enabled;
+
+    // Start balancer thread.
+    if (enabled && balanceThread == NULL) {
+        balanceThread = tasking_thread_create_kernel("irqbalance", irq_balance_thread, 0, 0, 0);
+        tasking_thread_schedule(balanceThread);
+    }
+    kprintf("IRQBALANCE: Balancing is %s.\n", enabled ? "on" : "off");
+}
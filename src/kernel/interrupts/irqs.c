@@ -27,20 +27,59 @@
 #include <string.h>
 #include <kernel/interrupts/irqs.h>
 
+#include <kernel/percpu.h>
 #include <kernel/acpi/acpi.h>
 #include <kernel/interrupts/idt.h>
 #include <kernel/interrupts/ioapic.h>
+#include <kernel/interrupts/irqstat.h>
 #include <kernel/interrupts/lapic.h>
 #include <kernel/interrupts/pic.h>
 #include <kernel/interrupts/smp.h>
+#include <kernel/interrupts/smpcall.h>
+#include <kernel/interrupts/softirq.h>
 #include <kernel/memory/kheap.h>
+#include <kernel/multitasking/rcu.h>
+#include <kernel/multitasking/sync.h>
+#include <kernel/tasking.h>
 
-// Common IRQ assembly handler.
-extern void _irq_common(void);
+// IRQ assembly entry stubs, one for each vector.
+extern uint8_t _irq_stubs[];
 
-// Array of IRQ handler pointers.
+// Handler lists for each vector above the exceptions. Lists are read under RCU, the lock only serializes changes.
 static uint8_t irqCount = 0;
-static irq_handler_t **irqHandlers;
+static irq_handler_t *irqHandlers[IRQ_VECTOR_COUNT];
+static lock_t irqHandlersLock = LOCK_INIT_NAMED(LOCK_TYPE_SPIN, "irqHandlersLock");
+
+// Vectors handed out on demand, and the IDT their gates are opened in.
+static bool irqVectorsAllocated[IRQ_VECTOR_COUNT];
+static lock_t irqVectorsLock = LOCK_INIT_NAMED(LOCK_TYPE_SPIN, "irqVectorsLock");
+static idt_entry_t *irqIdt = NULL;
+
+// Delivery of IRQs that can be moved between processors. The affinity is the processors an IRQ may be sent to,
+// and the target is the one it is currently sent to.
+typedef struct {
+    irq_route_func_t RouteFunc;
+    smp_cpumask_t Affinity;
+    uint32_t Target;
+} irq_route_t;
+static irq_route_t irqRoutes[IRQ_VECTOR_COUNT];
+static lock_t irqRoutesLock = LOCK_INIT_NAMED(LOCK_TYPE_SPIN, "irqRoutesLock");
+
+// Thread state for a threaded IRQ handler. The signal only counts to one, so IRQs raised before the thread
+// gets to run are handled in a single pass.
+typedef struct irq_thread_t {
+    uint8_t Irq;
+    irq_thread_func_t ThreadFunc;
+    semaphore_t Signal;
+    thread_t *Thread;
+
+    // Set while the IRQ's line is masked waiting on this thread. Only level triggered lines are masked.
+    volatile bool LineMasked;
+} irq_thread_t;
+
+// Number of threaded handlers keeping each line masked. The line is unmasked once none are.
+static uint8_t irqLineMasks[IRQ_MAX_COUNT];
+static lock_t irqLineMasksLock = LOCK_INIT_NAMED(LOCK_TYPE_SPIN, "irqLineMasksLock");
 
 // Do we send EOIs to the LAPIC instead of the PIC?
 static bool useLapic = false;
@@ -49,9 +88,8 @@ uint8_t irqs_get_count(void) {
     return irqCount;
 }
 
-static bool irqExecuting = false;
 bool irqs_irq_executing(void) {
-    return irqExecuting;
+    return percpu_get()->IrqDepth > 0;
 }
 
 void irqs_eoi(uint8_t irq) {
@@ -62,9 +100,174 @@ void irqs_eoi(uint8_t irq) {
         pic_eoi(irq);
 }
 
+static inline bool irqs_valid(uint8_t irq) {
+    // IRQ is either an I/O APIC input or an allocated vector.
+    return irq < irqCount || (irq < IRQ_VECTOR_COUNT && irqVectorsAllocated[irq]);
+}
+
+static uintptr_t irqs_get_stub(uint8_t vector) {
+    // Get entry stub for vector.
+    return (uintptr_t)_irq_stubs + ((vector - IRQ_VECTOR_FIRST) * IRQ_STUB_SIZE);
+}
+
+uint8_t irqs_alloc_vector(void) {
+    // Vectors can only be targeted at processors through the LAPIC.
+    if (!useLapic)
+        return 0;
+
+    // Find a free vector and open its gate. Returns 0 if none are left.
+    uint8_t vector = 0;
+    spinlock_lock(&irqVectorsLock);
+    for (uint16_t v = IRQ_VECTOR_DYNAMIC_FIRST; v <= IRQ_VECTOR_DYNAMIC_LAST; v++) {
+        if (!irqVectorsAllocated[v - IRQ_OFFSET]) {
+            irqVectorsAllocated[v - IRQ_OFFSET] = true;
+            vector = (uint8_t)v;
+            break;
+        }
+    }
+    spinlock_release(&irqVectorsLock);
+
+    if (vector != 0)
+        idt_open_interrupt_gate(irqIdt, vector, irqs_get_stub(vector));
+    return vector;
+}
+
+void irqs_free_vector(uint8_t vector) {
+    // Ensure vector was allocated.
+    if (vector < IRQ_VECTOR_DYNAMIC_FIRST || vector > IRQ_VECTOR_DYNAMIC_LAST || !irqVectorsAllocated[vector - IRQ_OFFSET])
+        panic("IRQS: Vector 0x%X was not allocated.\n", vector);
+    if (irqHandlers[vector - IRQ_OFFSET] != NULL)
+        panic("IRQS: Vector 0x%X still has handlers.\n", vector);
+
+    // Close gate and release vector.
+    idt_close_interrupt_gate(irqIdt, vector);
+    spinlock_lock(&irqVectorsLock);
+    irqVectorsAllocated[vector - IRQ_OFFSET] = false;
+    spinlock_release(&irqVectorsLock);
+}
+
+uint64_t irqs_get_irq_count(uint8_t irq) {
+    // Counts are kept per processor by the interrupt statistics.
+    return irqstat_get_count(irq);
+}
+
+static smp_cpumask_t irqs_online_mask(void) {
+    // Get mask of all processors that can be named in an affinity mask.
+    uint32_t procCount = smp_get_proc_count();
+    if (procCount >= SMP_CPUMASK_MAX)
+        return ~(smp_cpumask_t)0;
+    return SMP_CPUMASK(procCount) - 1;
+}
+
+bool irqs_route_ioapic(uint8_t irq, uint32_t procIndex) {
+    // Point the I/O APIC input at the processor's LAPIC, if its ID fits.
+    percpu_t *percpu = percpu_get_proc(procIndex);
+    if (percpu == NULL || percpu->ApicId > IOAPIC_DEST_MAX)
+        return false;
+    ioapic_set_destination(ioapic_remap_interrupt(irq), (uint8_t)percpu->ApicId);
+    return true;
+}
+
+void irqs_set_route(uint8_t irq, irq_route_func_t routeFunc, uint32_t procIndex) {
+    // Ensure IRQ is valid.
+    if (!irqs_valid(irq))
+        panic("IRQS: IRQ out of range.\n");
+
+    // Record how the IRQ is moved, and where it is delivered now. It may go to any processor to start with.
+    spinlock_lock(&irqRoutesLock);
+    irqRoutes[irq].RouteFunc = routeFunc;
+    irqRoutes[irq].Affinity = ~(smp_cpumask_t)0;
+    irqRoutes[irq].Target = procIndex;
+    spinlock_release(&irqRoutesLock);
+}
+
+bool irqs_routable(uint8_t irq) {
+    return irq < IRQ_VECTOR_COUNT && irqRoutes[irq].RouteFunc != NULL;
+}
+
+static bool irqs_set_target_locked(uint8_t irq, uint32_t procIndex) {
+    // Target must be allowed by the IRQ's affinity.
+    if (procIndex >= smp_get_proc_count() || (procIndex < SMP_CPUMASK_MAX && !(irqRoutes[irq].Affinity & SMP_CPUMASK(procIndex))))
+        return false;
+    if (irqRoutes[irq].Target == procIndex)
+        return true;
+
+    // Move delivery.
+    if (!irqRoutes[irq].RouteFunc(irq, procIndex))
+        return false;
+    irqRoutes[irq].Target = procIndex;
+    return true;
+}
+
+bool irqs_set_target(uint8_t irq, uint32_t procIndex) {
+    if (!irqs_routable(irq))
+        return false;
+
+    spinlock_lock(&irqRoutesLock);
+    bool result = irqs_set_target_locked(irq, procIndex);
+    spinlock_release(&irqRoutesLock);
+    return result;
+}
+
+uint32_t irqs_get_target(uint8_t irq) {
+    return (irq < IRQ_VECTOR_COUNT) ? irqRoutes[irq].Target : 0;
+}
+
+bool irqs_set_affinity(uint8_t irq, smp_cpumask_t mask) {
+    // Only processors that exist count.
+    mask &= irqs_online_mask();
+    if (!irqs_routable(irq) || mask == 0)
+        return false;
+
+    spinlock_lock(&irqRoutesLock);
+    smp_cpumask_t oldMask = irqRoutes[irq].Affinity;
+    irqRoutes[irq].Affinity = mask;
+
+    // If the IRQ is already on an allowed processor, it can stay there. Otherwise move it to the first one that takes it.
+    uint32_t target = irqRoutes[irq].Target;
+    bool moved = target < SMP_CPUMASK_MAX && (mask & SMP_CPUMASK(target));
+    for (uint32_t i = 0; i < SMP_CPUMASK_MAX && !moved; i++) {
+        if (mask & SMP_CPUMASK(i))
+            moved = irqs_set_target_locked(irq, i);
+    }
+
+    // Keep the old mask if no processor in the new one could be targeted.
+    if (!moved)
+        irqRoutes[irq].Affinity = oldMask;
+    spinlock_release(&irqRoutesLock);
+    return moved;
+}
+
+smp_cpumask_t irqs_get_affinity(uint8_t irq) {
+    return irqs_routable(irq) ? (irqRoutes[irq].Affinity & irqs_online_mask()) : 0;
+}
+
+void irqs_print_affinity(void) {
+    kprintf("IRQ  Vector  Count       Target  Affinity\n");
+    for (uint16_t irq = 0; irq < IRQ_VECTOR_COUNT; irq++) {
+        if (!irqs_routable(irq))
+            continue;
+        kprintf("%3u  0x%2X    %10llu  CPU %-3u 0x%llX\n", irq, irq + IRQ_OFFSET, irqs_get_irq_count(irq), irqRoutes[irq].Target, irqs_get_affinity(irq));
+    }
+}
+
+static void irqs_add_handler(uint8_t irq, irq_handler_t *handler) {
+    // Add handler to end of list. It's fully set up first, as IRQs may walk the list at any time.
+    spinlock_lock(&irqHandlersLock);
+    if (irqHandlers[irq] != NULL) {
+        irq_handler_t *currHandler = irqHandlers[irq];
+        while (currHandler->Next != NULL)
+            currHandler = currHandler->Next;
+        rcu_assign_pointer(currHandler->Next, handler);
+    }
+    else
+        rcu_assign_pointer(irqHandlers[irq], handler);
+    spinlock_release(&irqHandlersLock);
+}
+
 void irqs_install_handler_proc(uint8_t irq, irq_handler_func_t handlerFunc, uint32_t procIndex) {
     // Ensure IRQ is valid.
-    if (irq >= irqCount)
+    if (!irqs_valid(irq))
         panic("IRQS: IRQ out of range.\n");
 
     // Create handler object.
@@ -76,34 +279,109 @@ void irqs_install_handler_proc(uint8_t irq, irq_handler_func_t handlerFunc, uint
     handler->HandlerFunc = handlerFunc;
     handler->ProcessorIndex = procIndex;
 
-    // Add handler to end of list.
-    if (irqHandlers[irq] != NULL) {
-        irq_handler_t *currHandler = irqHandlers[irq];
-        while (currHandler->Next != NULL)
-            currHandler = currHandler->Next;
-        currHandler->Next = handler;
-    }
-    else
-        irqHandlers[irq] = handler;
+    // Add handler.
+    irqs_add_handler(irq, handler);
     kprintf("IRQS: Handler 0x%p for IRQ%u installed!\n", handlerFunc, irq);
 }
 
 // Installs an IRQ handler.
 void irqs_install_handler(uint8_t irq, irq_handler_func_t handlerFunc) {
     // Get processor we are running on.
-    smp_proc_t *proc = smp_get_proc(lapic_id());
-    uint32_t index = (proc != NULL) ? proc->Index : 0;
+    uint32_t index = percpu_index();
 
     // Add handler.
     irqs_install_handler_proc(irq, handlerFunc, index);
 }
 
+static void irqs_set_line_masked(uint8_t irq, bool masked) {
+    // Only lines need masking, message signalled interrupts are edge triggered.
+    if (irq >= irqCount)
+        return;
+
+    // Mask on the first threaded handler waiting, and unmask once the last one is done.
+    spinlock_lock(&irqLineMasksLock);
+    if (masked ? (irqLineMasks[irq]++ == 0) : (--irqLineMasks[irq] == 0)) {
+        if (useLapic)
+            ioapic_set_masked(ioapic_remap_interrupt(irq), masked);
+        else
+            pic_set_masked(irq, masked);
+    }
+    spinlock_release(&irqLineMasksLock);
+}
+
+static bool irqs_line_level_triggered(uint8_t irq) {
+    // Message signalled interrupts are edge triggered. The trigger mode is read each time, as PCI lines are set up after install.
+    if (irq >= irqCount)
+        return false;
+    return useLapic ? ioapic_is_level_triggered(ioapic_remap_interrupt(irq)) : pic_is_level_triggered(irq);
+}
+
+static void irqs_thread_wake(irq_thread_t *irqThread) {
+    // Keep a level triggered line masked until the bottom half has dealt with the device, otherwise it
+    // would keep firing until the thread runs. Edges that arrive while a line is masked are lost, so edge
+    // triggered lines are left alone, and repeated edges collapse into the one pending signal.
+    if (!irqThread->LineMasked && irqs_line_level_triggered(irqThread->Irq)) {
+        irqThread->LineMasked = true;
+        irqs_set_line_masked(irqThread->Irq, true);
+    }
+    semaphore_signal(&irqThread->Signal, 1);
+}
+
+static void irqs_thread_main(uintptr_t arg0, uintptr_t arg1, uintptr_t arg2) {
+    irq_thread_t *irqThread = (irq_thread_t*)arg0;
+    while (true) {
+        // Wait for the IRQ, then run the bottom half.
+        semaphore_wait(&irqThread->Signal, 1, SYNC_WAIT_FOREVER);
+        irqThread->ThreadFunc(irqThread->Irq);
+
+        // Let the line fire again. The flag is cleared first so an IRQ arriving right after masks it again.
+        if (irqThread->LineMasked) {
+            irqThread->LineMasked = false;
+            irqs_set_line_masked(irqThread->Irq, false);
+        }
+    }
+}
+
+// Installs a threaded IRQ handler. The top half runs in the IRQ and returns true if the IRQ was for its
+// device, after acknowledging it. Without a top half, the thread is woken on every IRQ on the line.
+void irqs_install_threaded(uint8_t irq, irq_handler_func_t topHalfFunc, irq_thread_func_t threadFunc, char *name) {
+    // Ensure IRQ is valid.
+    if (!irqs_valid(irq))
+        panic("IRQS: IRQ out of range.\n");
+
+    // Create thread state and start thread.
+    irq_thread_t *irqThread = kheap_alloc(sizeof(irq_thread_t));
+    memset(irqThread, 0, sizeof(irq_thread_t));
+    irqThread->Irq = irq;
+    irqThread->ThreadFunc = threadFunc;
+    semaphore_init(&irqThread->Signal, 0, 1);
+    irqThread->Thread = tasking_thread_create_kernel(name, irqs_thread_main, (uintptr_t)irqThread, 0, 0);
+    tasking_thread_set_priority(irqThread->Thread, IRQ_THREAD_PRIORITY);
+    tasking_thread_schedule(irqThread->Thread);
+
+    // Create handler object.
+    irq_handler_t *handler = kheap_alloc(sizeof(irq_handler_t));
+    memset(handler, 0, sizeof(irq_handler_t));
+    handler->HandlerFunc = topHalfFunc;
+    handler->Thread = irqThread;
+    handler->ProcessorIndex = percpu_index();
+
+    // Add handler.
+    irqs_add_handler(irq, handler);
+    kprintf("IRQS: Threaded handler 0x%p for IRQ%u installed!\n", threadFunc, irq);
+}
+
+static void irqs_free_handler(rcu_head_t *head) {
+    kheap_free(rcu_container(head, irq_handler_t, Rcu));
+}
+
 void irqs_remove_handler_proc(uint8_t irq, irq_handler_func_t handlerFunc, uint32_t procIndex) {
     // Ensure IRQ is valid.
-    if (irq >= irqCount)
+    if (!irqs_valid(irq))
         panic("IRQS: IRQ out of range.\n");
 
     // Try to find handler function.
+    spinlock_lock(&irqHandlersLock);
     irq_handler_t *prevHandler = NULL;
     irq_handler_t *handler = irqHandlers[irq];
     while (handler != NULL) {
@@ -115,24 +393,25 @@ void irqs_remove_handler_proc(uint8_t irq, irq_handler_func_t handlerFunc, uint3
 
     // If handler is still NULL, we couldn't find the specified handler function.
     if (handler == NULL) {
+        spinlock_release(&irqHandlersLock);
         kprintf("IRQS: Unable to find and remove handler 0x%p for IRQ%u!\n", handlerFunc, irq);
         return;
     }
 
-    // Remove handler.
+    // Unlink handler. It's freed once no IRQ can still be looking at it, and its Next stays valid until then.
     if (prevHandler != NULL)
-        prevHandler->Next = handler->Next;
+        rcu_assign_pointer(prevHandler->Next, handler->Next);
     else
-        irqHandlers[irq] = handler->Next;
-    kheap_free(handler);
+        rcu_assign_pointer(irqHandlers[irq], handler->Next);
+    spinlock_release(&irqHandlersLock);
+    rcu_call(&handler->Rcu, irqs_free_handler);
     kprintf("IRQS: Handler 0x%p for IRQ%u removed!\n", handlerFunc, irq);
 }
 
 // Removes an IRQ handler.
 void irqs_remove_handler(uint8_t irq, irq_handler_func_t handlerFunc) {
     // Get processor we are running on.
-    smp_proc_t *proc = smp_get_proc(lapic_id());
-    uint32_t index = (proc != NULL) ? proc->Index : 0;
+    uint32_t index = percpu_index();
 
     // Remove handler.
     return irqs_remove_handler_proc(irq, handlerFunc, index);
@@ -140,54 +419,78 @@ void irqs_remove_handler(uint8_t irq, irq_handler_func_t handlerFunc) {
 
 bool irqs_handler_mapped_proc(uint8_t irq, irq_handler_func_t handlerFunc, uint32_t procIndex) {
     // Ensure IRQ is valid.
-    if (irq >= irqCount)
+    if (!irqs_valid(irq))
         panic("IRQS: IRQ out of range.\n");
 
     // Try to find IRQ handler.
-    irq_handler_t *handler = irqHandlers[irq];
+    bool found = false;
+    rcu_read_lock();
+    irq_handler_t *handler = rcu_dereference(irqHandlers[irq]);
     while (handler != NULL) {
-        if (handler->HandlerFunc == handlerFunc && handler->ProcessorIndex == procIndex)
-            return true;
-        handler = handler->Next;
+        if (handler->HandlerFunc == handlerFunc && handler->ProcessorIndex == procIndex) {
+            found = true;
+            break;
+        }
+        handler = rcu_dereference(handler->Next);
     }
-    return false;
+    rcu_read_unlock();
+    return found;
 }
 
 bool irqs_handler_mapped(uint8_t irq, irq_handler_func_t handlerFunc) {
     // Get processor we are running on.
-    smp_proc_t *proc = smp_get_proc(lapic_id());
-    uint32_t index = (proc != NULL) ? proc->Index : 0;
+    uint32_t index = percpu_index();
 
     // Determine if handler is mapped.
     return irqs_handler_mapped_proc(irq, handlerFunc, index);
 }
 
-// Handler for IRQss.
-void irqs_handler(irq_regs_t *regs) {
-    // Get IRQ number.
-    irqExecuting = true;
-    uint8_t irq = useLapic ? lapic_get_irq() : pic_get_irq();
-
+// Handler for IRQss. The entry stub passes the TSC as it was on entry.
+void irqs_handler(irq_regs_t *regs, uint64_t entryTsc) {
     // Get processor we are running on.
-    smp_proc_t *proc = smp_get_proc(lapic_id());
-    uint32_t procIndex = (proc != NULL) ? proc->Index : 0;
-
-    // Ensure IRQ is within range.
-    if (irq < irqCount) {
-        // Invoke registered handlers.
-        irq_handler_t *handler = irqHandlers[irq];
+    percpu_t *percpu = percpu_get();
+    uint32_t procIndex = percpu->Index;
+    percpu->IrqDepth++;
+    percpu->IrqCount++;
+    rcu_irq_enter();
+
+    // Get IRQ number from the vector the entry stub pushed.
+    uint8_t irq = regs->Vector - IRQ_OFFSET;
+    irqstat_enter(procIndex, irq, entryTsc);
+
+    // Cross-processor calls have their own vector. Otherwise ensure IRQ is within range.
+    if (irq == IRQ_VECTOR_IPI_CALL - IRQ_OFFSET)
+        smp_call_ipi(procIndex);
+    else if (irqs_valid(irq)) {
+        // Invoke registered handlers. Interrupts are off, so handlers can't be freed during the walk.
+        // Routed IRQs are only sent to one processor at a time, so their handlers run wherever they arrive.
+        bool routed = irqRoutes[irq].RouteFunc != NULL;
+        irq_handler_t *handler = rcu_dereference(irqHandlers[irq]);
         while (handler != NULL) {
-            if (handler->HandlerFunc != NULL && handler->ProcessorIndex == procIndex) {
-                if (handler->HandlerFunc(regs, irq, procIndex))
+            if (routed || handler->ProcessorIndex == procIndex) {
+                if (handler->Thread != NULL) {
+                    // Threaded handler. Without a top half there's no telling if the IRQ was for it, so keep looking.
+                    if (handler->HandlerFunc == NULL)
+                        irqs_thread_wake(handler->Thread);
+                    else if (handler->HandlerFunc(regs, irq, procIndex)) {
+                        irqs_thread_wake(handler->Thread);
+                        break;
+                    }
+                }
+                else if (handler->HandlerFunc != NULL && handler->HandlerFunc(regs, irq, procIndex))
                     break;
             }
-            handler = handler->Next;
+            handler = rcu_dereference(handler->Next);
         }
     }
 
-    // Send EOI.
+    // Send EOI. Handler time is measured up to here, softirqs are accounted on their own.
     irqs_eoi(irq);
-    irqExecuting = false;
+    irqstat_exit(procIndex);
+    percpu->IrqDepth--;
+
+    // Run work deferred by the handlers.
+    softirq_run(procIndex);
 }
 
 void irqs_init(idt_entry_t *idt) {
@@ -198,6 +501,7 @@ void irqs_init(idt_entry_t *idt) {
     ioapic_init();
     useLapic = false;
     irqCount = IRQ_ISA_COUNT;
+    irqIdt = idt;
 
     // If the I/O APIC is supported, changeover to that.
     if (ioapic_supported()) {
@@ -224,15 +528,21 @@ void irqs_init(idt_entry_t *idt) {
         }
         useLapic = true;
         irqCount = ioapic_max_interrupts();
-    }
+        if (irqCount > IRQ_MAX_COUNT)
+            irqCount = IRQ_MAX_COUNT;
 
-    // Allocate space for handler array.
-    kprintf("IRQS: %u possible IRQs.\n", irqCount);
-    irqHandlers = kheap_alloc(sizeof(irq_handler_t) * irqCount);
-    memset(irqHandlers, 0, sizeof(irq_handler_t) * irqCount);
+        // ISA IRQs can be moved between processors, except the timer as its vector is shared with the LAPIC timer.
+        for (uint8_t i = 1; i < IRQ_ISA_COUNT; i++) {
+            if (i != 2)
+                irqs_set_route(i, irqs_route_ioapic, percpu_index());
+        }
+    }
 
     // Open gates in IDT.
+    kprintf("IRQS: %u possible IRQs.\n", irqCount);
     for (uint8_t irq = 0; irq < irqCount; irq++)
-        idt_open_interrupt_gate(idt, irq + IRQ_OFFSET, (uintptr_t)_irq_common);
+        idt_open_interrupt_gate(idt, irq + IRQ_OFFSET, irqs_get_stub(irq + IRQ_OFFSET));
+    if (useLapic)
+        idt_open_interrupt_gate(idt, IRQ_VECTOR_IPI_CALL, irqs_get_stub(IRQ_VECTOR_IPI_CALL));
     kprintf("IRQS: Initialized!\n");
 }
@@ -0,0 +1,219 @@
+/*
+ * File: irqstat.c
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <main.h>
+#include <io.h>
+#include <kprint.h>
+#include <string.h>
+#include <kernel/interrupts/irqstat.h>
+
+#include <driver/serial.h>
+#include <kernel/percpu.h>
+#include <kernel/timer.h>
+#include <kernel/interrupts/smp.h>
+#include <kernel/memory/kheap.h>
+
+// The boot processor records into a static block until the per-processor blocks are allocated.
+static irqstat_proc_t bootStats;
+static irqstat_proc_t *bootStatsList[1] = { &bootStats };
+
+// Statistics for each processor, by index.
+static irqstat_proc_t **procStats = bootStatsList;
+static uint32_t procStatsCount = 1;
+
+void irqstat_enter(uint32_t procIndex, uint8_t irq, uint64_t entryTsc) {
+    if (procIndex >= procStatsCount || irq >= IRQ_VECTOR_COUNT)
+        return;
+
+    irqstat_proc_t *stats = procStats[procIndex];
+    stats->Vectors[irq].Count++;
+    stats->EntryTsc = entryTsc;
+    stats->EntryIrq = irq;
+    stats->InIrq = true;
+}
+
+void irqstat_exit(uint32_t procIndex) {
+    if (procIndex >= procStatsCount)
+        return;
+
+    // Charge the time since entry to the IRQ. This may be called twice for a tick that switched threads.
+    irqstat_proc_t *stats = procStats[procIndex];
+    if (!stats->InIrq)
+        return;
+    uint64_t cycles = cpu_tsc_read() - stats->EntryTsc;
+    irqstat_vector_t *vector = &stats->Vectors[stats->EntryIrq];
+    vector->HandlerCycles += cycles;
+    if (cycles > vector->MaxHandlerCycles)
+        vector->MaxHandlerCycles = cycles;
+    stats->InIrq = false;
+}
+
+static uint64_t irqstat_read_count(volatile uint64_t *count) {
+#ifdef X86_64
+    return *count;
+#else
+    // Counts are only bumped by their own processor, low half first. The halves are read separately
+    // here, so retry if the high half moved in between.
+    volatile uint32_t *halves = (volatile uint32_t*)count;
+    uint32_t low, high;
+    do {
+        high = halves[1];
+        low = halves[0];
+    } while (high != halves[1]);
+    return ((uint64_t)high << 32) | low;
+#endif
+}
+
+uint64_t irqstat_get_count(uint8_t irq) {
+    // Sum of all interrupts on all processors since boot.
+    uint64_t count = 0;
+    if (irq < IRQ_VECTOR_COUNT) {
+        for (uint32_t i = 0; i < procStatsCount; i++)
+            count += irqstat_read_count(&procStats[i]->Vectors[irq].Count);
+    }
+    return count;
+}
+
+void irqstat_reset(void) {
+    // Other processors may still be recording, so an interrupt or two in flight can land in the cleared counts.
+    for (uint32_t i = 0; i < procStatsCount; i++) {
+        for (uint16_t irq = 0; irq < IRQ_VECTOR_COUNT; irq++) {
+            irqstat_vector_t *vector = &procStats[i]->Vectors[irq];
+            vector->CountAtReset = irqstat_read_count(&vector->Count);
+            vector->HandlerCycles = 0;
+            vector->MaxHandlerCycles = 0;
+        }
+    }
+}
+
+static inline uint64_t irqstat_count_since_reset(irqstat_vector_t *vector) {
+    return irqstat_read_count(&vector->Count) - vector->CountAtReset;
+}
+
+static const char *irqstat_get_type(uint16_t irq) {
+    uint16_t vector = irq + IRQ_OFFSET;
+    if (vector == IRQ_VECTOR_IPI_CALL)
+        return "IPI call";
+    else if (vector >= IRQ_VECTOR_DYNAMIC_FIRST && vector <= IRQ_VECTOR_DYNAMIC_LAST)
+        return "MSI";
+    return "Line";
+}
+
+void irqstat_print(void) {
+    uint64_t tscPerMs = timer_tsc_rate();
+    const char *unit = (tscPerMs != 0) ? "ns" : "cycles";
+
+    kprintf("IRQ  Vector");
+    for (uint32_t i = 0; i < procStatsCount; i++)
+        kprintf("        CPU%-3u", i);
+    kprintf("  Avg %-6s  Max %-6s  Type\n", unit, unit);
+
+    // Only list vectors that have fired.
+    for (uint16_t irq = 0; irq < IRQ_VECTOR_COUNT; irq++) {
+        uint64_t count = 0, cycles = 0, maxCycles = 0;
+        for (uint32_t i = 0; i < procStatsCount; i++) {
+            irqstat_vector_t *vector = &procStats[i]->Vectors[irq];
+            count += irqstat_count_since_reset(vector);
+            cycles += vector->HandlerCycles;
+            if (vector->MaxHandlerCycles > maxCycles)
+                maxCycles = vector->MaxHandlerCycles;
+        }
+        if (count == 0)
+            continue;
+
+        kprintf("%3u  0x%2X  ", irq, irq + IRQ_OFFSET);
+        for (uint32_t i = 0; i < procStatsCount; i++)
+            kprintf("  %12llu", irqstat_count_since_reset(&procStats[i]->Vectors[irq]));
+        kprintf("  %10llu  %10llu  %s\n", timer_tsc_to_ns(cycles / count),
+            timer_tsc_to_ns(maxCycles), irqstat_get_type(irq));
+    }
+}
+
+void irqstat_export(void) {
+    if (!serial_present()) {
+        kprintf("IRQSTAT: Nothing to export.\n");
+        return;
+    }
+    kprintf("IRQSTAT: Exporting %u processors over serial...\n", procStatsCount);
+
+    irqstat_export_header_t header;
+    memcpy((uint8_t*)header.Magic, (uint8_t*)IRQSTAT_EXPORT_MAGIC, sizeof(header.Magic));
+    header.Version = IRQSTAT_EXPORT_VERSION;
+    header.ProcessorCount = procStatsCount;
+    header.TscPerMs = timer_tsc_rate();
+    header.RecordSize = sizeof(irqstat_export_record_t);
+    header.IrqOffset = IRQ_OFFSET;
+    serial_write_bytes(&header, sizeof(header));
+
+    for (uint32_t i = 0; i < procStatsCount; i++) {
+        // Statistics keep changing while they are sent, so counts are taken once and used for both the header and records.
+        irqstat_proc_t *stats = procStats[i];
+        irqstat_export_proc_t procHeader;
+        procHeader.Processor = i;
+        procHeader.RecordCount = 0;
+        static uint64_t counts[IRQ_VECTOR_COUNT];
+        for (uint16_t irq = 0; irq < IRQ_VECTOR_COUNT; irq++) {
+            counts[irq] = irqstat_count_since_reset(&stats->Vectors[irq]);
+            if (counts[irq] != 0)
+                procHeader.RecordCount++;
+        }
+        serial_write_bytes(&procHeader, sizeof(procHeader));
+
+        for (uint16_t irq = 0; irq < IRQ_VECTOR_COUNT; irq++) {
+            if (counts[irq] == 0)
+                continue;
+
+            irqstat_export_record_t record;
+            record.Vector = irq + IRQ_OFFSET;
+            record.Reserved = 0;
+            record.Count = counts[irq];
+            record.HandlerCycles = stats->Vectors[irq].HandlerCycles;
+            record.MaxHandlerCycles = stats->Vectors[irq].MaxHandlerCycles;
+            serial_write_bytes(&record, sizeof(record));
+        }
+    }
+
+    kprintf("\nIRQSTAT: Export complete.\n");
+}
+
+void irqstat_init(void) {
+    // Allocate statistics for each processor. The boot processor keeps what it has recorded so far.
+    uint32_t procCount = smp_get_proc_count();
+    uint32_t bspIndex = percpu_index();
+    irqstat_proc_t **stats = (irqstat_proc_t**)kheap_alloc(sizeof(irqstat_proc_t*) * procCount);
+    for (uint32_t i = 0; i < procCount; i++) {
+        if (i == bspIndex) {
+            stats[i] = &bootStats;
+            continue;
+        }
+        stats[i] = (irqstat_proc_t*)kheap_alloc(sizeof(irqstat_proc_t));
+        memset(stats[i], 0, sizeof(irqstat_proc_t));
+    }
+
+    // Publish the list before the count, so a processor that sees the new count finds its block.
+    procStats = stats;
+    asm volatile ("" : : : "memory");
+    procStatsCount = procCount;
+    kprintf("IRQSTAT: Recording interrupt statistics for %u processors.\n", procCount);
+}
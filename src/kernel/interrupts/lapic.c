@@ -35,6 +35,9 @@
 extern void _irq_empty(void);
 static void *lapicPointer;
 
+// Are registers accessed through MSRs instead of MMIO? Chosen by the BSP, and followed by every processor.
+static bool x2apicMode = false;
+
 bool lapic_supported(void) {
     // Check for the APIC feature.
     uint32_t result, unused;
@@ -51,7 +54,16 @@ uint32_t lapic_get_base(void) {
 
 bool lapic_x2apic(void) {
     // Determine if LAPIC is an x2APIC.
-    return (((uint32_t)cpu_msr_read(IA32_APIC_BASE_MSR)) & IA32_APIC_BASE_MSR_X2APIC);
+    uint32_t result, unused;
+    if (cpuid_query(CPUID_GETFEATURES, &unused, &unused, &result, &unused))
+        return result & CPUID_FEAT_ECX_x2APIC;
+
+    return false;
+}
+
+bool lapic_x2apic_enabled(void) {
+    // Determine if LAPIC is in x2APIC mode.
+    return x2apicMode;
 }
 
 bool lapic_enabled(void) {
@@ -61,41 +73,51 @@ bool lapic_enabled(void) {
 
 static uint32_t lapic_read(uint16_t offset) {
     // Read value from LAPIC.
+    if (x2apicMode)
+        return (uint32_t)cpu_msr_read(IA32_X2APIC_MSR(offset));
     return *(volatile uint32_t*)((uintptr_t)(lapicPointer + offset));
 }
 
 static void lapic_write(uint16_t offset, uint32_t value) {
-    // Send data to LAPIC.
-    *(volatile uint32_t*)((uintptr_t)(lapicPointer + offset)) = value;
-    (void)lapic_read(LAPIC_REG_ID);
+    // Send data to LAPIC. MMIO writes to the LAPIC are uncached, so they land in order without reading anything back.
+    if (x2apicMode)
+        cpu_msr_write(IA32_X2APIC_MSR(offset), value);
+    else
+        *(volatile uint32_t*)((uintptr_t)(lapicPointer + offset)) = value;
 }
 
-static void lapic_send_icr(lapic_icr_t icr) {
-    // Get ICR into two 32-bit values.
-    uint32_t *data = (uint32_t*)&icr;
+static void lapic_send_icr(lapic_icr_t icr, uint32_t apic) {
+    // Get low half of ICR. The destination is passed separately, as x2APIC IDs are 32 bits wide.
+    uint32_t low = ((uint32_t*)&icr)[0];
 
-    // Send ICR to LAPICs.
-    lapic_write(LAPIC_REG_INTERRUPT_CMD_HIGH, data[1]);
-    lapic_write(LAPIC_REG_INTERRUPT_CMD_LOW, data[0]);
+    if (x2apicMode) {
+        // The ICR is a single MSR, and there is no delivery status to wait on. Writes to x2APIC MSRs aren't
+        // serializing, so fence first to ensure the target sees anything stored before the IPI.
+        asm volatile ("mfence; lfence" : : : "memory");
+        cpu_msr_write(IA32_X2APIC_MSR(LAPIC_REG_INTERRUPT_CMD_LOW), ((uint64_t)apic << 32) | low);
+        return;
+    }
 
-    // Wait for signal from LAPIC.
-    while (lapic_read(LAPIC_REG_INTERRUPT_CMD_LOW) & (LAPIC_DELIVERY_STATUS_SEND_PENDING << 12));
+    // Wait for the last IPI to be sent, then send ICR to LAPICs.
+    while (lapic_read(LAPIC_REG_INTERRUPT_CMD_LOW) & (LAPIC_DELIVERY_STATUS_SEND_PENDING << 12))
+        asm volatile ("pause");
+    lapic_write(LAPIC_REG_INTERRUPT_CMD_HIGH, apic << 24);
+    lapic_write(LAPIC_REG_INTERRUPT_CMD_LOW, low);
 }
 
-void lapic_send_init(uint8_t apic) {
+void lapic_send_init(uint32_t apic) {
     // Send INIT to specified APIC.
     lapic_icr_t icr = {};
     icr.DeliveryMode = LAPIC_DELIVERY_INIT;
     icr.DestinationMode = LAPIC_DEST_MODE_PHYSICAL;
     icr.TriggerMode = LAPIC_TRIGGER_EDGE;
     icr.Level = LAPIC_LEVEL_ASSERT;
-    icr.Destination = apic;
 
     // Send ICR.
-    lapic_send_icr(icr);;
+    lapic_send_icr(icr, apic);
 }
 
-void lapic_send_startup(uint8_t apic, uint8_t vector) {
+void lapic_send_startup(uint32_t apic, uint8_t vector) {
     // Send startup to specified APIC.
     lapic_icr_t icr = {};
     icr.Vector = vector;
@@ -103,10 +125,47 @@ void lapic_send_startup(uint8_t apic, uint8_t vector) {
     icr.DestinationMode = LAPIC_DEST_MODE_PHYSICAL;
     icr.TriggerMode = LAPIC_TRIGGER_EDGE;
     icr.Level = LAPIC_LEVEL_ASSERT;
-    icr.Destination = apic;
 
     // Send ICR.
-    lapic_send_icr(icr);
+    lapic_send_icr(icr, apic);
+}
+
+void lapic_send_init_all(void) {
+    // Send INIT to all LAPICs but ourself.
+    lapic_icr_t icr = {};
+    icr.DeliveryMode = LAPIC_DELIVERY_INIT;
+    icr.TriggerMode = LAPIC_TRIGGER_EDGE;
+    icr.DestinationShorthand = LAPIC_DEST_SHORTHAND_ALL_BUT_SELF;
+    icr.Level = LAPIC_LEVEL_ASSERT;
+
+    // Send ICR.
+    lapic_send_icr(icr, 0);
+}
+
+void lapic_send_startup_all(uint8_t vector) {
+    // Send startup to all LAPICs but ourself.
+    lapic_icr_t icr = {};
+    icr.Vector = vector;
+    icr.DeliveryMode = LAPIC_DELIVERY_STARTUP;
+    icr.TriggerMode = LAPIC_TRIGGER_EDGE;
+    icr.DestinationShorthand = LAPIC_DEST_SHORTHAND_ALL_BUT_SELF;
+    icr.Level = LAPIC_LEVEL_ASSERT;
+
+    // Send ICR.
+    lapic_send_icr(icr, 0);
+}
+
+void lapic_send_ipi(uint32_t apic, uint8_t vector) {
+    // Send fixed interrupt to specified APIC.
+    lapic_icr_t icr = {};
+    icr.Vector = vector;
+    icr.DeliveryMode = LAPIC_DELIVERY_FIXED;
+    icr.DestinationMode = LAPIC_DEST_MODE_PHYSICAL;
+    icr.TriggerMode = LAPIC_TRIGGER_EDGE;
+    icr.Level = LAPIC_LEVEL_ASSERT;
+
+    // Send ICR.
+    lapic_send_icr(icr, apic);
 }
 
 void lapic_send_nmi_all(void) {
@@ -118,30 +177,21 @@ void lapic_send_nmi_all(void) {
     icr.Level = LAPIC_LEVEL_ASSERT;
 
     // Send ICR.
-    lapic_send_icr(icr);
+    lapic_send_icr(icr, 0);
 }
 
-uint32_t lapic_timer_get_rate(void) {
-    // Set divider to 16.
-    kprintf("LAPIC: Calculating tick rate for timer...\n");
+void lapic_timer_count_start(void) {
+    // Count down from the top with the same divider the timer runs with, without raising interrupts.
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_MASKED | (IRQ_OFFSET + IRQ_TIMER));
     lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE16);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, 0xFFFFFFFF);
+}
 
-    uint32_t averageCount = 0;
-    for (uint8_t i = 0; i < 20; i++) {
-        // Reset initial count to 0xFFFFFFFF.
-        lapic_write(LAPIC_REG_TIMER_INITIAL, 0xFFFFFFFF);
-        lapic_write(LAPIC_REG_TIMER_CURRENT, 0xFFFFFFFF);
-
-        // Wait for 100 ms and get current count.
-        sleep(100);
-        averageCount += 0xFFFFFFFF - lapic_read(LAPIC_REG_TIMER_CURRENT);
-        lapic_write(LAPIC_REG_TIMER_INITIAL, 0);
-        lapic_write(LAPIC_REG_TIMER_CURRENT, 0);
-    }  
-
-    averageCount = averageCount / 20;
-    kprintf("LAPIC: Timer ticked %u times on average in 100ms.\n", averageCount);
-    return averageCount / 100;
+uint32_t lapic_timer_count_stop(void) {
+    // Get number of timer ticks since lapic_timer_count_start() and stop the timer.
+    uint32_t count = 0xFFFFFFFF - lapic_read(LAPIC_REG_TIMER_CURRENT);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, 0);
+    return count;
 }
 
 void lapic_timer_start(uint32_t rate) {
@@ -151,8 +201,30 @@ void lapic_timer_start(uint32_t rate) {
     lapic_write(LAPIC_REG_TIMER_INITIAL, rate);
 }
 
+void lapic_timer_start_oneshot(bool tscDeadline) {
+    // Put timer in one-shot or TSC-deadline mode. Nothing fires until the timer is armed.
+    lapic_write(LAPIC_REG_LVT_TIMER, (tscDeadline ? LAPIC_TIMER_MODE_TSC : LAPIC_TIMER_MODE_ONESHOT) | (IRQ_OFFSET + IRQ_TIMER));
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE16);
+
+    // Ensure the mode change lands before any write to the deadline MSR.
+    if (tscDeadline)
+        asm volatile ("mfence" : : : "memory");
+}
+
+void lapic_timer_arm(uint32_t count) {
+    // Fire once after the specified count. 0 stops the timer.
+    lapic_write(LAPIC_REG_TIMER_INITIAL, count);
+}
+
+void lapic_timer_arm_deadline(uint64_t tsc) {
+    // Fire once the TSC reaches the specified value. 0 stops the timer.
+    cpu_msr_write(IA32_TSC_DEADLINE_MSR, tsc);
+}
+
 uint32_t lapic_id(void) {
-    // Get ID if LAPIC is configured, otherwise return 0.
+    // Get ID if LAPIC is configured, otherwise return 0. x2APIC IDs take up the whole register.
+    if (x2apicMode)
+        return lapic_read(LAPIC_REG_ID);
     return lapicPointer != NULL ? lapic_read(LAPIC_REG_ID) >> 24 : 0;
 }
 
@@ -171,41 +243,50 @@ void lapic_eoi(void) {
     lapic_write(LAPIC_REG_EOI, 0);
 }
 
-int16_t lapic_get_irq(void) {
-    // Check each ISR register for a bit set.
-    for (uint8_t i = 0; i < 8; i++) {
-        // Read In-Service register and check for bits.
-        uint32_t isr = lapic_read(LAPIC_REG_INSERVICE + (i * 0x10));
-        if (isr)
-            return ((i * 32) + __builtin_ctz(isr)) - IRQ_OFFSET;
-    }
-
-    // No IRQs are set.
-    return -1;
-}
-
 void lapic_setup(void) {
     // Map LAPIC and get info.
-    kprintf("LAPIC: x2 APIC: %s\n", lapic_x2apic() ? "yes" : "no");
+    kprintf("LAPIC: x2 APIC: %s\n", x2apicMode ? "yes" : "no");
     kprintf("LAPIC: ID: %u\n", lapic_id());
     kprintf("LAPIC: Version: 0x%x\n", lapic_version());
     kprintf("LAPIC: Max LVT entry: 0x%x\n", lapic_max_lvt());
 
-    // Configure LAPIC.
+    // Configure LAPIC. In x2APIC mode the logical destination is fixed and there is no destination format register.
     lapic_write(LAPIC_REG_TASK_PRIORITY, 0x00);
-    lapic_write(LAPIC_REG_DEST_FORMAT, 0xFFFFFFFF);
-    lapic_write(LAPIC_REG_LOGICAL_DEST, 1 << 24);
+    if (!x2apicMode) {
+        lapic_write(LAPIC_REG_DEST_FORMAT, 0xFFFFFFFF);
+        lapic_write(LAPIC_REG_LOGICAL_DEST, 1 << 24);
+    }
 
     // Create spurious interrupt.
     lapic_write(LAPIC_REG_SPURIOUS_INT_VECTOR, LAPIC_SPURIOUS_INT | 0x100);
 }
 
+void lapic_mode_init(void) {
+    // Put this processor's LAPIC into x2APIC mode if that's what the BSP chose. It has to be enabled in xAPIC mode first.
+    if (!x2apicMode)
+        return;
+
+    uint64_t base = cpu_msr_read(IA32_APIC_BASE_MSR);
+    if (!(base & IA32_APIC_BASE_MSR_ENABLE)) {
+        base |= IA32_APIC_BASE_MSR_ENABLE;
+        cpu_msr_write(IA32_APIC_BASE_MSR, base);
+    }
+    if (!(base & IA32_APIC_BASE_MSR_X2APIC))
+        cpu_msr_write(IA32_APIC_BASE_MSR, base | IA32_APIC_BASE_MSR_X2APIC);
+}
+
 void lapic_init(void) {
-    // Get the base address of the local APIC and map it.
-    uint32_t base = lapic_get_base();
-    lapicPointer = paging_device_alloc(base, base);
-    
-    kprintf("LAPIC: Mapped LAPIC at 0x%X to 0x%p...\n", base, lapicPointer);
+    // Use x2APIC mode if it's supported, as MSR access avoids MMIO. Otherwise get the base address of the local APIC and map it.
+    x2apicMode = lapic_x2apic();
+    if (x2apicMode) {
+        lapic_mode_init();
+        kprintf("LAPIC: Using x2APIC mode...\n");
+    }
+    else {
+        uint32_t base = lapic_get_base();
+        lapicPointer = paging_device_alloc(base, base);
+        kprintf("LAPIC: Mapped LAPIC at 0x%X to 0x%p...\n", base, lapicPointer);
+    }
     //idt_open_interrupt_gate(LAPIC_SPURIOUS_INT, (uintptr_t)_irq_empty);
 
     lapic_setup();
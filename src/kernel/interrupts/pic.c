@@ -93,6 +93,31 @@ void pic_disable(void) {
     kprintf("PIC: Disabled!\n");
 }
 
+// Masks or unmasks a single IRQ.
+void pic_set_masked(uint8_t irq, bool masked) {
+    // Get PIC the IRQ is on.
+    uint16_t port = PIC1_DATA;
+    if (irq >= 8) {
+        port = PIC2_DATA;
+        irq -= 8;
+    }
+
+    // Update mask.
+    uint8_t mask = inb(port);
+    if (masked)
+        mask |= (1 << irq);
+    else
+        mask &= ~(1 << irq);
+    outb(port, mask);
+}
+
+// Checks if an IRQ is level triggered, as set up by the firmware for PCI lines.
+bool pic_is_level_triggered(uint8_t irq) {
+    if (irq >= 8)
+        return inb(PIC_ELCR2) & (1 << (irq - 8));
+    return inb(PIC_ELCR1) & (1 << irq);
+}
+
 // Sends an EOI to the PICs.
 void pic_eoi(uint32_t irq) {
     // If the IRQ was greater than 7 (IRQ 8 to 15),
@@ -28,6 +28,7 @@
 #include <string.h>
 #include <tools.h>
 #include <kernel/interrupts/smp.h>
+#include <kernel/interrupts/smpcall.h>
 
 #include <acpi.h>
 #include <kernel/gdt.h>
@@ -36,10 +37,14 @@
 #include <kernel/interrupts/ioapic.h>
 #include <kernel/interrupts/lapic.h>
 #include <kernel/interrupts/irqs.h>
+#include <kernel/interrupts/irqstat.h>
+#include <kernel/percpu.h>
 #include <kernel/memory/kheap.h>
 #include <kernel/memory/pmm.h>
 #include <kernel/memory/paging.h>
+#include <kernel/multitasking/rcu.h>
 #include <kernel/tasking.h>
+#include <kernel/timer.h>
 
 // https://wiki.osdev.org/SMP
 // http://ethv.net/workshops/osdev/notes/notes-5
@@ -49,7 +54,8 @@ extern uintptr_t _ap_bootstrap_end;
 
 static bool smpInitialized;
 
-// List of processors.
+// List of processors. Entries are published with RCU and never freed, so readers need no
+// read-side section. That matters as APs look themselves up before their per-CPU data exists.
 static uint32_t procCount = 1;
 static smp_proc_t *processors = NULL;
 
@@ -62,18 +68,34 @@ uint32_t smp_get_proc_count(void) {
 
 smp_proc_t *smp_get_proc(uint32_t apicId) {
     // Search for specified APIC ID and return the processor object..
-    smp_proc_t *currentProc = processors;
+    smp_proc_t *currentProc = rcu_dereference(processors);
     while (currentProc != NULL) {
         if (currentProc->ApicId == apicId)
             return currentProc;
-        currentProc = currentProc->Next;
+        currentProc = rcu_dereference(currentProc->Next);
     }
 
     // Couldn't find it.
     return NULL;
 }
 
-uint32_t smp_ap_get_stack(uint32_t apicId) {
+smp_proc_t *smp_get_proc_index(uint32_t index) {
+    // Search for specified index and return the processor object.
+    smp_proc_t *currentProc = rcu_dereference(processors);
+    while (currentProc != NULL) {
+        if (currentProc->Index == index)
+            return currentProc;
+        currentProc = rcu_dereference(currentProc->Next);
+    }
+
+    // Couldn't find it.
+    return NULL;
+}
+
+uintptr_t smp_ap_get_stack(void) {
+    // Switch LAPIC into the same mode as the BSP's before reading our ID, as this is the first thing an AP does.
+    lapic_mode_init();
+    uint32_t apicId = lapic_id();
     smp_proc_t *proc = smp_get_proc(apicId);
 
     if (proc == NULL)
@@ -81,13 +103,6 @@ uint32_t smp_ap_get_stack(uint32_t apicId) {
     return apStacks[proc->Index];
 }
 
-static bool test(irq_regs_t *regs, uint8_t irqNum, uint32_t procIndex) {
-    // Change tasks every 5ms.
-	if (timer_ticks() % 5 == 0)
-		tasking_tick(regs, procIndex);
-	return true;
-}
-
 void smp_ap_main(void) {
     // Reload paging directory.
     paging_change_directory(memInfo.kernelPageDirectory);
@@ -121,16 +136,17 @@ void smp_ap_main(void) {
     gdt_tss_load(tss);
 #endif
 
+    // Set up this processor's data block.
+    percpu_init_ap(proc->Index, proc->ApicId);
+
     // Initialize interrupts.
     interrupts_init_ap();
     lapic_setup();
 
-    // Start LAPIC timer.
-    lapic_timer_start(lapic_timer_get_rate());
+    // Start LAPIC timer, which also handles task switching, and take cross-processor calls from here on.
+    timer_init_ap();
+    smp_call_init_ap();
 
-    // Install handler for IRQ0 to handle task switching.
-    irqs_install_handler(IRQ_TIMER, test);
-    
     // Initialize and start tasking.
     tasking_init_ap();
 
@@ -191,6 +207,9 @@ static void smp_setup_apboot(void) {
     memset((void*)(memInfo.kernelVirtualOffset + SMP_PAGING_PAE_ADDRESS), memInfo.paeEnabled ? 1 : 0, sizeof(uint32_t));
 #endif
 
+    // Clear the lock APs take while on the shared bootstrap stack.
+    memset((void*)(memInfo.kernelVirtualOffset + SMP_AP_LOCK_ADDRESS), 0, sizeof(uint32_t));
+
     // Copy AP bootstrap code into low memory.
     memcpy((void*)(memInfo.kernelVirtualOffset + SMP_AP_BOOTSTRAP_ADDRESS), (void*)apStart, apSize);
 }
@@ -214,6 +233,7 @@ void smp_init(void) {
 
     // Search for LAPICs (processors) in ACPI.
     procCount = 0;
+    uint32_t disabledCount = 0;
     kprintf("SMP: Looking for processors...\n");
     ACPI_MADT_LOCAL_APIC *acpiCpu = (ACPI_MADT_LOCAL_APIC*)acpi_search_madt(ACPI_MADT_TYPE_LOCAL_APIC, 8, 0);
     while (acpiCpu != NULL) {
@@ -222,6 +242,8 @@ void smp_init(void) {
         // Add to count.
         if (acpiCpu->LapicFlags & ACPI_MADT_ENABLED)
             procCount++;
+        else
+            disabledCount++;
         acpiCpu = (ACPI_MADT_LOCAL_APIC*)acpi_search_madt(ACPI_MADT_TYPE_LOCAL_APIC, 8, ((uintptr_t)acpiCpu) + 1);
     }
 
@@ -249,9 +271,9 @@ void smp_init(void) {
 
             // Add to processor list.
             if (lastProc != NULL)
-                lastProc->Next = proc;
+                rcu_assign_pointer(lastProc->Next, proc);
             else
-                processors = lastProc = proc;
+                rcu_assign_pointer(processors, proc);
             lastProc = proc;
             currentCpu++;
         }
@@ -260,38 +282,56 @@ void smp_init(void) {
         acpiCpu = (ACPI_MADT_LOCAL_APIC*)acpi_search_madt(ACPI_MADT_TYPE_LOCAL_APIC, 8, ((uintptr_t)acpiCpu) + 1);
     }
 
-    kprintf("SMP: Waiting two seconds for verification...\n");
-    sleep(2000);
+    // Create per-CPU data table, as the APs fill it in as they come up. Same for cross-processor call state and interrupt statistics.
+    percpu_init_smp();
+    smp_call_init();
+    irqstat_init();
 
     // Initialize boot code and stacks for APs.
     kprintf("SMP: Initializing %u processors...\n", procCount);
     smp_setup_apboot();
     smp_setup_stacks();
 
-    // Initialize each processor.
-    smp_proc_t *currentProc = processors;
-    while (currentProc != NULL) {
-        // No need to initialize the BSP (current processor).
-        if (currentProc->ApicId == lapic_id()) {
-            currentProc->Started = true;
-            currentProc = currentProc->Next;
-            continue;
-        }
-
-        // Send INIT command to processor (AP).
-        kprintf("SMP: Sending INIT to LAPIC %u on processor %u\n", currentProc->ApicId, currentProc->Index);
-        lapic_send_init(currentProc->ApicId);
-
-        // Wait 10ms.
+    // No need to initialize the BSP (current processor).
+    smp_proc_t *bspProc = smp_get_proc(lapic_id());
+    if (bspProc == NULL)
+        panic("SMP: BSP (APIC %u) is not in the ACPI!\n", lapic_id());
+    bspProc->Started = true;
+
+    // Start all APs at once. Broadcasting is only safe if every processor in the ACPI is enabled,
+    // as each AP that wakes up must be able to find itself in the list.
+    uint8_t startupVector = SMP_AP_BOOTSTRAP_ADDRESS / PAGE_SIZE_4K;
+    if (disabledCount == 0) {
+        kprintf("SMP: Broadcasting INIT and STARTUP to all APs\n");
+        lapic_send_init_all();
         sleep(10);
+        lapic_send_startup_all(startupVector);
+    }
+    else {
+        kprintf("SMP: Sending INIT and STARTUP to each AP\n");
+        for (smp_proc_t *currentProc = processors; currentProc != NULL; currentProc = currentProc->Next)
+            if (!currentProc->Started)
+                lapic_send_init(currentProc->ApicId);
+        sleep(10);
+        for (smp_proc_t *currentProc = processors; currentProc != NULL; currentProc = currentProc->Next)
+            if (!currentProc->Started)
+                lapic_send_startup(currentProc->ApicId, startupVector);
+    }
 
-        // Send STARTUP command to processor (AP).
-        kprintf("SMP: Sending STARTUP to LAPIC %u on processor %u\n", currentProc->ApicId, currentProc->Index);
-        lapic_send_startup(currentProc->ApicId, SMP_AP_BOOTSTRAP_ADDRESS / PAGE_SIZE_4K);
-
-        // Wait for processor to come up and move to next one.
-        while (!currentProc->Started);
-        currentProc = currentProc->Next;
+    // Send a second STARTUP to any AP that missed the first. APs already running the bootstrap ignore it.
+    sleep(1);
+    for (smp_proc_t *currentProc = processors; currentProc != NULL; currentProc = currentProc->Next)
+        if (!currentProc->Started)
+            lapic_send_startup(currentProc->ApicId, startupVector);
+
+    // Wait for all processors to come up. They finish initializing in parallel after this.
+    uint64_t startTicks = timer_ticks();
+    for (smp_proc_t *currentProc = processors; currentProc != NULL; currentProc = currentProc->Next) {
+        while (!currentProc->Started) {
+            if (timer_ticks() - startTicks > SMP_AP_START_TIMEOUT)
+                panic("SMP: Processor %u (APIC %u) failed to start!\n", currentProc->Index, currentProc->ApicId);
+            asm volatile ("pause");
+        }
     }
 
     // Destroy AP boot code.
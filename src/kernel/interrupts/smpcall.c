@@ -0,0 +1,224 @@
+/*
+ * File: smpcall.c
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <main.h>
+#include <kprint.h>
+#include <io.h>
+#include <string.h>
+#include <kernel/interrupts/smpcall.h>
+
+#include <kernel/percpu.h>
+#include <kernel/timer.h>
+#include <kernel/interrupts/interrupts.h>
+#include <kernel/interrupts/irqs.h>
+#include <kernel/interrupts/lapic.h>
+#include <kernel/interrupts/smp.h>
+#include <kernel/memory/kheap.h>
+
+// Call state for each processor. If SMP isn't up this is NULL, and calls only run locally.
+static uint32_t callProcCount = 0;
+static smp_call_proc_t *callProcs = NULL;
+
+static void smp_call_run(uint32_t procIndex) {
+    // Take the whole queue and put it back in the order it was queued.
+    smp_call_proc_t *proc = &callProcs[procIndex];
+    smp_call_slot_t *slot = __sync_lock_test_and_set(&proc->Queue, NULL);
+    smp_call_slot_t *ordered = NULL;
+    while (slot != NULL) {
+        smp_call_slot_t *next = slot->Next;
+        slot->Next = ordered;
+        ordered = slot;
+        slot = next;
+    }
+
+    while (ordered != NULL) {
+        // Copy request out, as the sender can reuse the slot as soon as it's released.
+        smp_call_slot_t *next = ordered->Next;
+        smp_call_func_t func = ordered->Func;
+        uintptr_t data = ordered->Data;
+        volatile uint32_t *pending = ordered->Pending;
+
+        uint64_t latency = cpu_tsc_read() - ordered->QueuedTsc;
+        proc->CallsRun++;
+        proc->LatencyCycles += latency;
+        if (latency > proc->MaxLatencyCycles)
+            proc->MaxLatencyCycles = latency;
+
+        // Asynchronous slots are released before the call, synchronous ones only once it's done.
+        if (pending == NULL) {
+            asm volatile ("" : : : "memory");
+            ordered->Busy = false;
+            func(data);
+        }
+        else {
+            func(data);
+            asm volatile ("" : : : "memory");
+            ordered->Busy = false;
+            __sync_sub_and_fetch(pending, 1);
+        }
+        ordered = next;
+    }
+}
+
+static void smp_call_send(uint32_t procIndex, uint32_t targetIndex, smp_call_func_t func, uintptr_t data, volatile uint32_t *pending) {
+    // Interrupts must be off. Wait for the target to take our last request, running our own queue meanwhile
+    // in case the target is waiting on us in turn.
+    smp_call_proc_t *sender = &callProcs[procIndex];
+    smp_call_slot_t *slot = &sender->Slots[targetIndex];
+    while (slot->Busy) {
+        smp_call_run(procIndex);
+        asm volatile ("pause");
+    }
+
+    // Fill slot. The pending count is raised first, as the target may finish before we return.
+    slot->Func = func;
+    slot->Data = data;
+    slot->Pending = pending;
+    slot->QueuedTsc = cpu_tsc_read();
+    slot->Busy = true;
+    if (pending != NULL)
+        __sync_add_and_fetch(pending, 1);
+    sender->CallsSent++;
+
+    // Push onto the target's queue. Only the first request on an empty queue needs an IPI, the rest ride along with it.
+    smp_call_proc_t *target = &callProcs[targetIndex];
+    smp_call_slot_t *head;
+    do {
+        head = target->Queue;
+        slot->Next = head;
+    } while (!__sync_bool_compare_and_swap(&target->Queue, head, slot));
+
+    if (head == NULL) {
+        lapic_send_ipi(smp_get_proc_index(targetIndex)->ApicId, IRQ_VECTOR_IPI_CALL);
+        sender->IpisSent++;
+    }
+}
+
+static void smp_call_many(smp_cpumask_t mask, bool all, bool others, smp_call_func_t func, uintptr_t data, bool wait) {
+    // Waiting with interrupts off could deadlock against a processor waiting on us.
+    if (wait && !interrupts_enabled())
+        panic("SMPCALL: Synchronous call made with interrupts disabled!\n");
+
+    // Stay on this processor while requests are queued from its slots.
+    uintptr_t flags = interrupts_save_disable();
+    uint32_t procIndex = percpu_index();
+    volatile uint32_t pending = 0;
+    for (uint32_t i = 0; i < callProcCount; i++) {
+        if (i == procIndex || !callProcs[i].Online)
+            continue;
+        if (!all && (i >= SMP_CPUMASK_MAX || !(mask & SMP_CPUMASK(i))))
+            continue;
+        smp_call_send(procIndex, i, func, data, wait ? &pending : NULL);
+    }
+
+    // Run locally with interrupts off, the same as on the other processors.
+    if (all ? !others : (procIndex < SMP_CPUMASK_MAX && (mask & SMP_CPUMASK(procIndex))))
+        func(data);
+    interrupts_restore(flags);
+
+    // Wait for the other processors to finish.
+    while (pending != 0)
+        asm volatile ("pause");
+}
+
+bool smp_call_function_single(uint32_t procIndex, smp_call_func_t func, uintptr_t data, bool wait) {
+    if (wait && !interrupts_enabled())
+        panic("SMPCALL: Synchronous call made with interrupts disabled!\n");
+
+    // Run directly if the target is us, otherwise queue it up. Processors that aren't online can't be called.
+    uintptr_t flags = interrupts_save_disable();
+    uint32_t currentIndex = percpu_index();
+    volatile uint32_t pending = 0;
+    bool called = true;
+    if (procIndex == currentIndex)
+        func(data);
+    else if (procIndex < callProcCount && callProcs[procIndex].Online)
+        smp_call_send(currentIndex, procIndex, func, data, wait ? &pending : NULL);
+    else
+        called = false;
+    interrupts_restore(flags);
+
+    while (pending != 0)
+        asm volatile ("pause");
+    return called;
+}
+
+void smp_call_function_mask(smp_cpumask_t mask, smp_call_func_t func, uintptr_t data, bool wait) {
+    smp_call_many(mask, false, false, func, data, wait);
+}
+
+void smp_call_function_all(smp_call_func_t func, uintptr_t data, bool wait) {
+    smp_call_many(0, true, false, func, data, wait);
+}
+
+void smp_call_function_others(smp_call_func_t func, uintptr_t data, bool wait) {
+    smp_call_many(0, true, true, func, data, wait);
+}
+
+void smp_call_ipi(uint32_t procIndex) {
+    // Called from the IRQ handler.
+    if (callProcs == NULL)
+        return;
+    callProcs[procIndex].IpisReceived++;
+    smp_call_run(procIndex);
+}
+
+void smp_call_print_stats(void) {
+    if (callProcs == NULL) {
+        kprintf("SMPCALL: SMP is not initialized.\n");
+        return;
+    }
+
+    uint64_t tscPerMs = timer_tsc_rate();
+    const char *unit = (tscPerMs != 0) ? "ns" : "cycles";
+    for (uint32_t i = 0; i < callProcCount; i++) {
+        smp_call_proc_t *proc = &callProcs[i];
+        uint64_t avgLatency = (proc->CallsRun != 0) ? (proc->LatencyCycles / proc->CallsRun) : 0;
+        kprintf("Processor %u: sent %llu calls with %llu IPIs, ran %llu calls from %llu IPIs\n",
+            i, proc->CallsSent, proc->IpisSent, proc->CallsRun, proc->IpisReceived);
+        kprintf("  latency avg %llu %s, max %llu %s\n", timer_tsc_to_ns(avgLatency), unit,
+            timer_tsc_to_ns(proc->MaxLatencyCycles), unit);
+    }
+}
+
+void smp_call_init_ap(void) {
+    // Interrupts and the LAPIC are up, so this processor can take calls.
+    callProcs[percpu_index()].Online = true;
+}
+
+void smp_call_init(void) {
+    // Create call state for each processor, before any APs are started.
+    callProcCount = smp_get_proc_count();
+    smp_call_proc_t *procs = (smp_call_proc_t*)kheap_alloc(sizeof(smp_call_proc_t) * callProcCount);
+    memset(procs, 0, sizeof(smp_call_proc_t) * callProcCount);
+    for (uint32_t i = 0; i < callProcCount; i++) {
+        procs[i].Slots = (smp_call_slot_t*)kheap_alloc(sizeof(smp_call_slot_t) * callProcCount);
+        memset(procs[i].Slots, 0, sizeof(smp_call_slot_t) * callProcCount);
+    }
+
+    // The BSP is ready now.
+    procs[percpu_index()].Online = true;
+    callProcs = procs;
+    kprintf("SMPCALL: Initialized for %u processors.\n", callProcCount);
+}
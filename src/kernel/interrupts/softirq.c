@@ -0,0 +1,189 @@
+/*
+ * File: softirq.c
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <main.h>
+#include <kprint.h>
+#include <string.h>
+#include <kernel/interrupts/softirq.h>
+
+#include <kernel/percpu.h>
+#include <kernel/interrupts/interrupts.h>
+#include <kernel/interrupts/smp.h>
+#include <kernel/memory/kheap.h>
+
+// Per-processor state, and handlers shared by all processors.
+static softirq_proc_t *softirqProcs = NULL;
+static uint32_t softirqProcCount = 0;
+static softirq_handler_t softirqHandlers[SOFTIRQ_COUNT];
+
+void softirq_register(uint8_t vector, softirq_handler_t handler) {
+    if (vector >= SOFTIRQ_COUNT)
+        panic("SOFTIRQ: Vector %u out of range.\n", vector);
+    softirqHandlers[vector] = handler;
+}
+
+void softirq_raise(uint8_t vector) {
+    if (softirqProcs == NULL)
+        return;
+
+    uint32_t procIndex = percpu_index();
+    __sync_fetch_and_or(&softirqProcs[procIndex].Pending, 1 << vector);
+
+    // Inside an IRQ the softirq runs on exit, otherwise there's nothing to wait for.
+    if (interrupts_enabled())
+        softirq_run(procIndex);
+}
+
+bool softirq_active(uint32_t procIndex) {
+    return softirqProcs != NULL && procIndex < softirqProcCount && softirqProcs[procIndex].Active;
+}
+
+bool softirq_pending(uint32_t procIndex) {
+    return softirqProcs != NULL && procIndex < softirqProcCount && softirqProcs[procIndex].Pending != 0;
+}
+
+void softirq_run(uint32_t procIndex) {
+    if (softirqProcs == NULL || procIndex >= softirqProcCount)
+        return;
+
+    // Softirqs don't nest. An IRQ that interrupts one leaves its work for the running loop to pick up.
+    uintptr_t flags = interrupts_save_disable();
+    softirq_proc_t *proc = &softirqProcs[procIndex];
+    if (proc->Active || proc->Pending == 0) {
+        interrupts_restore(flags);
+        return;
+    }
+    proc->Active = true;
+
+    // Run handlers with interrupts on, so hard IRQs aren't held up.
+    for (uint32_t restart = 0; restart < SOFTIRQ_MAX_RESTART; restart++) {
+        uint32_t pending = __sync_lock_test_and_set(&proc->Pending, 0);
+        if (pending == 0)
+            break;
+
+        interrupts_enable_quiet();
+        for (uint8_t vector = 0; vector < SOFTIRQ_COUNT; vector++) {
+            if ((pending & (1 << vector)) && softirqHandlers[vector] != NULL)
+                softirqHandlers[vector](procIndex);
+        }
+        interrupts_disable_quiet();
+    }
+
+    proc->Active = false;
+    interrupts_restore(flags);
+}
+
+//
+// Tasklets.
+//
+void tasklet_init(tasklet_t *tasklet, tasklet_func_t func, uintptr_t data) {
+    tasklet->Next = NULL;
+    tasklet->Func = func;
+    tasklet->Data = data;
+    tasklet->Scheduled = false;
+    tasklet->Running = false;
+}
+
+static void tasklet_list_add(tasklet_t *tasklet, bool hi) {
+    // Add to this processor's list. Interrupts are off so an IRQ can't touch the list at the same time.
+    uintptr_t flags = interrupts_save_disable();
+    uint32_t procIndex = percpu_index();
+    tasklet_list_t *list = hi ? &softirqProcs[procIndex].HiTasklets : &softirqProcs[procIndex].Tasklets;
+    tasklet->Next = NULL;
+    if (list->Tail != NULL)
+        list->Tail->Next = tasklet;
+    else
+        list->Head = tasklet;
+    list->Tail = tasklet;
+    interrupts_restore(flags);
+
+    softirq_raise(hi ? SOFTIRQ_HI_TASKLET : SOFTIRQ_TASKLET);
+}
+
+static void tasklet_add(tasklet_t *tasklet, bool hi) {
+    // A tasklet already waiting to run isn't queued twice.
+    if (__sync_lock_test_and_set(&tasklet->Scheduled, true))
+        return;
+
+    // Before softirqs are up, just run it.
+    if (softirqProcs == NULL) {
+        tasklet->Scheduled = false;
+        tasklet->Func(tasklet->Data);
+        return;
+    }
+    tasklet_list_add(tasklet, hi);
+}
+
+void tasklet_schedule(tasklet_t *tasklet) {
+    tasklet_add(tasklet, false);
+}
+
+void tasklet_hi_schedule(tasklet_t *tasklet) {
+    tasklet_add(tasklet, true);
+}
+
+static void tasklet_run_list(tasklet_list_t *list, bool hi) {
+    // Take the whole list, tasklets scheduled while these run go on a fresh one.
+    uintptr_t flags = interrupts_save_disable();
+    tasklet_t *tasklet = list->Head;
+    list->Head = list->Tail = NULL;
+    interrupts_restore(flags);
+
+    while (tasklet != NULL) {
+        tasklet_t *nextTasklet = tasklet->Next;
+
+        // If another processor is running this tasklet, try again later.
+        if (__sync_lock_test_and_set(&tasklet->Running, true)) {
+            tasklet_list_add(tasklet, hi);
+            tasklet = nextTasklet;
+            continue;
+        }
+
+        // Clear the flag first so the tasklet can reschedule itself.
+        tasklet->Scheduled = false;
+        tasklet->Func(tasklet->Data);
+        __sync_lock_release(&tasklet->Running);
+        tasklet = nextTasklet;
+    }
+}
+
+static void softirq_hi_tasklet_handler(uint32_t procIndex) {
+    tasklet_run_list(&softirqProcs[procIndex].HiTasklets, true);
+}
+
+static void softirq_tasklet_handler(uint32_t procIndex) {
+    tasklet_run_list(&softirqProcs[procIndex].Tasklets, false);
+}
+
+void softirq_init(void) {
+    // Create state for each processor.
+    softirqProcCount = smp_get_proc_count();
+    softirq_proc_t *procs = (softirq_proc_t*)kheap_alloc(sizeof(softirq_proc_t) * softirqProcCount);
+    memset(procs, 0, sizeof(softirq_proc_t) * softirqProcCount);
+
+    softirq_register(SOFTIRQ_HI_TASKLET, softirq_hi_tasklet_handler);
+    softirq_register(SOFTIRQ_TASKLET, softirq_tasklet_handler);
+    softirqProcs = procs;
+    kprintf("SOFTIRQ: Initialized for %u processors.\n", softirqProcCount);
+}
@@ -0,0 +1,174 @@
+/*
+ * File: lock.c
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <main.h>
+#include <kernel/lock.h>
+
+#include <io.h>
+#include <kernel/lockstat.h>
+#include <kernel/percpu.h>
+
+static inline uintptr_t spinlock_interrupts_save(void) {
+    // Get state of interrupts and disable them. Waiters queue up with interrupts off, so an
+    // interrupt handler can't end up waiting behind the thread it interrupted.
+    uintptr_t flags;
+#ifdef X86_64
+    asm volatile ("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+#else
+    asm volatile ("pushfl; pop %0; cli" : "=r"(flags) : : "memory");
+#endif
+    return flags & LOCK_FLAGS_INTERRUPTS;
+}
+
+void spinlock_init(lock_t *lockObject, uint32_t type) {
+    lockObject->Lock = 0;
+    lockObject->InterruptState = 0;
+    lockObject->Type = type;
+    lockObject->NextTicket = 0;
+    lockObject->ServingTicket = 0;
+    lockObject->Holder = NULL;
+    lockObject->Name = NULL;
+    lockObject->NameIndex = 0;
+}
+
+void spinlock_set_name(lock_t *lockObject, const char *name) {
+    lockObject->Name = name;
+    lockObject->NameIndex = 0;
+}
+
+void spinlock_set_name_index(lock_t *lockObject, const char *name, uint32_t index) {
+    lockObject->Name = name;
+    lockObject->NameIndex = index + 1;
+}
+
+static bool spinlock_lock_mcs(lock_t *lockObject) {
+    // Take a free queue node from this processor. Interrupts are off, so nothing else here can race us.
+    percpu_t *percpu = percpu_get();
+    if (percpu->LockNodesUsed == (1 << LOCK_MCS_NODE_COUNT) - 1)
+        panic("LOCK: Out of MCS nodes on processor %u!\n", percpu->Index);
+    uint32_t nodeIndex = __builtin_ctz(~percpu->LockNodesUsed);
+    percpu->LockNodesUsed |= 1 << nodeIndex;
+
+    // Join the end of the queue. If there was someone ahead of us, wait for them to hand the lock over.
+    lock_mcs_node_t *node = &percpu->LockNodes[nodeIndex];
+    node->Next = NULL;
+    node->Locked = true;
+    lock_mcs_node_t *prevNode = (lock_mcs_node_t*)__sync_lock_test_and_set(&lockObject->Lock, (uintptr_t)node);
+    if (prevNode != NULL) {
+        prevNode->Next = node;
+        while (node->Locked)
+            asm volatile ("pause");
+    }
+    lockObject->Holder = node;
+    return prevNode != NULL;
+}
+
+static void spinlock_release_mcs(lock_t *lockObject) {
+    lock_mcs_node_t *node = lockObject->Holder;
+
+    // If nobody is queued behind us, empty the queue. Someone may be joining right now, so wait for them to link in if that fails.
+    if (node->Next == NULL) {
+        if (!__sync_bool_compare_and_swap(&lockObject->Lock, (uintptr_t)node, 0)) {
+            while (node->Next == NULL)
+                asm volatile ("pause");
+            node->Next->Locked = false;
+        }
+    }
+    else {
+        node->Next->Locked = false;
+    }
+
+    // Locks are always released on the processor that took them, as interrupts are off in between.
+    percpu_t *percpu = percpu_get();
+    percpu->LockNodesUsed &= ~(1 << (node - percpu->LockNodes));
+}
+
+void spinlock_lock(lock_t *lockObject) {
+    uintptr_t interruptState = spinlock_interrupts_save();
+#ifdef LOCKSTAT
+    uint64_t startTsc = cpu_tsc_read();
+#endif
+
+    bool contended = false;
+    switch (lockObject->Type) {
+        case LOCK_TYPE_TICKET: {
+            // Take a ticket and wait for it to be served.
+            uint32_t ticket = __sync_fetch_and_add(&lockObject->NextTicket, 1);
+            contended = lockObject->ServingTicket != ticket;
+            while (lockObject->ServingTicket != ticket)
+                asm volatile ("pause");
+            break;
+        }
+
+        case LOCK_TYPE_MCS:
+            contended = spinlock_lock_mcs(lockObject);
+            break;
+
+        default:
+            // Only attempt the locked exchange when the lock looks free, so waiters spin on a shared
+            // copy of the cache line instead of pulling it back and forth.
+            while (__sync_lock_test_and_set(&lockObject->Lock, 1)) {
+                contended = true;
+                while (lockObject->Lock)
+                    asm volatile ("pause");
+            }
+            break;
+    }
+
+    // Save state of interrupts now that we are the holder.
+    lockObject->InterruptState = interruptState;
+#ifdef LOCKSTAT
+    lockstat_acquired(lockObject, contended, startTsc);
+#else
+    (void)contended;
+#endif
+}
+
+void spinlock_release(lock_t *lockObject) {
+    // Get interrupt state before releasing, as the next holder overwrites it.
+    uintptr_t interruptState = lockObject->InterruptState;
+#ifdef LOCKSTAT
+    lockstat_releasing(lockObject);
+#endif
+
+    switch (lockObject->Type) {
+        case LOCK_TYPE_TICKET:
+            // Only the holder writes the served ticket, so no locked instruction is needed.
+            asm volatile ("" : : : "memory");
+            lockObject->ServingTicket++;
+            break;
+
+        case LOCK_TYPE_MCS:
+            spinlock_release_mcs(lockObject);
+            break;
+
+        default:
+            __sync_lock_release(&lockObject->Lock);
+            break;
+    }
+
+    // Enable interrupts if they were enabled before.
+    if (interruptState)
+        asm volatile ("sti");
+}
@@ -0,0 +1,127 @@
+/*
+ * File: lockstat.c
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <main.h>
+#include <io.h>
+#include <kprint.h>
+#include <kernel/lockstat.h>
+
+#include <kernel/timer.h>
+
+#ifdef LOCKSTAT
+// Named locks that have been taken at least once. Locks are only ever pushed on the front.
+static lock_t *volatile lockstatLocks = NULL;
+
+static void lockstat_register(lock_t *lockObject) {
+    // Only the first holder to get here adds the lock.
+    if (!__sync_bool_compare_and_swap(&lockObject->StatsRegistered, false, true))
+        return;
+
+    lock_t *head;
+    do {
+        head = lockstatLocks;
+        lockObject->StatsNext = head;
+    } while (!__sync_bool_compare_and_swap(&lockstatLocks, head, lockObject));
+}
+
+void lockstat_acquired(lock_t *lockObject, bool contended, uint64_t startTsc) {
+    // Only named locks are tracked.
+    if (lockObject->Name == NULL)
+        return;
+    if (!lockObject->StatsRegistered)
+        lockstat_register(lockObject);
+
+    // We hold the lock, so nobody else is updating these.
+    uint64_t currentTsc = cpu_tsc_read();
+    lockObject->Acquisitions++;
+    if (contended) {
+        lockObject->Contentions++;
+        lockObject->SpinCycles += currentTsc - startTsc;
+    }
+    lockObject->AcquiredTsc = currentTsc;
+}
+
+void lockstat_releasing(lock_t *lockObject) {
+    if (lockObject->Name == NULL)
+        return;
+
+    uint64_t holdCycles = cpu_tsc_read() - lockObject->AcquiredTsc;
+    if (holdCycles > lockObject->MaxHoldCycles)
+        lockObject->MaxHoldCycles = holdCycles;
+}
+
+void lockstat_print(void) {
+    // Pick out the most contended locks.
+    lock_t *topLocks[LOCKSTAT_TOP_COUNT];
+    uint32_t topCount = 0;
+    uint32_t lockCount = 0;
+    for (lock_t *lockObject = lockstatLocks; lockObject != NULL; lockObject = lockObject->StatsNext) {
+        lockCount++;
+        if (topCount == LOCKSTAT_TOP_COUNT && lockObject->Contentions <= topLocks[topCount - 1]->Contentions)
+            continue;
+
+        // Insert in order, dropping the last one if the list is full.
+        uint32_t index = (topCount < LOCKSTAT_TOP_COUNT) ? topCount++ : topCount - 1;
+        while (index > 0 && topLocks[index - 1]->Contentions < lockObject->Contentions) {
+            topLocks[index] = topLocks[index - 1];
+            index--;
+        }
+        topLocks[index] = lockObject;
+    }
+
+    uint64_t tscPerMs = timer_tsc_rate();
+    const char *unit = (tscPerMs != 0) ? "ns" : "cycles";
+    kprintf("Lock statistics, %u named locks, most contended first:\n", lockCount);
+    for (uint32_t i = 0; i < topCount; i++) {
+        lock_t *lockObject = topLocks[i];
+        uint64_t avgSpin = (lockObject->Contentions != 0) ? (lockObject->SpinCycles / lockObject->Contentions) : 0;
+        kprintf("  %s", lockObject->Name);
+        if (lockObject->NameIndex != 0)
+            kprintf("[%u]", lockObject->NameIndex - 1);
+        kprintf(" (0x%p): %llu taken, %llu contended, %llu %s spun (%llu avg), %llu %s max hold\n",
+            lockObject, lockObject->Acquisitions, lockObject->Contentions,
+            timer_tsc_to_ns(lockObject->SpinCycles), unit, timer_tsc_to_ns(avgSpin),
+            timer_tsc_to_ns(lockObject->MaxHoldCycles), unit);
+    }
+}
+
+void lockstat_reset(void) {
+    // Counters may be bumped by holders on other processors while this runs, that's fine for statistics.
+    for (lock_t *lockObject = lockstatLocks; lockObject != NULL; lockObject = lockObject->StatsNext) {
+        lockObject->Acquisitions = 0;
+        lockObject->Contentions = 0;
+        lockObject->SpinCycles = 0;
+        lockObject->MaxHoldCycles = 0;
+    }
+    kprintf("Lock statistics reset.\n");
+}
+#else
+void lockstat_print(void) {
+    kprintf("Lock statistics aren't built in. Rebuild with LOCKSTAT=TRUE.\n");
+}
+
+void lockstat_reset(void) {
+    lockstat_print();
+}
+#endif
@@ -34,7 +34,7 @@
 
 // Based on code from https://github.com/CCareaga/heap_allocator. Licensed under the MIT.
 
-static lock_t kheap_lock = { };
+static lock_t kheap_lock = LOCK_INIT_NAMED(LOCK_TYPE_TICKET, "kheap_lock");
 static size_t currentKernelHeapSize;
 static kheap_bin_t bins[KHEAP_BIN_COUNT];
 
@@ -153,7 +153,7 @@ void paging_unmap_region(uintptr_t startAddress, uintptr_t endAddress) {
     }
 }
 
-static lock_t paging_device_alloc_lock = { };
+static lock_t paging_device_alloc_lock = LOCK_INIT_NAMED(LOCK_TYPE_SPIN, "paging_device_alloc_lock");
 
 void *paging_device_alloc(uint64_t startPhys, uint64_t endPhys) {
     // Ensure addresses are on 4KB boundaries.
@@ -54,7 +54,7 @@ mem_info_t memInfo;
 uint32_t earlyPagesLast;
 
 // Locks.
-static lock_t pagingLock = { };
+static lock_t pagingLock = LOCK_INIT_NAMED(LOCK_TYPE_TICKET, "pagingLock");
 
 // DMA bitmap. Each bit represents a 64KB page, in order.
 static bool dmaFrames[PMM_NO_OF_DMA_FRAMES];
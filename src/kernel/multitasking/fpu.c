@@ -0,0 +1,195 @@
+/*
+ * File: fpu.c
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <main.h>
+#include <kprint.h>
+#include <string.h>
+#include <kernel/multitasking/fpu.h>
+
+#include <kernel/cpuid.h>
+#include <kernel/memory/kheap.h>
+
+// Save method and area size, detected on the BSP.
+static bool fpuDetected = false;
+static uint8_t fpuSaveMode = FPU_SAVE_FNSAVE;
+static uint32_t fpuStateSize = FPU_FNSAVE_SIZE;
+static uint64_t fpuXcr0 = 0;
+
+// Clean state copied into each thread's area on its first FPU use.
+static void *fpuInitialState = NULL;
+
+static inline uintptr_t fpu_read_cr0(void) {
+    uintptr_t value;
+    asm volatile ("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void fpu_write_cr0(uintptr_t value) {
+    asm volatile ("mov %0, %%cr0" : : "r"(value));
+}
+
+static inline uintptr_t fpu_read_cr4(void) {
+    uintptr_t value;
+    asm volatile ("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void fpu_write_cr4(uintptr_t value) {
+    asm volatile ("mov %0, %%cr4" : : "r"(value));
+}
+
+static inline void fpu_xsetbv(uint32_t index, uint64_t value) {
+    asm volatile ("xsetbv" : : "c"(index), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+void *fpu_state_create(void) {
+    // Over-allocate so the area can be aligned, keeping the original pointer just before it.
+    uint8_t *block = (uint8_t*)kheap_alloc(fpuStateSize + FPU_STATE_ALIGNMENT + sizeof(void*));
+    if (block == NULL)
+        panic("FPU: Failed to allocate state area!\n");
+
+    uintptr_t aligned = ((uintptr_t)block + sizeof(void*) + FPU_STATE_ALIGNMENT - 1) & ~((uintptr_t)FPU_STATE_ALIGNMENT - 1);
+    ((void**)aligned)[-1] = block;
+
+    // Start from the clean state.
+    memcpy((void*)aligned, fpuInitialState, fpuStateSize);
+    return (void*)aligned;
+}
+
+void fpu_state_free(void *state) {
+    if (state != NULL)
+        kheap_free(((void**)state)[-1]);
+}
+
+void fpu_save(void *state) {
+    switch (fpuSaveMode) {
+        case FPU_SAVE_XSAVE:
+            asm volatile ("xsave (%0)" : : "r"(state), "a"(0xFFFFFFFF), "d"(0xFFFFFFFF) : "memory");
+            break;
+
+        case FPU_SAVE_FXSAVE:
+            asm volatile ("fxsave (%0)" : : "r"(state) : "memory");
+            break;
+
+        default:
+            // FNSAVE also reinitializes the FPU, reload so the registers stay valid.
+            asm volatile ("fnsave (%0)\nfrstor (%0)" : : "r"(state) : "memory");
+            break;
+    }
+}
+
+void fpu_restore(void *state) {
+    switch (fpuSaveMode) {
+        case FPU_SAVE_XSAVE:
+            asm volatile ("xrstor (%0)" : : "r"(state), "a"(0xFFFFFFFF), "d"(0xFFFFFFFF) : "memory");
+            break;
+
+        case FPU_SAVE_FXSAVE:
+            asm volatile ("fxrstor (%0)" : : "r"(state) : "memory");
+            break;
+
+        default:
+            asm volatile ("frstor (%0)" : : "r"(state) : "memory");
+            break;
+    }
+}
+
+void fpu_trap_next_use(void) {
+    // Setting TS causes the next FPU/SSE instruction to raise #NM.
+    fpu_write_cr0(fpu_read_cr0() | FPU_CR0_TS);
+}
+
+void fpu_allow_use(void) {
+    asm volatile ("clts");
+}
+
+static void fpu_detect(void) {
+    uint32_t unused, ecx, edx;
+    if (!cpuid_query(CPUID_GETFEATURES, &unused, &unused, &ecx, &edx))
+        ecx = edx = 0;
+
+    // Pick the best save method available.
+    if ((ecx & CPUID_FEAT_ECX_XSAVE) && (edx & CPUID_FEAT_EDX_FXSR)) {
+        fpuSaveMode = FPU_SAVE_XSAVE;
+        fpuXcr0 = FPU_XCR0_X87 | FPU_XCR0_SSE;
+        if (ecx & CPUID_FEAT_ECX_AVX)
+            fpuXcr0 |= FPU_XCR0_AVX;
+    }
+    else if (edx & CPUID_FEAT_EDX_FXSR) {
+        fpuSaveMode = FPU_SAVE_FXSAVE;
+        fpuStateSize = FPU_FXSAVE_SIZE;
+    }
+}
+
+void fpu_init(void) {
+    // Detect features once, all processors are assumed to match the BSP.
+    bool bsp = !fpuDetected;
+    if (bsp) {
+        fpu_detect();
+        fpuDetected = true;
+    }
+
+    // Enable native FPU errors and let TS trap WAIT, and make sure the FPU isn't emulated.
+    fpu_write_cr0((fpu_read_cr0() | FPU_CR0_MP | FPU_CR0_NE) & ~(FPU_CR0_EM | FPU_CR0_TS));
+
+    // Enable FXSAVE and SSE, and XSAVE if supported.
+    if (fpuSaveMode != FPU_SAVE_FNSAVE) {
+        uintptr_t cr4 = fpu_read_cr4() | FPU_CR4_OSFXSR | FPU_CR4_OSXMMEXCPT;
+        if (fpuSaveMode == FPU_SAVE_XSAVE)
+            cr4 |= FPU_CR4_OSXSAVE;
+        fpu_write_cr4(cr4);
+        if (fpuSaveMode == FPU_SAVE_XSAVE)
+            fpu_xsetbv(0, fpuXcr0);
+    }
+
+    // Reset the FPU to a known state.
+    asm volatile ("fninit");
+    if (fpuSaveMode != FPU_SAVE_FNSAVE) {
+        uint32_t mxcsr = FPU_MXCSR_DEFAULT;
+        asm volatile ("ldmxcsr %0" : : "m"(mxcsr));
+    }
+
+    if (!bsp)
+        return;
+
+    // Get size of the XSAVE area for the enabled components.
+    if (fpuSaveMode == FPU_SAVE_XSAVE) {
+        uint32_t unused, size;
+        if (cpuid_query(CPUID_GETXSAVESTATE, &unused, &size, &unused, &unused) && size >= FPU_FXSAVE_SIZE)
+            fpuStateSize = size;
+        else
+            fpuStateSize = FPU_FXSAVE_SIZE + 64 + 256;
+    }
+
+    // Capture the clean state. The area is zeroed first so the XSAVE header starts out valid.
+    uint8_t *block = (uint8_t*)kheap_alloc(fpuStateSize + FPU_STATE_ALIGNMENT + sizeof(void*));
+    if (block == NULL)
+        panic("FPU: Failed to allocate initial state!\n");
+    fpuInitialState = (void*)(((uintptr_t)block + sizeof(void*) + FPU_STATE_ALIGNMENT - 1) & ~((uintptr_t)FPU_STATE_ALIGNMENT - 1));
+    memset(fpuInitialState, 0, fpuStateSize);
+    fpu_save(fpuInitialState);
+
+    kprintf("FPU: Using %s with a %u byte save area.\n", fpuSaveMode == FPU_SAVE_XSAVE ? "XSAVE"
+        : (fpuSaveMode == FPU_SAVE_FXSAVE ? "FXSAVE" : "FNSAVE"), fpuStateSize);
+}
@@ -0,0 +1,82 @@
+/*
+ * File: futex.c
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <main.h>
+#include <kernel/multitasking/futex.h>
+
+#include <kernel/lock.h>
+#include <kernel/memory/paging.h>
+#include <kernel/multitasking/sync.h>
+
+// Wait queues are hashed by physical address, so processes sharing a page share its futexes.
+// Zeroed queues are ready to use.
+static waitqueue_t futexBuckets[FUTEX_BUCKET_COUNT];
+
+static bool futex_key(volatile uint32_t *address, uint64_t *keyOut) {
+    // Futex words must be aligned and mapped user accessible, so kernel memory can't be probed.
+    uintptr_t virtual = (uintptr_t)address;
+    uint64_t pagePhys;
+    if ((virtual & (sizeof(uint32_t) - 1)) || !paging_get_phys_user(virtual, &pagePhys))
+        return false;
+
+    *keyOut = pagePhys + (virtual & (PAGE_SIZE_4K - 1));
+    return true;
+}
+
+static inline waitqueue_t *futex_bucket(uint64_t key) {
+    // Futex words are aligned, so the low bits carry nothing.
+    return &futexBuckets[((key >> 2) ^ (key >> 12)) % FUTEX_BUCKET_COUNT];
+}
+
+int32_t futex_wait(volatile uint32_t *address, uint32_t value, uint32_t timeoutMs) {
+    uint64_t key;
+    if (!futex_key(address, &key))
+        return FUTEX_ERR_FAULT;
+
+    // Check the value with the bucket locked. Wakers change the value before taking the lock,
+    // so either the change is seen here or the waker sees us queued.
+    waitqueue_t *bucket = futex_bucket(key);
+    spinlock_lock(&bucket->Lock);
+    if (*address != value) {
+        spinlock_release(&bucket->Lock);
+        return FUTEX_ERR_AGAIN;
+    }
+
+    bool woken = waitqueue_wait_key_locked(bucket, key, timeoutMs);
+    spinlock_release(&bucket->Lock);
+    return woken ? FUTEX_OK : FUTEX_ERR_TIMEOUT;
+}
+
+int32_t futex_wake(volatile uint32_t *address, uint32_t count) {
+    uint64_t key;
+    if (!futex_key(address, &key))
+        return FUTEX_ERR_FAULT;
+
+    // Wake up to count waiters, oldest first.
+    waitqueue_t *bucket = futex_bucket(key);
+    spinlock_lock(&bucket->Lock);
+    uint32_t woken = waitqueue_wake_key_locked(bucket, key, count);
+    spinlock_release(&bucket->Lock);
+    return (int32_t)woken;
+}
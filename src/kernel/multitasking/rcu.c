@@ -0,0 +1,148 @@
+/*
+ * File: rcu.c
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <main.h>
+#include <kprint.h>
+#include <kernel/multitasking/rcu.h>
+
+#include <kernel/lock.h>
+#include <kernel/percpu.h>
+#include <kernel/interrupts/smp.h>
+#include <kernel/interrupts/softirq.h>
+
+// Callbacks waiting on the grace period in progress, and callbacks queued since it began.
+static rcu_head_t *rcuWaiting = NULL;
+static rcu_head_t *rcuNext = NULL;
+static rcu_head_t **rcuNextTail = &rcuNext;
+static lock_t rcuLock = LOCK_INIT_NAMED(LOCK_TYPE_TICKET, "rcuLock");
+
+// Grace period state. The grace period ends once every processor has reported a quiescent state.
+static bool rcuGpActive = false;
+static volatile uint32_t rcuQsPending = 0;
+
+static inline void rcu_report(percpu_t *percpu) {
+    // Only one report per processor counts, whether made by the processor itself or on behalf of an idle one.
+    if (percpu->RcuQsNeeded && __sync_bool_compare_and_swap(&percpu->RcuQsNeeded, true, false)
+        && __sync_sub_and_fetch(&rcuQsPending, 1) == 0)
+        softirq_raise(SOFTIRQ_RCU);
+}
+
+static void rcu_start_gp(void) {
+    // Callbacks queued so far wait on this grace period. Lock must be held.
+    rcuWaiting = rcuNext;
+    rcuNext = NULL;
+    rcuNextTail = &rcuNext;
+    rcuGpActive = true;
+
+    // Ask every processor for a quiescent state. The extra count keeps the grace period from ending while this runs.
+    rcuQsPending = 1;
+    for (uint32_t i = 0; i < smp_get_proc_count(); i++) {
+        percpu_t *percpu = percpu_get_proc(i);
+        if (percpu == NULL)
+            continue;
+        __sync_fetch_and_add(&rcuQsPending, 1);
+        percpu->RcuQsNeeded = true;
+
+        // Idle processors aren't reading anything, so report for them. They recheck the flag on the way
+        // in, so either we see them idle here or they see the flag.
+        __sync_synchronize();
+        if (percpu->RcuIdle)
+            rcu_report(percpu);
+    }
+    if (__sync_sub_and_fetch(&rcuQsPending, 1) == 0)
+        softirq_raise(SOFTIRQ_RCU);
+}
+
+static void rcu_softirq(uint32_t procIndex) {
+    // Collect callbacks of a finished grace period, and start the next one if more are queued.
+    rcu_head_t *head = NULL;
+    spinlock_lock(&rcuLock);
+    if (rcuGpActive && rcuQsPending == 0) {
+        head = rcuWaiting;
+        rcuWaiting = NULL;
+        rcuGpActive = false;
+        if (rcuNext != NULL)
+            rcu_start_gp();
+    }
+    spinlock_release(&rcuLock);
+
+    // Run callbacks in the order they were queued.
+    while (head != NULL) {
+        rcu_head_t *nextHead = head->Next;
+        head->Func(head);
+        head = nextHead;
+    }
+}
+
+void rcu_call(rcu_head_t *head, rcu_callback_t func) {
+    // Queue callback to run after a grace period, starting one if none is in progress.
+    head->Next = NULL;
+    head->Func = func;
+    spinlock_lock(&rcuLock);
+    *rcuNextTail = head;
+    rcuNextTail = &head->Next;
+    if (!rcuGpActive)
+        rcu_start_gp();
+    spinlock_release(&rcuLock);
+}
+
+void rcu_note_qs(void) {
+    // Called where the current processor can't be inside a read-side section, like a context switch.
+    rcu_report(percpu_get());
+}
+
+void rcu_irq_enter(void) {
+    // An interrupt is coming out of idle, and handlers may read.
+    percpu_t *percpu = percpu_get();
+    if (percpu->RcuIdle) {
+        percpu->RcuIdle = false;
+        __sync_synchronize();
+    }
+
+    // Interrupted code wasn't reading unless it was in a read-side section, as interrupts were on.
+    if (percpu->RcuNesting == 0)
+        rcu_report(percpu);
+}
+
+void rcu_idle_enter(void) {
+    // Nothing is read while halted, so grace periods started from here on don't wait on us.
+    percpu_t *percpu = percpu_get();
+    percpu->RcuIdle = true;
+    __sync_synchronize();
+    rcu_report(percpu);
+}
+
+void rcu_idle_exit(void) {
+    percpu_t *percpu = percpu_get();
+    percpu->RcuIdle = false;
+    __sync_synchronize();
+}
+
+void rcu_init(void) {
+    softirq_register(SOFTIRQ_RCU, rcu_softirq);
+
+    // Finish any grace period that ended before softirqs were up.
+    softirq_raise(SOFTIRQ_RCU);
+    kprintf("RCU: Initialized!\n");
+}
@@ -0,0 +1,223 @@
+/*
+ * File: schedtrace.c
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <main.h>
+#include <io.h>
+#include <kprint.h>
+#include <string.h>
+#include <kernel/multitasking/schedtrace.h>
+
+#include <driver/serial.h>
+#include <kernel/percpu.h>
+#include <kernel/tasking.h>
+#include <kernel/timer.h>
+#include <kernel/interrupts/smp.h>
+#include <kernel/memory/kheap.h>
+
+// Trace buffers for each processor, by index.
+static schedtrace_buffer_t **traceBuffers = NULL;
+static uint32_t traceBufferCount = 0;
+static volatile bool traceEnabled = false;
+
+static const char *histogramNames[SCHEDTRACE_HIST_COUNT] = { "Wakeup latency", "Run length", "Switch cost" };
+
+static schedtrace_buffer_t *schedtrace_get_buffer(void) {
+    // Get the current processor's buffer, or NULL if tracing is off.
+    if (!traceEnabled)
+        return NULL;
+    uint32_t procIndex = percpu_index();
+    return (procIndex < traceBufferCount) ? traceBuffers[procIndex] : NULL;
+}
+
+static void schedtrace_record(schedtrace_buffer_t *buffer, uint64_t tsc, uint8_t type, thread_t *thread,
+    uint32_t nextThreadId, uint32_t procIndex, uint32_t targetIndex) {
+    // Overwrite the oldest event once the ring is full.
+    schedtrace_event_t *event = &buffer->Events[buffer->Written % SCHEDTRACE_BUFFER_EVENTS];
+    event->Tsc = tsc;
+    event->ThreadId = thread->ThreadId;
+    event->NextThreadId = nextThreadId;
+    event->Type = type;
+    event->State = thread->State;
+    event->Processor = (uint16_t)procIndex;
+    event->TargetProcessor = (uint16_t)targetIndex;
+    event->Reserved = 0;
+    buffer->Written++;
+}
+
+static inline void schedtrace_histogram_add(schedtrace_buffer_t *buffer, uint32_t histogram, uint64_t cycles) {
+    // Bucket is the highest set bit of the interval.
+    uint32_t bucket = (cycles > 0) ? (63 - __builtin_clzll(cycles)) : 0;
+    if (bucket >= SCHEDTRACE_HIST_BUCKETS)
+        bucket = SCHEDTRACE_HIST_BUCKETS - 1;
+    buffer->Histograms[histogram][bucket]++;
+}
+
+void schedtrace_switch(uint32_t procIndex, thread_t *prevThread, thread_t *nextThread, uint64_t scheduleTsc) {
+    schedtrace_buffer_t *buffer = schedtrace_get_buffer();
+    if (buffer == NULL)
+        return;
+    uint64_t tsc = cpu_tsc_read();
+
+    // Outgoing threads that can't run anymore are blocking, sleeping or exiting.
+    if (prevThread->State != THREAD_STATE_RUNNABLE)
+        schedtrace_record(buffer, tsc, SCHEDTRACE_EVENT_BLOCK, prevThread, 0, procIndex, procIndex);
+    schedtrace_record(buffer, tsc, SCHEDTRACE_EVENT_SWITCH, prevThread, nextThread->ThreadId, procIndex, procIndex);
+
+    // Charge how long the outgoing thread ran. Time spent idle isn't interesting.
+    if (prevThread != percpu_get()->Tasking->IdleThread && prevThread->TraceRunTsc != 0)
+        schedtrace_histogram_add(buffer, SCHEDTRACE_HIST_RUN_LENGTH, tsc - prevThread->TraceRunTsc);
+    prevThread->TraceRunTsc = 0;
+
+    // If the incoming thread was woken, this is how long it waited to get a processor.
+    if (nextThread->TraceWakeTsc != 0) {
+        schedtrace_histogram_add(buffer, SCHEDTRACE_HIST_WAKEUP_LATENCY, tsc - nextThread->TraceWakeTsc);
+        nextThread->TraceWakeTsc = 0;
+    }
+    nextThread->TraceRunTsc = tsc;
+    schedtrace_histogram_add(buffer, SCHEDTRACE_HIST_SWITCH_COST, tsc - scheduleTsc);
+}
+
+void schedtrace_wakeup(thread_t *thread, uint32_t targetIndex) {
+    schedtrace_buffer_t *buffer = schedtrace_get_buffer();
+    if (buffer == NULL)
+        return;
+
+    // Event goes in the waker's buffer, as only the local processor may write to it.
+    uint64_t tsc = cpu_tsc_read();
+    schedtrace_record(buffer, tsc, SCHEDTRACE_EVENT_WAKEUP, thread, 0, percpu_index(), targetIndex);
+    thread->TraceWakeTsc = tsc;
+}
+
+void schedtrace_migrate(thread_t *thread, uint32_t fromIndex, uint32_t toIndex) {
+    schedtrace_buffer_t *buffer = schedtrace_get_buffer();
+    if (buffer == NULL)
+        return;
+    schedtrace_record(buffer, cpu_tsc_read(), SCHEDTRACE_EVENT_MIGRATE, thread, 0, fromIndex, toIndex);
+}
+
+void schedtrace_set_enabled(bool enabled) {
+    traceEnabled = enabled && traceBuffers != NULL;
+}
+
+void schedtrace_clear(void) {
+    // Stop tracing while buffers are reset. Events in flight on other processors may still land.
+    bool enabled = traceEnabled;
+    traceEnabled = false;
+    for (uint32_t i = 0; i < traceBufferCount; i++) {
+        traceBuffers[i]->Written = 0;
+        memset(traceBuffers[i]->Histograms, 0, sizeof(traceBuffers[i]->Histograms));
+    }
+    traceEnabled = enabled;
+}
+
+void schedtrace_print(void) {
+    if (traceBuffers == NULL) {
+        kprintf("SCHEDTRACE: Not initialized.\n");
+        return;
+    }
+
+    uint64_t tscPerMs = timer_tsc_rate();
+    kprintf("Scheduler trace %s, %u processors, %llu TSC cycles/ms.\n", traceEnabled ? "enabled" : "disabled",
+        traceBufferCount, tscPerMs);
+    for (uint32_t i = 0; i < traceBufferCount; i++) {
+        uint64_t written = traceBuffers[i]->Written;
+        uint64_t dropped = (written > SCHEDTRACE_BUFFER_EVENTS) ? (written - SCHEDTRACE_BUFFER_EVENTS) : 0;
+        percpu_t *percpu = percpu_get_proc(i);
+        kprintf("CPU %u: %llu events (%llu overwritten), %llu context switches.\n", i, written, dropped,
+            (percpu != NULL) ? percpu->ContextSwitches : 0);
+    }
+
+    // Sum each histogram over all processors.
+    for (uint32_t h = 0; h < SCHEDTRACE_HIST_COUNT; h++) {
+        uint64_t buckets[SCHEDTRACE_HIST_BUCKETS];
+        uint64_t total = 0;
+        memset(buckets, 0, sizeof(buckets));
+        for (uint32_t i = 0; i < traceBufferCount; i++) {
+            for (uint32_t b = 0; b < SCHEDTRACE_HIST_BUCKETS; b++) {
+                buckets[b] += traceBuffers[i]->Histograms[h][b];
+                total += traceBuffers[i]->Histograms[h][b];
+            }
+        }
+
+        kprintf("%s (%llu samples):\n", histogramNames[h], total);
+        for (uint32_t b = 0; b < SCHEDTRACE_HIST_BUCKETS; b++) {
+            if (buckets[b] == 0)
+                continue;
+            kprintf("  %llu - %llu %s: %llu (%u%%)\n", timer_tsc_to_ns(1ull << b),
+                timer_tsc_to_ns((2ull << b) - 1), (tscPerMs != 0) ? "ns" : "cycles",
+                buckets[b], (uint32_t)((buckets[b] * 100) / total));
+        }
+    }
+}
+
+void schedtrace_export(void) {
+    if (traceBuffers == NULL || !serial_present()) {
+        kprintf("SCHEDTRACE: Nothing to export.\n");
+        return;
+    }
+
+    // Stop tracing so the buffers hold still while they are sent.
+    bool enabled = traceEnabled;
+    traceEnabled = false;
+    kprintf("SCHEDTRACE: Exporting %u buffers over serial...\n", traceBufferCount);
+
+    schedtrace_export_header_t header;
+    memcpy((uint8_t*)header.Magic, (uint8_t*)SCHEDTRACE_EXPORT_MAGIC, sizeof(header.Magic));
+    header.Version = SCHEDTRACE_EXPORT_VERSION;
+    header.ProcessorCount = traceBufferCount;
+    header.TscPerMs = timer_tsc_rate();
+    header.EventSize = sizeof(schedtrace_event_t);
+    header.BufferEvents = SCHEDTRACE_BUFFER_EVENTS;
+    serial_write_bytes(&header, sizeof(header));
+
+    for (uint32_t i = 0; i < traceBufferCount; i++) {
+        // Send events oldest first. Once the ring has wrapped, the oldest is the next one to be overwritten.
+        schedtrace_buffer_t *buffer = traceBuffers[i];
+        uint64_t written = buffer->Written;
+        schedtrace_export_proc_t procHeader;
+        procHeader.Processor = i;
+        procHeader.EventCount = (written > SCHEDTRACE_BUFFER_EVENTS) ? SCHEDTRACE_BUFFER_EVENTS : (uint32_t)written;
+        procHeader.Dropped = written - procHeader.EventCount;
+        serial_write_bytes(&procHeader, sizeof(procHeader));
+
+        uint32_t start = (written > SCHEDTRACE_BUFFER_EVENTS) ? (uint32_t)(written % SCHEDTRACE_BUFFER_EVENTS) : 0;
+        for (uint32_t e = 0; e < procHeader.EventCount; e++)
+            serial_write_bytes(&buffer->Events[(start + e) % SCHEDTRACE_BUFFER_EVENTS], sizeof(schedtrace_event_t));
+    }
+
+    kprintf("\nSCHEDTRACE: Export complete.\n");
+    traceEnabled = enabled;
+}
+
+void schedtrace_init(void) {
+    // Allocate a buffer for each processor. Tracing starts enabled, as recording is just a few stores.
+    traceBufferCount = smp_get_proc_count();
+    traceBuffers = (schedtrace_buffer_t**)kheap_alloc(sizeof(schedtrace_buffer_t*) * traceBufferCount);
+    for (uint32_t i = 0; i < traceBufferCount; i++) {
+        traceBuffers[i] = (schedtrace_buffer_t*)kheap_alloc(sizeof(schedtrace_buffer_t));
+        memset(traceBuffers[i], 0, sizeof(schedtrace_buffer_t));
+    }
+    traceEnabled = true;
+    kprintf("SCHEDTRACE: %u buffers of %u events each.\n", traceBufferCount, SCHEDTRACE_BUFFER_EVENTS);
+}
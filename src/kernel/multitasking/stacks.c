@@ -0,0 +1,141 @@
+/*
+ * File: stacks.c
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <main.h>
+#include <kprint.h>
+#include <string.h>
+#include <kernel/multitasking/stacks.h>
+
+#include <kernel/percpu.h>
+#include <kernel/tasking.h>
+#include <kernel/interrupts/smp.h>
+#include <kernel/memory/kheap.h>
+#include <kernel/memory/paging.h>
+
+// Per-processor caches.
+static stacks_cache_t *stackCaches = NULL;
+static uint32_t stackCacheCount = 0;
+
+// Next never-used address in the stack region, and ranges that have been given back.
+static uintptr_t stacksNextAddress = STACKS_REGION_START;
+static stacks_range_t *stacksFreeRanges = NULL;
+static lock_t stacksLock = LOCK_INIT_NAMED(LOCK_TYPE_SPIN, "stacksLock");
+
+static stacks_cache_t *stacks_get_cache(size_t size) {
+    // Only default sized stacks are cached.
+    if (stackCaches == NULL || STACKS_PAGES(size) != STACKS_PAGES(THREAD_STACK_SIZE))
+        return NULL;
+
+    // Get processor we are running on.
+    uint32_t procIndex = percpu_index();
+    return (procIndex < stackCacheCount) ? &stackCaches[procIndex] : NULL;
+}
+
+uintptr_t stacks_alloc(size_t size) {
+    // Take a stack from this processor's cache if there's one. These are already mapped.
+    stacks_cache_t *cache = stacks_get_cache(size);
+    if (cache != NULL) {
+        uintptr_t stackBottom = 0;
+        spinlock_lock(&cache->Lock);
+        if (cache->Count > 0)
+            stackBottom = cache->Stacks[--cache->Count];
+        spinlock_release(&cache->Lock);
+
+        if (stackBottom != 0)
+            return stackBottom;
+    }
+
+    // Get virtual range big enough for the stack and its guard page, reusing a freed one if possible.
+    uint32_t pageCount = STACKS_PAGES(size) + 1;
+    uintptr_t rangeStart = 0;
+    stacks_range_t *freeRange = NULL;
+    spinlock_lock(&stacksLock);
+    stacks_range_t **rangePtr = &stacksFreeRanges;
+    while (*rangePtr != NULL) {
+        if ((*rangePtr)->PageCount == pageCount) {
+            freeRange = *rangePtr;
+            *rangePtr = freeRange->Next;
+            rangeStart = freeRange->Start;
+            break;
+        }
+        rangePtr = &(*rangePtr)->Next;
+    }
+
+    if (rangeStart == 0) {
+        if (stacksNextAddress + (pageCount * PAGE_SIZE_4K) - 1 > STACKS_REGION_END)
+            panic("STACKS: Out of stack virtual addresses!\n");
+        rangeStart = stacksNextAddress;
+        stacksNextAddress += pageCount * PAGE_SIZE_4K;
+    }
+    spinlock_release(&stacksLock);
+
+    if (freeRange != NULL)
+        kheap_free(freeRange);
+
+    // Map stack above the guard page, which stays unmapped.
+    uintptr_t stackBottom = rangeStart + PAGE_SIZE_4K;
+    paging_map_region(stackBottom, rangeStart + ((pageCount - 1) * PAGE_SIZE_4K), true, true);
+    return stackBottom;
+}
+
+void stacks_free(uintptr_t stackBottom, size_t size) {
+    // Put stack back in this processor's cache if there's room.
+    stacks_cache_t *cache = stacks_get_cache(size);
+    if (cache != NULL) {
+        bool cached = false;
+        spinlock_lock(&cache->Lock);
+        if (cache->Count < STACKS_CACHE_SIZE) {
+            cache->Stacks[cache->Count++] = stackBottom;
+            cached = true;
+        }
+        spinlock_release(&cache->Lock);
+
+        if (cached)
+            return;
+    }
+
+    // Unmap stack, returning its page frames.
+    uint32_t stackPages = STACKS_PAGES(size);
+    paging_unmap_region(stackBottom, stackBottom + ((stackPages - 1) * PAGE_SIZE_4K));
+
+    // Give virtual range back for reuse.
+    stacks_range_t *freeRange = (stacks_range_t*)kheap_alloc(sizeof(stacks_range_t));
+    freeRange->Start = stackBottom - PAGE_SIZE_4K;
+    freeRange->PageCount = stackPages + 1;
+    spinlock_lock(&stacksLock);
+    freeRange->Next = stacksFreeRanges;
+    stacksFreeRanges = freeRange;
+    spinlock_release(&stacksLock);
+}
+
+void stacks_init(void) {
+    // Create a cache for each processor.
+    stackCacheCount = smp_get_proc_count();
+    stacks_cache_t *caches = (stacks_cache_t*)kheap_alloc(sizeof(stacks_cache_t) * stackCacheCount);
+    memset(caches, 0, sizeof(stacks_cache_t) * stackCacheCount);
+    for (uint32_t i = 0; i < stackCacheCount; i++)
+        spinlock_set_name_index(&caches[i].Lock, "stacksCacheLock", i);
+    stackCaches = caches;
+    kprintf("STACKS: Initialized stack caches for %u processors.\n", stackCacheCount);
+}
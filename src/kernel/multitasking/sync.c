@@ -0,0 +1,302 @@
+/*
+ * File: sync.c
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <main.h>
+#include <kprint.h>
+#include <kernel/multitasking/sync.h>
+
+#include <kernel/hrtimer.h>
+#include <kernel/multitasking/rcu.h>
+#include <kernel/tasking.h>
+#include <kernel/timer.h>
+
+//
+// Wait queues.
+//
+void waitqueue_init(waitqueue_t *queue) {
+    spinlock_init(&queue->Lock, LOCK_TYPE_SPIN);
+    queue->Head = NULL;
+    queue->Tail = NULL;
+}
+
+static void waitqueue_add(waitqueue_t *queue, waitqueue_entry_t *entry) {
+    entry->Next = NULL;
+    entry->Prev = queue->Tail;
+    if (queue->Tail != NULL)
+        queue->Tail->Next = entry;
+    else
+        queue->Head = entry;
+    queue->Tail = entry;
+}
+
+static void waitqueue_remove(waitqueue_t *queue, waitqueue_entry_t *entry) {
+    if (entry->Prev != NULL)
+        entry->Prev->Next = entry->Next;
+    else
+        queue->Head = entry->Next;
+    if (entry->Next != NULL)
+        entry->Next->Prev = entry->Prev;
+    else
+        queue->Tail = entry->Prev;
+    entry->Next = entry->Prev = NULL;
+}
+
+static void waitqueue_timeout(hrtimer_t *timer, void *arg) {
+    tasking_thread_wake((thread_t*)arg);
+}
+
+bool waitqueue_wait_key_locked(waitqueue_t *queue, uint64_t key, uint32_t timeoutMs) {
+    // Queue must be locked by the caller, and is locked again on return. Returns false if the wait timed out.
+    waitqueue_entry_t entry = { };
+    entry.Thread = tasking_thread_current();
+    entry.Key = key;
+    waitqueue_add(queue, &entry);
+
+    // Threads that can't block (before tasking or with interrupts off before the queue was locked) spin instead.
+    bool canBlock = entry.Thread != NULL && queue->Lock.InterruptState != 0 && tasking_thread_can_block();
+    bool timed = timeoutMs != SYNC_WAIT_FOREVER;
+    uint64_t deadline = timed ? timer_now_ns() + (timeoutMs * TIMER_NS_PER_MS) : 0;
+
+    // Blocked threads are woken by a timer when the timeout runs out.
+    hrtimer_t timeoutTimer;
+    if (timed && canBlock) {
+        hrtimer_setup(&timeoutTimer, waitqueue_timeout, entry.Thread, HRTIMER_FLAG_HARD);
+        hrtimer_add(&timeoutTimer, deadline);
+    }
+
+    while (!entry.Woken) {
+        // Killed threads are woken so they can take themselves off the queue before they die.
+        if (canBlock && tasking_thread_killed()) {
+            waitqueue_remove(queue, &entry);
+            if (timed)
+                hrtimer_cancel(&timeoutTimer);
+            spinlock_release(&queue->Lock);
+            tasking_kill_thread();
+        }
+
+        if (timed && timer_now_ns() >= deadline) {
+            waitqueue_remove(queue, &entry);
+            if (canBlock)
+                hrtimer_cancel(&timeoutTimer);
+            return false;
+        }
+
+        // The thread is marked blocked before the queue is unlocked, so a wake in between isn't lost.
+        // If the timer fired just before that, nothing is left to wake it, so it stays runnable.
+        if (canBlock) {
+            tasking_thread_prepare_block(0);
+            if (timed && !hrtimer_pending(&timeoutTimer))
+                tasking_thread_wake(entry.Thread);
+            spinlock_release(&queue->Lock);
+            tasking_thread_finish_block();
+        }
+        else {
+            spinlock_release(&queue->Lock);
+            asm volatile ("pause");
+        }
+        spinlock_lock(&queue->Lock);
+    }
+
+    if (timed && canBlock)
+        hrtimer_cancel(&timeoutTimer);
+    return true;
+}
+
+bool waitqueue_wait_locked(waitqueue_t *queue, uint32_t timeoutMs) {
+    return waitqueue_wait_key_locked(queue, 0, timeoutMs);
+}
+
+static void waitqueue_wake_entry(waitqueue_t *queue, waitqueue_entry_t *entry) {
+    // The entry lives on the waiter's stack, so it can't be touched once the waiter sees it was woken.
+    thread_t *thread = entry->Thread;
+    waitqueue_remove(queue, entry);
+    entry->Woken = true;
+    if (thread != NULL)
+        tasking_thread_wake(thread);
+}
+
+void waitqueue_wake_one_locked(waitqueue_t *queue) {
+    // Wake the longest waiting thread.
+    if (queue->Head != NULL)
+        waitqueue_wake_entry(queue, queue->Head);
+}
+
+uint32_t waitqueue_wake_key_locked(waitqueue_t *queue, uint64_t key, uint32_t count) {
+    // Wake up to count of the longest waiting threads with a matching key. Returns the number woken.
+    uint32_t woken = 0;
+    waitqueue_entry_t *entry = queue->Head;
+    while (entry != NULL && woken < count) {
+        waitqueue_entry_t *nextEntry = entry->Next;
+        if (entry->Key == key) {
+            waitqueue_wake_entry(queue, entry);
+            woken++;
+        }
+        entry = nextEntry;
+    }
+    return woken;
+}
+
+void waitqueue_wake_all_locked(waitqueue_t *queue) {
+    while (queue->Head != NULL)
+        waitqueue_wake_one_locked(queue);
+}
+
+void waitqueue_wake_one(waitqueue_t *queue) {
+    spinlock_lock(&queue->Lock);
+    waitqueue_wake_one_locked(queue);
+    spinlock_release(&queue->Lock);
+}
+
+void waitqueue_wake_all(waitqueue_t *queue) {
+    spinlock_lock(&queue->Lock);
+    waitqueue_wake_all_locked(queue);
+    spinlock_release(&queue->Lock);
+}
+
+//
+// Mutexes.
+//
+static inline thread_t *mutex_self(void) {
+    thread_t *thread = tasking_thread_current();
+    return (thread != NULL) ? thread : MUTEX_OWNER_BOOT;
+}
+
+void mutex_init(mutex_t *mutex) {
+    mutex->Owner = NULL;
+    waitqueue_init(&mutex->Waiters);
+}
+
+bool mutex_try_lock(mutex_t *mutex) {
+    return __sync_bool_compare_and_swap(&mutex->Owner, NULL, mutex_self());
+}
+
+void mutex_lock(mutex_t *mutex) {
+    thread_t *self = mutex_self();
+    if (__sync_bool_compare_and_swap(&mutex->Owner, NULL, self))
+        return;
+
+    // Spin while the owner is running on another processor, as it will likely release the mutex soon.
+    // The owner may exit at any time, so its thread is only looked at inside an RCU read-side section.
+    rcu_read_lock();
+    for (uint32_t i = 0; i < MUTEX_SPIN_LIMIT; i++) {
+        thread_t *owner = mutex->Owner;
+        if (owner == NULL) {
+            if (__sync_bool_compare_and_swap(&mutex->Owner, NULL, self)) {
+                rcu_read_unlock();
+                return;
+            }
+            continue;
+        }
+        if (owner == MUTEX_OWNER_BOOT || !tasking_thread_is_running(owner))
+            break;
+        asm volatile ("pause");
+    }
+    rcu_read_unlock();
+
+    // Sleep until the mutex is released. Unlocking takes the queue lock, so a release can't slip
+    // in between a failed attempt here and the wait.
+    spinlock_lock(&mutex->Waiters.Lock);
+    while (!__sync_bool_compare_and_swap(&mutex->Owner, NULL, self))
+        waitqueue_wait_locked(&mutex->Waiters, SYNC_WAIT_FOREVER);
+    spinlock_release(&mutex->Waiters.Lock);
+}
+
+void mutex_unlock(mutex_t *mutex) {
+    // Release mutex and wake a waiter to take it. Threads that are spinning may get it first.
+    spinlock_lock(&mutex->Waiters.Lock);
+    __sync_lock_release(&mutex->Owner);
+    waitqueue_wake_one_locked(&mutex->Waiters);
+    spinlock_release(&mutex->Waiters.Lock);
+}
+
+//
+// Semaphores.
+//
+void semaphore_init(semaphore_t *semaphore, uint32_t count, uint32_t maxCount) {
+    // A max count of zero means there is no limit.
+    semaphore->Count = count;
+    semaphore->MaxCount = maxCount;
+    waitqueue_init(&semaphore->Waiters);
+}
+
+bool semaphore_wait(semaphore_t *semaphore, uint32_t units, uint32_t timeoutMs) {
+    spinlock_lock(&semaphore->Waiters.Lock);
+
+    // Wait until enough units are available. Each wake only covers one pass, so the deadline is tracked here.
+    uint64_t deadline = timer_ticks() + timeoutMs;
+    while (semaphore->Count < units) {
+        uint32_t remaining = SYNC_WAIT_FOREVER;
+        if (timeoutMs != SYNC_WAIT_FOREVER) {
+            uint64_t currentTick = timer_ticks();
+            remaining = (deadline > currentTick) ? (uint32_t)(deadline - currentTick) : 0;
+        }
+
+        if (remaining == 0 || !waitqueue_wait_locked(&semaphore->Waiters, remaining)) {
+            spinlock_release(&semaphore->Waiters.Lock);
+            return false;
+        }
+    }
+
+    semaphore->Count -= units;
+    spinlock_release(&semaphore->Waiters.Lock);
+    return true;
+}
+
+void semaphore_signal(semaphore_t *semaphore, uint32_t units) {
+    spinlock_lock(&semaphore->Waiters.Lock);
+    semaphore->Count += units;
+    if (semaphore->MaxCount != 0 && semaphore->Count > semaphore->MaxCount)
+        semaphore->Count = semaphore->MaxCount;
+
+    // Waiters may want different numbers of units, so let them all check.
+    waitqueue_wake_all_locked(&semaphore->Waiters);
+    spinlock_release(&semaphore->Waiters.Lock);
+}
+
+//
+// Condition variables.
+//
+void condvar_init(condvar_t *condvar) {
+    waitqueue_init(&condvar->Waiters);
+}
+
+bool condvar_wait(condvar_t *condvar, mutex_t *mutex, uint32_t timeoutMs) {
+    // Release mutex only once we are on the queue, so a signal sent after the caller's check isn't missed.
+    spinlock_lock(&condvar->Waiters.Lock);
+    mutex_unlock(mutex);
+    bool signaled = waitqueue_wait_locked(&condvar->Waiters, timeoutMs);
+    spinlock_release(&condvar->Waiters.Lock);
+
+    // Take the mutex back before returning, as the caller expects.
+    mutex_lock(mutex);
+    return signaled;
+}
+
+void condvar_signal(condvar_t *condvar) {
+    waitqueue_wake_one(&condvar->Waiters);
+}
+
+void condvar_broadcast(condvar_t *condvar) {
+    waitqueue_wake_all(&condvar->Waiters);
+}
@@ -29,13 +29,17 @@
 
 #include <kernel/multitasking/syscalls.h>
 #include <kernel/gdt.h>
+#include <kernel/percpu.h>
 #include <kernel/interrupts/idt.h>
 #include <kernel/timer.h>
 #include <kernel/cpuid.h>
 #include <kernel/memory/kheap.h>
 #include <kernel/memory/paging.h>
 #include <kernel/memory/pmm.h>
+#include <kernel/interrupts/interrupts.h>
 #include <kernel/interrupts/smp.h>
+#include <kernel/multitasking/futex.h>
+#include <kernel/tasking.h>
 
 #include <kernel/lock.h>
 
@@ -87,6 +91,30 @@ static uintptr_t syscalls_uptime_handler(uintptr_t ptrAddr) {
     return -1;
 }
 
+static uintptr_t syscalls_futex_handler(uintptr_t address, uintptr_t op, uintptr_t value, uintptr_t timeoutMs) {
+    // Blocking needs the thread's own ring 0 stack, which only user threads have on every entry path.
+    thread_t *thread = tasking_thread_current();
+    if (thread == NULL || !thread->Parent->UserMode)
+        return -1;
+
+    switch (op) {
+        case FUTEX_WAIT: {
+            // System calls come in with interrupts off, and the thread can only block with them on.
+            // They must be off again before the exit path restores the caller's stack.
+            interrupts_enable_quiet();
+            int32_t result = futex_wait((volatile uint32_t*)address, (uint32_t)value, (uint32_t)timeoutMs);
+            interrupts_disable_quiet();
+            return (uintptr_t)(intptr_t)result;
+        }
+
+        case FUTEX_WAKE:
+            return (uintptr_t)(intptr_t)futex_wake((volatile uint32_t*)address, (uint32_t)value);
+
+        default:
+            return -1;
+    }
+}
+
 uintptr_t syscalls_handler(uintptr_t arg0, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3, uintptr_t arg4, uintptr_t arg5, uintptr_t index) {
     if (index == 0xAB) {
        kprintf_va(false, arg0, arg1);
@@ -97,6 +125,9 @@ uintptr_t syscalls_handler(uintptr_t arg0, uintptr_t arg1, uintptr_t arg2, uintp
         case SYSCALL_UPTIME:
             return syscalls_uptime_handler(arg0);
 
+        case SYSCALL_FUTEX:
+            return syscalls_futex_handler(arg0, arg1, arg2, arg3);
+
         default:
             return -1;
     }
@@ -104,10 +135,21 @@ uintptr_t syscalls_handler(uintptr_t arg0, uintptr_t arg1, uintptr_t arg2, uintp
     return 0xFE;
 }
 
+void syscalls_set_kernel_stack(uintptr_t stack) {
+    // Point ring 3 entry into the kernel at the specified stack, skipping the MSR write if nothing changed.
+    tss_t *tss = gdt_tss_get();
+    if (gdt_tss_get_kernel_stack(tss) == stack)
+        return;
+    gdt_tss_set_kernel_stack(tss, stack);
+#ifndef X86_64
+    if (!syscallInterruptOnly)
+        cpu_msr_write(SYSCALL_MSR_SYSENTER_ESP, stack);
+#endif
+}
+
 void syscalls_init_ap(void) {
     // Get processor we are running on.
-    smp_proc_t *proc = smp_get_proc(lapic_id());
-    uint32_t index = (proc != NULL) ? proc->Index : 0;
+    uint32_t index = percpu_index();
 
 #ifdef X86_64
     // Detect and enable SYSCALL.
@@ -118,6 +160,9 @@ void syscalls_init_ap(void) {
         cpu_msr_write(SYSCALL_MSR_STAR, (((uint64_t)(GDT_KERNEL_DATA_OFFSET | GDT_PRIVILEGE_USER)) << 48) | ((uint64_t)GDT_KERNEL_CODE_OFFSET << 32));
         cpu_msr_write(SYSCALL_MSR_LSTAR, (uintptr_t)_syscalls_syscall_handler);
 
+        // Clear IF on entry, so no interrupt can arrive before the handler swaps GS.
+        cpu_msr_write(SYSCALL_MSR_SFMASK, INTERRUPTS_FLAG);
+
         // Enable SYSCALL instructions.
         cpu_msr_write(SYSCALL_MSR_EFER, cpu_msr_read(SYSCALL_MSR_EFER) | 0x1);
         kprintf("SYSCALLS: SYSCALL instruction enabled!\n");
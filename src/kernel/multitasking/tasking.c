@@ -24,24 +24,43 @@
 
 #include <main.h>
 #include <kprint.h>
+#include <io.h>
 #include <string.h>
 
 #include <kernel/tasking.h>
 #include <kernel/gdt.h>
+#include <kernel/hrtimer.h>
+#include <kernel/percpu.h>
 #include <kernel/memory/kheap.h>
 #include <kernel/main.h>
+#include <kernel/cpuid.h>
 #include <kernel/timer.h>
+#include <kernel/interrupts/idt.h>
 #include <kernel/interrupts/interrupts.h>
 #include <kernel/interrupts/irqs.h>
+#include <kernel/interrupts/irqstat.h>
+#include <kernel/interrupts/lapic.h>
+#include <kernel/interrupts/exceptions.h>
 #include <kernel/interrupts/smp.h>
+#include <kernel/interrupts/softirq.h>
 
 #include <kernel/memory/paging.h>
 #include <kernel/memory/pmm.h>
+#include <kernel/multitasking/fpu.h>
+#include <kernel/multitasking/rcu.h>
+#include <kernel/multitasking/schedtrace.h>
+#include <kernel/multitasking/stacks.h>
+#include <kernel/multitasking/syscalls.h>
 
 #include <kernel/lock.h>
 
 extern void _isr_exit(void);
 extern void _tasking_thread_exec(void);
+extern void _tasking_exec_stack(uintptr_t stackPointer, lock_t *runQueueLock);
+extern void _tasking_yield_interrupt(void);
+
+// Initial size of each processor's sleep heap. The heap doubles when full.
+#define TASKING_SLEEP_HEAP_SIZE 16
 
 static uint32_t nextProcessId = 0;
 static uint32_t nextThreadId = 0;
@@ -50,8 +69,8 @@ static uint32_t nextThreadId = 0;
 static tasking_proc_t *threadLists;
 
 // Locks.
-lock_t threadLock = { };
-lock_t processLock = { };
+lock_t threadLock = LOCK_INIT_NAMED(LOCK_TYPE_SPIN, "threadLock");
+lock_t processLock = LOCK_INIT_NAMED(LOCK_TYPE_SPIN, "processLock");
 
 
 bool taskingEnabled = false;
@@ -66,7 +85,7 @@ static inline void tasking_unfreeze() {
     taskingEnabled = true;
 }
 
-lock_t threadIdLock = { };
+lock_t threadIdLock = LOCK_INIT_NAMED(LOCK_TYPE_SPIN, "threadIdLock");
 static uint32_t tasking_new_thread_id(void) {
     spinlock_lock(&threadIdLock);
     uint32_t threadId = nextThreadId;
@@ -75,7 +94,7 @@ static uint32_t tasking_new_thread_id(void) {
     return threadId;
 }
 
-lock_t processIdLock = { };
+lock_t processIdLock = LOCK_INIT_NAMED(LOCK_TYPE_SPIN, "processIdLock");
 static uint32_t tasking_new_process_id(void) {
     spinlock_lock(&processIdLock);
     uint32_t processId = nextProcessId;
@@ -84,54 +103,625 @@ static uint32_t tasking_new_process_id(void) {
     return processId;
 }
 
-void tasking_kill_thread(void) {
+static void tasking_thread_free_rcu(rcu_head_t *head) {
+    kheap_free(rcu_container(head, thread_t, Rcu));
+}
+
+static void tasking_thread_free(thread_t *thread) {
+    // Return kernel stack to the pool. User stacks stay mapped in their process.
+    if (thread->StackBottom != 0)
+        stacks_free(thread->StackBottom, thread->StackSize);
+    fpu_state_free(thread->FpuState);
+
+    // The thread object itself goes once readers that may have seen it are done.
+    rcu_call(&thread->Rcu, tasking_thread_free_rcu);
+}
+
+static void tasking_thread_zombie(tasking_proc_t *proc, thread_t *thread) {
+    // Leave dead thread for the reaper. The processor's run queue lock must be held.
+    thread->SchedNext = proc->ZombieThreads;
+    proc->ZombieThreads = thread;
+}
+
+static void tasking_process_free(process_t *process) {
+    // User processes own their lower half, including the stacks mapped there.
+    if (process->UserMode)
+        paging_free_app_copy(process->PagingTablePhys);
+    kheap_free(process);
+}
+
+static void tasking_reap(thread_t *thread) {
+    while (thread != NULL) {
+        thread_t *nextThread = thread->SchedNext;
+        process_t *process = thread->Parent;
+        tasking_thread_free(thread);
+
+        // Free the process along with its last thread.
+        spinlock_lock(&threadLock);
+        bool lastThread = --process->ThreadCount == 0;
+        spinlock_release(&threadLock);
+        if (lastThread)
+            tasking_process_free(process);
+        thread = nextThread;
+    }
+}
+
+static inline uint32_t tasking_timeslice(uint8_t priority) {
+    // Interactive priorities get short slices for latency, batch priorities get long slices for throughput.
+    return TASKING_TIMESLICE_MIN + (((TASKING_TIMESLICE_MAX - TASKING_TIMESLICE_MIN) * priority) / TASKING_PRIORITY_LOWEST);
+}
+
+static void tasking_runqueue_add(tasking_runqueue_t *runQueue, thread_t *thread) {
+    // Add thread to the end of the list for its priority.
+    thread_t *firstThread = runQueue->Threads[thread->Priority];
+    if (firstThread != NULL) {
+        thread->SchedNext = firstThread;
+        thread->SchedPrev = firstThread->SchedPrev;
+        firstThread->SchedPrev->SchedNext = thread;
+        firstThread->SchedPrev = thread;
+    }
+    else {
+        // No threads at this priority, so this one is first.
+        runQueue->Threads[thread->Priority] = thread;
+        runQueue->Bitmap |= (1 << thread->Priority);
+        thread->SchedNext = thread;
+        thread->SchedPrev = thread;
+    }
+
+    thread->RunQueue = runQueue;
+    runQueue->Count++;
+}
+
+static void tasking_runqueue_remove(tasking_runqueue_t *runQueue, thread_t *thread) {
+    // Remove thread from the list for its priority.
+    if (thread->SchedNext == thread) {
+        // Thread was the only one at this priority.
+        runQueue->Threads[thread->Priority] = NULL;
+        runQueue->Bitmap &= ~(1 << thread->Priority);
+    }
+    else {
+        thread->SchedPrev->SchedNext = thread->SchedNext;
+        thread->SchedNext->SchedPrev = thread->SchedPrev;
+        if (runQueue->Threads[thread->Priority] == thread)
+            runQueue->Threads[thread->Priority] = thread->SchedNext;
+    }
+
+    thread->SchedNext = NULL;
+    thread->SchedPrev = NULL;
+    thread->RunQueue = NULL;
+    runQueue->Count--;
+}
+
+static thread_t *tasking_runqueue_take(tasking_proc_t *proc) {
+    // If the active array is empty, the expired array becomes the active one.
+    if (proc->ActiveQueue->Bitmap == 0) {
+        tasking_runqueue_t *runQueue = proc->ActiveQueue;
+        proc->ActiveQueue = proc->ExpiredQueue;
+        proc->ExpiredQueue = runQueue;
+    }
+
+    // Nothing to run?
+    if (proc->ActiveQueue->Bitmap == 0)
+        return NULL;
+
+    // The lowest set bit is the highest priority with a runnable thread.
+    thread_t *thread = proc->ActiveQueue->Threads[__builtin_ctz(proc->ActiveQueue->Bitmap)];
+    tasking_runqueue_remove(proc->ActiveQueue, thread);
+    return thread;
+}
+
+static void tasking_proc_kick(tasking_proc_t *proc) {
+    // Without a periodic tick the processor may not take a timer interrupt for a while, so send it one now.
+    if (!timer_tickless() || !proc->TaskingEnabled)
+        return;
+
+    smp_proc_t *smpProc = smp_get_proc_index(proc - threadLists);
+    if (smpProc != NULL && smpProc->ApicId != lapic_id())
+        lapic_send_ipi(smpProc->ApicId, IRQ_OFFSET + IRQ_TIMER);
+}
+
+static void tasking_enqueue(tasking_proc_t *proc, thread_t *thread) {
+    // Add to the active array.
+    tasking_runqueue_add(proc->ActiveQueue, thread);
+
+    // Preempt the current thread at the next tick if the new thread should run first.
+    if (proc->CurrentThread == NULL || proc->CurrentThread == proc->IdleThread || thread->Priority < proc->CurrentThread->Priority) {
+        if (!proc->NeedsReschedule)
+            tasking_proc_kick(proc);
+        proc->NeedsReschedule = true;
+    }
+}
+
+static void tasking_thread_penalize(thread_t *thread) {
+    // Thread used up its whole time slice, so treat it as more CPU-bound.
+    if (thread->Priority < TASKING_PRIORITY_LOWEST && thread->Priority < thread->BasePriority + TASKING_PRIORITY_PENALTY_MAX)
+        thread->Priority++;
+    thread->TimeSlice = tasking_timeslice(thread->Priority);
+}
+
+static void tasking_thread_reward(thread_t *thread) {
+    // Thread gave up the processor to wait on something, so treat it as more interactive.
+    if (thread->Priority > thread->BasePriority)
+        thread->Priority = thread->BasePriority;
+    else if (thread->Priority > TASKING_PRIORITY_HIGHEST && thread->Priority + TASKING_PRIORITY_BONUS_MAX > thread->BasePriority)
+        thread->Priority--;
+    thread->TimeSlice = tasking_timeslice(thread->Priority);
+}
+
+static inline bool tasking_affinity_allows(thread_t *thread, uint32_t procIndex) {
+    if (procIndex >= 64)
+        return thread->AffinityMask == TASKING_AFFINITY_ALL;
+    return (thread->AffinityMask & TASKING_AFFINITY_PROC(procIndex)) != 0;
+}
+
+static inline uint32_t tasking_proc_load(uint32_t procIndex) {
+    // Queued threads, plus the running one if it's not the idle thread.
+    tasking_proc_t *proc = &threadLists[procIndex];
+    return proc->ActiveQueue->Count + proc->ExpiredQueue->Count + ((proc->CurrentThread != proc->IdleThread) ? 1 : 0);
+}
+
+static uint32_t tasking_proc_least_loaded(thread_t *thread, uint32_t defaultIndex) {
+    // Find least loaded processor the thread may run on.
+    uint32_t bestIndex = defaultIndex;
+    uint32_t bestLoad = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < smp_get_proc_count(); i++) {
+        if (!tasking_affinity_allows(thread, i))
+            continue;
+
+        uint32_t load = tasking_proc_load(i);
+        if (load < bestLoad) {
+            bestIndex = i;
+            bestLoad = load;
+        }
+    }
+    return bestIndex;
+}
+
+static tasking_proc_t *tasking_thread_lock(thread_t *thread) {
+    // The thread may move to another processor until the one it's on is locked.
+    while (true) {
+        uint32_t procIndex = thread->ProcessorIndex;
+        spinlock_lock(&threadLists[procIndex].RunQueueLock);
+        if (thread->ProcessorIndex == procIndex)
+            return &threadLists[procIndex];
+        spinlock_release(&threadLists[procIndex].RunQueueLock);
+    }
+}
+
+static void tasking_lock_pair(uint32_t procIndex1, uint32_t procIndex2) {
+    // Always lock the lower index first so two processors can't deadlock on each other.
+    if (procIndex1 > procIndex2) {
+        uint32_t temp = procIndex1;
+        procIndex1 = procIndex2;
+        procIndex2 = temp;
+    }
+    spinlock_lock(&threadLists[procIndex1].RunQueueLock);
+    if (procIndex1 != procIndex2)
+        spinlock_lock(&threadLists[procIndex2].RunQueueLock);
+}
+
+static void tasking_unlock_pair(uint32_t procIndex1, uint32_t procIndex2) {
+    // Release in reverse order so the saved interrupt state is restored correctly.
+    if (procIndex1 > procIndex2) {
+        uint32_t temp = procIndex1;
+        procIndex1 = procIndex2;
+        procIndex2 = temp;
+    }
+    if (procIndex1 != procIndex2)
+        spinlock_release(&threadLists[procIndex2].RunQueueLock);
+    spinlock_release(&threadLists[procIndex1].RunQueueLock);
+}
+
+static thread_t *tasking_runqueue_find_allowed(tasking_runqueue_t *runQueue, uint32_t procIndex) {
+    // Find a queued thread that may run on the specified processor.
+    uint32_t bitmap = runQueue->Bitmap;
+    while (bitmap != 0) {
+        uint8_t priority = __builtin_ctz(bitmap);
+        bitmap &= ~(1 << priority);
+
+        thread_t *thread = runQueue->Threads[priority];
+        do {
+            if (tasking_affinity_allows(thread, procIndex))
+                return thread;
+            thread = thread->SchedNext;
+        } while (thread != runQueue->Threads[priority]);
+    }
+    return NULL;
+}
+
+static void tasking_balance(uint32_t procIndex) {
+    // Find busiest processor.
+    uint32_t ownLoad = tasking_proc_load(procIndex);
+    uint32_t busiestIndex = procIndex;
+    uint32_t busiestLoad = 0;
+    for (uint32_t i = 0; i < smp_get_proc_count(); i++) {
+        uint32_t load = tasking_proc_load(i);
+        if (i != procIndex && load > busiestLoad) {
+            busiestIndex = i;
+            busiestLoad = load;
+        }
+    }
+
+    // Only pull a thread if it makes things more even.
+    if (busiestIndex == procIndex || busiestLoad < ownLoad + 2)
+        return;
+
+    // Pull a thread, preferring ones in the expired array as they are least likely to have a warm cache.
+    tasking_lock_pair(procIndex, busiestIndex);
+    tasking_proc_t *busiestProc = &threadLists[busiestIndex];
+    thread_t *thread = tasking_runqueue_find_allowed(busiestProc->ExpiredQueue, procIndex);
+    if (thread == NULL)
+        thread = tasking_runqueue_find_allowed(busiestProc->ActiveQueue, procIndex);
+    if (thread != NULL) {
+        tasking_runqueue_remove(thread->RunQueue, thread);
+        thread->ProcessorIndex = procIndex;
+        tasking_enqueue(&threadLists[procIndex], thread);
+        schedtrace_migrate(thread, busiestIndex, procIndex);
+    }
+    tasking_unlock_pair(procIndex, busiestIndex);
+}
+
+static void tasking_migrate_pending(uint32_t procIndex) {
+    // Take list of threads that need to move off this processor.
+    tasking_proc_t *proc = &threadLists[procIndex];
+    spinlock_lock(&proc->RunQueueLock);
+    thread_t *thread = proc->MigrateThreads;
+    proc->MigrateThreads = NULL;
+    spinlock_release(&proc->RunQueueLock);
+
+    while (thread != NULL) {
+        thread_t *nextThread = thread->SchedNext;
+        uint32_t destIndex = tasking_proc_least_loaded(thread, procIndex);
+
+        // Move thread to its new processor. If it was killed in the meantime, leave it for the reaper.
+        tasking_lock_pair(procIndex, destIndex);
+        thread->Migrating = false;
+        if (thread->State != THREAD_STATE_DEAD) {
+            thread->SchedNext = NULL;
+            thread->ProcessorIndex = destIndex;
+            tasking_enqueue(&threadLists[destIndex], thread);
+            schedtrace_migrate(thread, procIndex, destIndex);
+        }
+        else
+            tasking_thread_zombie(proc, thread);
+        tasking_unlock_pair(procIndex, destIndex);
+        thread = nextThread;
+    }
+}
+
+static void tasking_sleep_heap_set(tasking_proc_t *proc, uint32_t index, thread_t *thread) {
+    proc->SleepHeap[index] = thread;
+    thread->SleepIndex = index + 1;
+}
+
+static void tasking_sleep_heap_up(tasking_proc_t *proc, uint32_t index) {
+    // Move thread up until its parent wakes no later than it does.
+    thread_t *thread = proc->SleepHeap[index];
+    while (index > 0) {
+        uint32_t parentIndex = (index - 1) / 2;
+        if (proc->SleepHeap[parentIndex]->WakeTick <= thread->WakeTick)
+            break;
+        tasking_sleep_heap_set(proc, index, proc->SleepHeap[parentIndex]);
+        index = parentIndex;
+    }
+    tasking_sleep_heap_set(proc, index, thread);
+}
+
+static void tasking_sleep_heap_down(tasking_proc_t *proc, uint32_t index) {
+    // Move thread down until both children wake no earlier than it does.
+    thread_t *thread = proc->SleepHeap[index];
+    while (true) {
+        uint32_t childIndex = (index * 2) + 1;
+        if (childIndex >= proc->SleepCount)
+            break;
+        if (childIndex + 1 < proc->SleepCount && proc->SleepHeap[childIndex + 1]->WakeTick < proc->SleepHeap[childIndex]->WakeTick)
+            childIndex++;
+        if (thread->WakeTick <= proc->SleepHeap[childIndex]->WakeTick)
+            break;
+        tasking_sleep_heap_set(proc, index, proc->SleepHeap[childIndex]);
+        index = childIndex;
+    }
+    tasking_sleep_heap_set(proc, index, thread);
+}
+
+static bool tasking_sleep_heap_add(tasking_proc_t *proc, thread_t *thread) {
+    // Grow heap if needed. The old heap is kept if there is no memory for a bigger one.
+    if (proc->SleepCount == proc->SleepCapacity) {
+        uint32_t capacity = (proc->SleepCapacity > 0) ? proc->SleepCapacity * 2 : TASKING_SLEEP_HEAP_SIZE;
+        thread_t **heap = (thread_t**)kheap_realloc(proc->SleepHeap, sizeof(thread_t*) * capacity);
+        if (heap == NULL)
+            return false;
+        proc->SleepHeap = heap;
+        proc->SleepCapacity = capacity;
+    }
+
+    // Add thread to the bottom and move it into place.
+    proc->SleepHeap[proc->SleepCount] = thread;
+    proc->SleepCount++;
+    tasking_sleep_heap_up(proc, proc->SleepCount - 1);
+    return true;
+}
+
+static void tasking_sleep_heap_remove(tasking_proc_t *proc, thread_t *thread) {
+    uint32_t index = thread->SleepIndex - 1;
+    thread->SleepIndex = 0;
+    proc->SleepCount--;
+    if (index == proc->SleepCount)
+        return;
+
+    // Move last thread into the hole and restore heap order.
+    thread_t *lastThread = proc->SleepHeap[proc->SleepCount];
+    tasking_sleep_heap_set(proc, index, lastThread);
+    tasking_sleep_heap_up(proc, index);
+    tasking_sleep_heap_down(proc, lastThread->SleepIndex - 1);
+}
+
+static void tasking_thread_make_runnable(tasking_proc_t *proc, thread_t *thread) {
+    // Pull thread from the sleep heap if it was woken early.
+    if (thread->SleepIndex != 0)
+        tasking_sleep_heap_remove(proc, thread);
+
+    thread->State = THREAD_STATE_RUNNABLE;
+    tasking_thread_reward(thread);
+    thread->TimeSliceRemaining = thread->TimeSlice;
+    schedtrace_wakeup(thread, proc - threadLists);
+
+    // If the thread hasn't switched away yet, the scheduler will put it back on the run queue.
+    if (proc->CurrentThread != thread)
+        tasking_enqueue(proc, thread);
+}
+
+thread_t *tasking_thread_current(void) {
+    // Get current thread. This is NULL until tasking starts on this processor.
+    return percpu_current_thread();
+}
+
+bool tasking_thread_killed(void) {
+    // Blocking code checks this when woken, and cleans up its wait before calling tasking_kill_thread().
+    thread_t *thread = tasking_thread_current();
+    return thread != NULL && thread->Killed;
+}
+
+static inline void tasking_yield_interrupt(bool expire) {
+    // Raise the yield interrupt. AX tells the handler whether this is a voluntary yield.
+    asm volatile ("int %0" : : "i"(TASKING_YIELD_INTERRUPT), "a"((uintptr_t)expire) : "memory");
+}
+
+void tasking_yield(void) {
+    // Give up the rest of our time slice.
+    tasking_yield_interrupt(true);
+}
+
+void tasking_thread_block(uint8_t state) {
+    // Get processor we are running on.
+    uint32_t procIndex = percpu_index();
+
+    // Threads can't block until tasking is up.
+    if (!taskingEnabled || !threadLists[procIndex].TaskingEnabled)
+        return;
+
+    // Mark current thread as waiting, and switch away from it.
+    spinlock_lock(&threadLists[procIndex].RunQueueLock);
+    threadLists[procIndex].CurrentThread->State = state;
+    spinlock_release(&threadLists[procIndex].RunQueueLock);
+    tasking_yield_interrupt(false);
+}
+
+void tasking_thread_wake(thread_t *thread) {
+    // Lock processor the thread last ran on.
+    tasking_proc_t *proc = tasking_thread_lock(thread);
+
+    // Only waiting threads can be woken.
+    if (thread->State == THREAD_STATE_BLOCKED || thread->State == THREAD_STATE_SLEEPING)
+        tasking_thread_make_runnable(proc, thread);
+    spinlock_release(&proc->RunQueueLock);
+}
+
+bool tasking_thread_can_block(void) {
+    // Get processor we are running on.
+    uint32_t procIndex = percpu_index();
+
+    // Threads can't block until tasking is up, and the idle thread must always be runnable.
+    return taskingEnabled && threadLists[procIndex].TaskingEnabled
+        && threadLists[procIndex].CurrentThread != threadLists[procIndex].IdleThread;
+}
+
+void tasking_thread_prepare_block(uint64_t wakeTick) {
     // Get processor we are running on.
-    smp_proc_t *proc = smp_get_proc(lapic_id());
-    uint32_t procIndex = (proc != NULL) ? proc->Index : 0;
+    uint32_t procIndex = percpu_index();
+
+    // Mark current thread as blocked. A wake that arrives before the thread switches away just
+    // makes it runnable again, so callers can drop their own locks between this and tasking_thread_finish_block().
+    tasking_proc_t *proc = &threadLists[procIndex];
+    spinlock_lock(&proc->RunQueueLock);
+    thread_t *thread = proc->CurrentThread;
+    thread->State = THREAD_STATE_BLOCKED;
+
+    // Let the timer wake the thread if the wait has a timeout. If it can't be queued, the thread stays
+    // runnable and the wait returns at once, like any other spurious wake.
+    if (wakeTick != 0) {
+        thread->WakeTick = wakeTick;
+        if (!tasking_sleep_heap_add(proc, thread))
+            thread->State = THREAD_STATE_RUNNABLE;
+    }
+    spinlock_release(&proc->RunQueueLock);
+}
+
+void tasking_thread_finish_block(void) {
+    // Switch away until woken.
+    tasking_yield_interrupt(false);
+}
+
+bool tasking_thread_is_running(thread_t *thread) {
+    // This is only a hint, as the thread may be switched out right after.
+    uint32_t procIndex = thread->ProcessorIndex;
+    return threadLists != NULL && procIndex < smp_get_proc_count() && threadLists[procIndex].CurrentThread == thread
+        && thread->State == THREAD_STATE_RUNNABLE;
+}
+
+bool tasking_thread_sleep(uint32_t ms) {
+    // Sleeping with interrupts off would never be woken.
+    if (!interrupts_enabled() || !tasking_thread_can_block())
+        return false;
+
+    // Get processor we are running on.
+    uint32_t procIndex = percpu_index();
+
+    // Put current thread on the sleep heap, to be woken by the timer.
+    tasking_proc_t *proc = &threadLists[procIndex];
+    spinlock_lock(&proc->RunQueueLock);
+    thread_t *thread = proc->CurrentThread;
+    thread->WakeTick = timer_ticks() + ms;
+    thread->State = THREAD_STATE_SLEEPING;
+    if (!tasking_sleep_heap_add(proc, thread)) {
+        // No room on the sleep heap, so the caller has to wait some other way.
+        thread->State = THREAD_STATE_RUNNABLE;
+        spinlock_release(&proc->RunQueueLock);
+        return false;
+    }
+    spinlock_release(&proc->RunQueueLock);
+
+    // Switch away until woken.
+    tasking_yield_interrupt(false);
+    return true;
+}
+
+void tasking_thread_set_priority(thread_t *thread, uint8_t priority) {
+    if (priority > TASKING_PRIORITY_LOWEST)
+        priority = TASKING_PRIORITY_LOWEST;
+
+    // Lock processor the thread is on.
+    tasking_proc_t *proc = tasking_thread_lock(thread);
+
+    // Pull thread from the run queue while its priority changes.
+    tasking_runqueue_t *runQueue = thread->RunQueue;
+    if (runQueue != NULL)
+        tasking_runqueue_remove(runQueue, thread);
+
+    // Set new priority and time slice.
+    thread->BasePriority = priority;
+    thread->Priority = priority;
+    thread->TimeSlice = tasking_timeslice(priority);
+    if (thread->TimeSliceRemaining > thread->TimeSlice)
+        thread->TimeSliceRemaining = thread->TimeSlice;
+
+    // Put thread back where it was.
+    if (runQueue == proc->ActiveQueue)
+        tasking_enqueue(proc, thread);
+    else if (runQueue != NULL)
+        tasking_runqueue_add(runQueue, thread);
+    spinlock_release(&proc->RunQueueLock);
+}
+
+uint8_t tasking_thread_get_priority(thread_t *thread) {
+    return thread->BasePriority;
+}
 
-    // Pause tasking on processor.
-    threadLists[procIndex].TaskingEnabled = false;
+void tasking_thread_set_affinity(thread_t *thread, uint64_t affinityMask) {
+    // A thread must be able to run somewhere.
+    if (affinityMask == 0)
+        return;
+
+    // Set new mask.
+    tasking_proc_t *proc = tasking_thread_lock(thread);
+    uint32_t procIndex = thread->ProcessorIndex;
+    thread->AffinityMask = affinityMask;
+    bool allowed = tasking_affinity_allows(thread, procIndex);
+
+    // A running thread is moved by the scheduler once it switches away.
+    if (!allowed && proc->CurrentThread == thread)
+        proc->NeedsReschedule = true;
+    bool queued = thread->RunQueue != NULL;
+    spinlock_release(&proc->RunQueueLock);
+
+    // Move queued thread to a processor it's allowed on.
+    if (!allowed && queued) {
+        uint32_t destIndex = tasking_proc_least_loaded(thread, procIndex);
+        tasking_lock_pair(procIndex, destIndex);
+        if (thread->ProcessorIndex == procIndex && thread->RunQueue != NULL) {
+            tasking_runqueue_remove(thread->RunQueue, thread);
+            thread->ProcessorIndex = destIndex;
+            tasking_enqueue(&threadLists[destIndex], thread);
+            schedtrace_migrate(thread, procIndex, destIndex);
+        }
+        tasking_unlock_pair(procIndex, destIndex);
+    }
+}
+
+static void tasking_thread_kill_sibling(thread_t *thread) {
+    // Lock processor the thread is on.
+    tasking_proc_t *proc = tasking_thread_lock(thread);
+
+    // Blocked threads may still have a wait queue entry and timer on their stack. They are woken instead,
+    // and see they were killed, so they unlink both before exiting.
+    thread->Killed = true;
+    if (thread->State == THREAD_STATE_BLOCKED) {
+        tasking_thread_make_runnable(proc, thread);
+        spinlock_release(&proc->RunQueueLock);
+        return;
+    }
+
+    // Mark thread as dead and pull it from the run queue.
+    thread->State = THREAD_STATE_DEAD;
+    if (thread->RunQueue != NULL)
+        tasking_runqueue_remove(thread->RunQueue, thread);
+    if (thread->SleepIndex != 0)
+        tasking_sleep_heap_remove(proc, thread);
+
+    // If the thread is running, its processor hands it to the reaper when switching away.
+    // Migrating threads are handed over once they reach the migration code.
+    if (proc->CurrentThread == thread) {
+        if (!proc->NeedsReschedule)
+            tasking_proc_kick(proc);
+        proc->NeedsReschedule = true;
+    }
+    else if (!thread->Migrating)
+        tasking_thread_zombie(proc, thread);
+    spinlock_release(&proc->RunQueueLock);
+}
 
+void tasking_kill_thread(void) {
     // Get current thread.
-    thread_t *currentThread = threadLists[procIndex].CurrentThread;
+    thread_t *currentThread = tasking_thread_current();
+    process_t *parentProcess = currentThread->Parent;
 
-    // Remove thread from schedule.
-    currentThread->SchedPrev->SchedNext = currentThread->SchedNext;
-    currentThread->SchedNext->SchedPrev = currentThread->SchedPrev;
+    // If this is the main thread, we can kill the process too.
+    bool killProcess = currentThread == parentProcess->MainThread;
 
-    // Remove thread from process.
     spinlock_lock(&threadLock);
-    currentThread->Prev->Next = currentThread->Next;
-    currentThread->Next->Prev = currentThread->Prev;
+    if (killProcess) {
+        // Kill all other threads in the process. Each is detached into a ring of its own, as killed
+        // blocked threads still unlink themselves below once they unwind, after the others may be freed.
+        thread_t *thread = currentThread->Next;
+        while (thread != currentThread) {
+            thread_t *nextThread = thread->Next;
+            thread->Next = thread;
+            thread->Prev = thread;
+            tasking_thread_kill_sibling(thread);
+            thread = nextThread;
+        }
+        currentThread->Next = currentThread;
+        currentThread->Prev = currentThread;
+        parentProcess->MainThread = NULL;
+    }
+    else {
+        // Remove thread from process.
+        currentThread->Prev->Next = currentThread->Next;
+        currentThread->Next->Prev = currentThread->Prev;
+    }
     spinlock_release(&threadLock);
 
-    // If this is the main thread, we can kill the process too.
-    process_t *parentProcess = currentThread->Parent;
-    if (currentThread == parentProcess->MainThread) {
+    if (killProcess) {
         // Remove process from list.
         spinlock_lock(&processLock);
         parentProcess->Prev->Next = parentProcess->Next;
         parentProcess->Next->Prev = parentProcess->Prev;
         spinlock_release(&processLock);
-
-        // Free all threads.
-        thread_t *thread = currentThread->Next;
-        while (thread != currentThread) {
-            kheap_free(thread);
-            thread = thread->Next;
-        }
-        kheap_free(currentThread);
-
-        // Free process from memory.
-        kheap_free(parentProcess);
-    }
-    else {
-        // Free thread from memory. The scheduler will move away from it at the next cycle.
-        kheap_free(currentThread);
     }
 
-    // Resume tasking.
-    threadLists[procIndex].TaskingEnabled = true;
+    // Mark thread as dead and switch away from it. The reaper frees it and, once all threads are gone, the process.
+    currentThread->State = THREAD_STATE_DEAD;
+    tasking_yield_interrupt(false);
 }
 
 void __notified(int sig) {
@@ -159,7 +749,8 @@ void __notified(int sig) {
 
 
 
-thread_t *tasking_thread_create(process_t *process, char *name, thread_entry_func_t func, uintptr_t arg0, uintptr_t arg1, uintptr_t arg2) {
+thread_t *tasking_thread_create_stack(process_t *process, char *name, thread_entry_func_t func, size_t stackSize,
+    uintptr_t arg0, uintptr_t arg1, uintptr_t arg2) {
     // Allocate memory for thread.
     thread_t *thread = (thread_t*)kheap_alloc(sizeof(thread_t));
     memset(thread, 0, sizeof(thread_t));
@@ -170,11 +761,36 @@ thread_t *tasking_thread_create(process_t *process, char *name, thread_entry_fun
     thread->ThreadId = tasking_new_thread_id();
     thread->EntryFunc = func;
 
-    // Pop new page for stack and map to temp address.
-    thread->StackPage = pmm_pop_frame();
-    uintptr_t stackBottom = (uintptr_t)paging_device_alloc(thread->StackPage, thread->StackPage);
-    uintptr_t stackTop = stackBottom + PAGE_SIZE_4K;
-    memset((void*)stackBottom, 0, PAGE_SIZE_4K);
+    // Set scheduling fields. The thread isn't on a run queue until it is scheduled.
+    thread->State = THREAD_STATE_RUNNABLE;
+    thread->BasePriority = TASKING_PRIORITY_NORMAL;
+    thread->Priority = TASKING_PRIORITY_NORMAL;
+    thread->TimeSlice = tasking_timeslice(TASKING_PRIORITY_NORMAL);
+    thread->TimeSliceRemaining = thread->TimeSlice;
+    thread->AffinityMask = TASKING_AFFINITY_ALL;
+    thread->FpuProcessorIndex = FPU_NO_PROCESSOR;
+
+    uintptr_t stackBottom;
+    uintptr_t stackTop;
+    if (process->UserMode) {
+        // Pop new page for stack and map to temp address.
+        thread->StackPage = pmm_pop_frame();
+        stackBottom = (uintptr_t)paging_device_alloc(thread->StackPage, thread->StackPage);
+        stackTop = stackBottom + PAGE_SIZE_4K;
+        memset((void*)stackBottom, 0, PAGE_SIZE_4K);
+
+        // Get ring 0 stack, so the thread can block inside system calls.
+        thread->StackSize = THREAD_STACK_SIZE;
+        thread->StackBottom = stacks_alloc(thread->StackSize);
+    }
+    else {
+        // Get kernel stack from the pool. It has a guard page below it, and doesn't need zeroing.
+        thread->StackSize = STACKS_PAGES(stackSize) * PAGE_SIZE_4K;
+        thread->StackBottom = stacks_alloc(thread->StackSize);
+        stackBottom = thread->StackBottom;
+        stackTop = stackBottom + thread->StackSize;
+        memset((void*)(stackTop - sizeof(irq_regs_t)), 0, sizeof(irq_regs_t));
+    }
 
     // Set up registers.
     irq_regs_t *regs = (irq_regs_t*)(stackTop - sizeof(irq_regs_t));
@@ -182,6 +798,11 @@ thread_t *tasking_thread_create(process_t *process, char *name, thread_entry_fun
     regs->FLAGS.InterruptsEnabled = true;
     regs->CS = process->UserMode ? (GDT_USER_CODE_OFFSET | GDT_PRIVILEGE_USER) : GDT_KERNEL_CODE_OFFSET;
     regs->DS = regs->ES = regs->FS = regs->GS = regs->SS = process->UserMode ? (GDT_USER_DATA_OFFSET | GDT_PRIVILEGE_USER) : GDT_KERNEL_DATA_OFFSET;
+#ifndef X86_64
+    // Kernel threads keep GS on the per-CPU segment. Each processor has its own copy of it in its GDT.
+    if (!process->UserMode)
+        regs->GS = GDT_PERCPU_OFFSET;
+#endif
 
     // AX contains the address of thread's main function. BX, CX, and DX contain args.
     regs->IP = (uintptr_t)_tasking_thread_exec;
@@ -228,6 +849,7 @@ thread_t *tasking_thread_create(process_t *process, char *name, thread_entry_fun
         thread->Next = thread;
         thread->Prev = thread;
     }
+    process->ThreadCount++;
 
     spinlock_release(&threadLock);
 
@@ -235,6 +857,11 @@ thread_t *tasking_thread_create(process_t *process, char *name, thread_entry_fun
     return thread;
 }
 
+thread_t *tasking_thread_create(process_t *process, char *name, thread_entry_func_t func, uintptr_t arg0, uintptr_t arg1, uintptr_t arg2) {
+    // Create thread with the default stack size.
+    return tasking_thread_create_stack(process, name, func, THREAD_STACK_SIZE, arg0, arg1, arg2);
+}
+
 thread_t *tasking_thread_create_kernel(char *name, thread_entry_func_t func, uintptr_t arg0, uintptr_t arg1, uintptr_t arg2) {
     // Create kernel thread.
     return tasking_thread_create(kernelProcess, name, func, arg0, arg1, arg2);
@@ -277,18 +904,23 @@ process_t *tasking_process_create(process_t *parent, char *name, bool userMode,
     return process;
 }
 
+void tasking_thread_schedule(thread_t *thread) {
+    // Add thread to the least loaded processor it may run on.
+    tasking_thread_schedule_proc(thread, tasking_proc_least_loaded(thread, 0));
+}
+
 void tasking_thread_schedule_proc(thread_t *thread, uint32_t procIndex) {
-    // Pause tasking on processor.
-    threadLists[procIndex].TaskingEnabled = false;
+    // Lock processor.
+    tasking_proc_t *proc = &threadLists[procIndex];
+    spinlock_lock(&proc->RunQueueLock);
 
     // Add thread into schedule on specified processor.
-    thread->SchedNext = threadLists[procIndex].CurrentThread->SchedNext;
-    thread->SchedNext->SchedPrev = thread;
-    thread->SchedPrev = threadLists[procIndex].CurrentThread;
-    threadLists[procIndex].CurrentThread->SchedNext = thread;
-
-    // Resume tasking on processor.
-    threadLists[procIndex].TaskingEnabled = true;
+    thread->ProcessorIndex = procIndex;
+    thread->State = THREAD_STATE_RUNNABLE;
+    thread->TimeSliceRemaining = thread->TimeSlice;
+    tasking_enqueue(proc, thread);
+    schedtrace_wakeup(thread, procIndex);
+    spinlock_release(&proc->RunQueueLock);
 }
 
 static void kernel_init_thread(void) {
@@ -298,10 +930,35 @@ static void kernel_init_thread(void) {
     }
 }
 
+static void tasking_reaper_thread(uintptr_t arg0, uintptr_t arg1, uintptr_t arg2) {
+    thread_t *batch = NULL;
+    while (true) {
+        sleep(TASKING_REAPER_INTERVAL);
+
+        // Free the batch collected last pass. By now no processor can still be switching away from those threads.
+        tasking_reap(batch);
+
+        // Collect zombies from all processors for the next pass.
+        batch = NULL;
+        for (uint32_t i = 0; i < smp_get_proc_count(); i++) {
+            spinlock_lock(&threadLists[i].RunQueueLock);
+            thread_t *thread = threadLists[i].ZombieThreads;
+            threadLists[i].ZombieThreads = NULL;
+            spinlock_release(&threadLists[i].RunQueueLock);
+
+            while (thread != NULL) {
+                thread_t *nextThread = thread->SchedNext;
+                thread->SchedNext = batch;
+                batch = thread;
+                thread = nextThread;
+            }
+        }
+    }
+}
+
 static void kernel_main_thread(void) {
     // Get processor we are running on.
-    smp_proc_t *proc = smp_get_proc(lapic_id());
-    uint32_t procIndex = (proc != NULL) ? proc->Index : 0;
+    uint32_t procIndex = percpu_index();
 
     // Enable tasking on current processor.
     threadLists[procIndex].TaskingEnabled = true;
@@ -317,6 +974,9 @@ static void kernel_main_thread(void) {
     kprintf("TASKING: All processors started, enabling multitasking!\n");
     tasking_unfreeze();
 
+    // Start reaper to free dead threads and processes.
+    tasking_thread_schedule(tasking_thread_create_kernel("reaper", tasking_reaper_thread, 0, 0, 0));
+
     // Create userspace process.
    // kprintf("Creating userspace process...\n");
     //process_t *initProcess = tasking_process_create(kernelProcess, "init", true, "init_main", kernel_init_thread, 0, 0, 0);
@@ -328,38 +988,250 @@ static void kernel_main_thread(void) {
 static void kernel_idle_thread(uintptr_t procIndex) {
     threadLists[procIndex].TaskingEnabled = true;
 
-    // Do nothing.
+    // Use MONITOR/MWAIT if supported, so a remote processor queueing work can wake us without an interrupt.
+    uint32_t unused, result;
+    bool mwaitSupported = cpuid_query(CPUID_GETFEATURES, &unused, &unused, &result, &unused) && (result & CPUID_FEAT_ECX_MONITOR);
+    volatile bool *needsReschedule = &threadLists[procIndex].NeedsReschedule;
+
+    // Halt until there is something to run. The timer tick or an IPI also wakes us.
     while (true) {
-        sleep(1000);
-       // kprintf("hi %u\n", lapic_id());
+        rcu_idle_enter();
+        if (mwaitSupported) {
+            asm volatile ("monitor" : : "a"(needsReschedule), "c"(0), "d"(0));
+            if (!*needsReschedule)
+                asm volatile ("mwait" : : "a"(0), "c"(0));
+        }
+        else {
+            // Interrupts are disabled between the check and HLT so a wakeup can't be missed.
+            asm volatile ("cli");
+            if (!*needsReschedule)
+                asm volatile ("sti; hlt");
+            else
+                asm volatile ("sti");
+        }
+        rcu_idle_exit();
+
+        // Run any deferred work that was left pending.
+        softirq_run(procIndex);
+
+        // Try to take work from a busier processor.
+        tasking_balance(procIndex);
+
+        // Switch to whatever was queued right away instead of waiting for the next tick.
+        if (*needsReschedule)
+            tasking_yield();
     }
 }
 
-static void tasking_exec(uint32_t procIndex) {
-    // Send EOI.
-    irqs_eoi(0);
+void tasking_get_proc_ticks(uint32_t procIndex, uint64_t *idleTicks, uint64_t *busyTicks) {
+    *idleTicks = threadLists[procIndex].IdleTicks;
+    *busyTicks = threadLists[procIndex].BusyTicks;
+}
 
-    // Change out paging structure and stack.
-    paging_change_directory(threadLists[procIndex].CurrentThread->Parent->PagingTablePhys);
-#ifdef X86_64
-    asm volatile ("mov %0, %%rsp" : : "r"(threadLists[procIndex].CurrentThread->StackPointer));
-#else
-    asm volatile ("mov %0, %%esp" : : "r"(threadLists[procIndex].CurrentThread->StackPointer));
-#endif
-    asm volatile ("jmp _irq_exit");
+static void tasking_exec(uint32_t procIndex, bool eoi) {
+    // Send EOI if we came from an IRQ. The IRQ handler won't return to finish up, so it's done here.
+    percpu_t *percpu = percpu_get();
+    if (eoi) {
+        irqs_eoi(0);
+        irqstat_exit(percpu->Index);
+        percpu->IrqDepth = 0;
+    }
+
+    // Publish new thread for quick lookups.
+    thread_t *thread = threadLists[procIndex].CurrentThread;
+    percpu->CurrentThread = thread;
+    percpu->ContextSwitches++;
+
+    // User threads enter the kernel on their own ring 0 stack.
+    syscalls_set_kernel_stack(thread->Parent->UserMode ? thread->StackBottom + thread->StackSize : percpu->KernelStack);
+
+    // Change out paging structure and stack. The run queue lock is released once we are on the new stack.
+    paging_change_directory(thread->Parent->PagingTablePhys);
+    _tasking_exec_stack(thread->StackPointer, &threadLists[procIndex].RunQueueLock);
 }
 
-void tasking_tick(irq_regs_t *regs, uint32_t procIndex) {
+static void tasking_program_timer(tasking_proc_t *proc) {
+    // Wake up for load balancing at the latest.
+    uint32_t ms = (proc->BalanceTicks < TASKING_BALANCE_INTERVAL) ? (TASKING_BALANCE_INTERVAL - proc->BalanceTicks) : 1;
+
+    // A running thread needs the timer when its slice runs out.
+    if (proc->CurrentThread != proc->IdleThread && proc->CurrentThread->TimeSliceRemaining < ms)
+        ms = proc->CurrentThread->TimeSliceRemaining;
+
+    // Sleeping threads need it when the first one should wake.
+    if (proc->SleepCount > 0) {
+        uint64_t currentTick = timer_ticks();
+        uint64_t wakeTick = proc->SleepHeap[0]->WakeTick;
+        if (wakeTick <= currentTick)
+            ms = 1;
+        else if (wakeTick - currentTick < ms)
+            ms = (uint32_t)(wakeTick - currentTick);
+    }
+
+    // A switch held back for softirqs happens at the next tick.
+    if (proc->NeedsReschedule)
+        ms = 1;
+
+    // Arm timer. High-resolution timers may need it sooner, at better than tick precision. This does nothing if the timer is periodic.
+    uint64_t timerDeadline = hrtimer_next_deadline(proc - threadLists);
+    if (timerDeadline < timer_now_ns() + (ms * TIMER_NS_PER_MS))
+        timer_set_next_event_ns(timerDeadline);
+    else
+        timer_set_next_event(ms);
+}
+
+static void tasking_fpu_handler(ExceptionRegisters_t *regs) {
+    // Get processor we are running on.
+    uint32_t procIndex = percpu_index();
+    tasking_proc_t *proc = &threadLists[procIndex];
+    thread_t *thread = proc->CurrentThread;
+
+    // Allow FPU use for the rest of the slice.
+    fpu_allow_use();
+    proc->FpuActive = true;
+    if (thread == NULL)
+        return;
+
+    // Nothing to load if the registers still hold this thread's state.
+    if (proc->FpuOwner == thread && thread->FpuProcessorIndex == procIndex)
+        return;
+
+    // Previous owner's state was saved when it was switched out, so load ours over it.
+    if (thread->FpuState == NULL)
+        thread->FpuState = fpu_state_create();
+    fpu_restore(thread->FpuState);
+    proc->FpuOwner = thread;
+    thread->FpuProcessorIndex = procIndex;
+}
+
+static void tasking_schedule(irq_regs_t *regs, uint32_t procIndex, bool eoi, bool yield) {
+    // Lock processor's run queues. The time taken from here until the switch is traced as the switch cost.
+    uint64_t scheduleTsc = cpu_tsc_read();
+    tasking_proc_t *proc = &threadLists[procIndex];
+    spinlock_lock(&proc->RunQueueLock);
+    proc->NeedsReschedule = false;
+
+    // Put current thread back on the run queue if it can still run.
+    thread_t *currentThread = proc->CurrentThread;
+    if (currentThread != proc->IdleThread && currentThread->State == THREAD_STATE_RUNNABLE) {
+        if (!tasking_affinity_allows(currentThread, procIndex)) {
+            // Thread may no longer run here, so it gets moved at the next tick.
+            currentThread->Migrating = true;
+            currentThread->SchedNext = proc->MigrateThreads;
+            proc->MigrateThreads = currentThread;
+        }
+        else if (yield || currentThread->TimeSliceRemaining == 0) {
+            // Thread is done with its slice, so it waits in the expired array until everyone else has had a turn.
+            if (!yield)
+                tasking_thread_penalize(currentThread);
+            currentThread->TimeSliceRemaining = currentThread->TimeSlice;
+            tasking_runqueue_add(proc->ExpiredQueue, currentThread);
+        }
+        else {
+            // Thread was preempted, so it keeps the rest of its slice.
+            tasking_runqueue_add(proc->ActiveQueue, currentThread);
+        }
+    }
+
+    // Get highest priority thread, or idle if there is nothing to run.
+    thread_t *nextThread = tasking_runqueue_take(proc);
+    if (nextThread == NULL)
+        nextThread = proc->IdleThread;
+    nextThread->ProcessorIndex = procIndex;
+
+    // If we picked the same thread, there's nothing to switch.
+    if (nextThread == currentThread) {
+        tasking_program_timer(proc);
+        spinlock_release(&proc->RunQueueLock);
+        return;
+    }
+
+    // Save stack pointer and move to next thread.
+    currentThread->StackPointer = (uintptr_t)regs;
+    proc->CurrentThread = nextThread;
+    tasking_program_timer(proc);
+
+    // Save FPU state if the outgoing thread used it, so it can resume on any processor.
+    // The next FPU instruction traps, and only then is the new thread's state loaded.
+    if (proc->FpuActive && currentThread->State != THREAD_STATE_DEAD)
+        fpu_save(currentThread->FpuState);
+    proc->FpuActive = false;
+    fpu_trap_next_use();
+
+    // Dead threads are left for the reaper, as we are still running on their stack.
+    if (currentThread->State == THREAD_STATE_DEAD)
+        tasking_thread_zombie(proc, currentThread);
+
+    // Jump to next task. The outgoing thread can't be in a read-side section, so this is a quiescent state.
+    rcu_note_qs();
+    schedtrace_switch(procIndex, currentThread, nextThread, scheduleTsc);
+    tasking_exec(procIndex, eoi);
+}
+
+void tasking_yield_handler(irq_regs_t *regs) {
+    // Get processor we are running on.
+    uint32_t procIndex = percpu_index();
+
     // Is tasking enabled both globally and for the current processor?
     if (!taskingEnabled || !threadLists[procIndex].TaskingEnabled)
         return;
 
-    // Save stack pointer and move to next thread in schedule.
-    threadLists[procIndex].CurrentThread->StackPointer = (uintptr_t)regs;
-    threadLists[procIndex].CurrentThread = threadLists[procIndex].CurrentThread->SchedNext;
+    // Switch away from the current thread. AX is set if this is a voluntary yield.
+    tasking_schedule(regs, procIndex, false, regs->AX != 0);
+}
+
+void tasking_tick(irq_regs_t *regs, uint32_t procIndex) {
+    // Is tasking enabled both globally and for the current processor? If not, keep the timer going.
+    if (!taskingEnabled || !threadLists[procIndex].TaskingEnabled) {
+        timer_set_next_event(1);
+        return;
+    }
+
+    // Get ticks elapsed since the last timer interrupt. Without a periodic tick this can be more than one.
+    tasking_proc_t *proc = &threadLists[procIndex];
+    uint64_t currentTick = timer_ticks();
+    uint32_t elapsed = (proc->LastTick != 0) ? (uint32_t)(currentTick - proc->LastTick) : 0;
+    proc->LastTick = currentTick;
+
+    // Move threads that may no longer run here, and periodically even out load with other processors.
+    if (proc->MigrateThreads != NULL)
+        tasking_migrate_pending(procIndex);
+    proc->BalanceTicks += elapsed;
+    if (proc->BalanceTicks >= TASKING_BALANCE_INTERVAL) {
+        proc->BalanceTicks = 0;
+        tasking_balance(procIndex);
+    }
+
+    // Wake any threads whose sleep has run out.
+    if (proc->SleepCount > 0) {
+        spinlock_lock(&proc->RunQueueLock);
+        while (proc->SleepCount > 0 && proc->SleepHeap[0]->WakeTick <= currentTick)
+            tasking_thread_make_runnable(proc, proc->SleepHeap[0]);
+        spinlock_release(&proc->RunQueueLock);
+    }
+
+    // Charge the elapsed ticks to the current thread's time slice.
+    thread_t *currentThread = proc->CurrentThread;
+    if (currentThread == proc->IdleThread)
+        proc->IdleTicks += elapsed;
+    else {
+        proc->BusyTicks += elapsed;
+        currentThread->TimeSliceRemaining -= (elapsed < currentThread->TimeSliceRemaining) ? elapsed : currentThread->TimeSliceRemaining;
+        if (currentThread->TimeSliceRemaining == 0)
+            proc->NeedsReschedule = true;
+    }
 
-    // Jump to next task.
-    tasking_exec(procIndex);
+    // Switch if the slice ran out or a higher priority thread is waiting. Softirqs in progress or raised
+    // by this interrupt must finish first, as switching away skips the softirq run on IRQ exit.
+    // Threads in an RCU read-side section aren't preempted, the switch is retried at the next tick.
+    if (proc->NeedsReschedule && !softirq_active(procIndex) && !softirq_pending(procIndex) && percpu_get()->RcuNesting == 0)
+        tasking_schedule(regs, procIndex, true, false);
+    else {
+        // Arm timer for the next thing that needs doing.
+        spinlock_lock(&proc->RunQueueLock);
+        tasking_program_timer(proc);
+        spinlock_release(&proc->RunQueueLock);
+    }
 }
 
 void tasking_init_ap(void) {
@@ -367,7 +1239,8 @@ void tasking_init_ap(void) {
     interrupts_disable();
 
     // Get processor.
-    smp_proc_t *proc = smp_get_proc(lapic_id());
+    uint32_t procIndex = percpu_index();
+    percpu_get()->Tasking = &threadLists[procIndex];
 
     // Set kernel stack pointer. This is used for interrupts when switching from ring 3 tasks.
     uintptr_t kernelStack;
@@ -377,19 +1250,24 @@ void tasking_init_ap(void) {
     asm volatile ("mov %%esp, %0" : "=r"(kernelStack));
 #endif
     gdt_tss_set_kernel_stack(gdt_tss_get(), kernelStack);
+    percpu_get()->KernelStack = kernelStack;
 
-    // Initialize fast syscalls for this processor.
+    // Initialize fast syscalls and the FPU for this processor.
     syscalls_init_ap();
+    fpu_init();
 
-    // Create idle kernel thread.
-    thread_t *idleThread = tasking_thread_create_kernel("core_idle", kernel_idle_thread, proc->Index, 0, 0);
-    threadLists[proc->Index].CurrentThread = idleThread;
-    idleThread->SchedNext = idleThread;
-    idleThread->SchedPrev = idleThread;
+    // Create idle kernel thread. This runs whenever the run queues are empty.
+    thread_t *idleThread = tasking_thread_create_kernel("core_idle", kernel_idle_thread, procIndex, 0, 0);
+    idleThread->BasePriority = idleThread->Priority = TASKING_PRIORITY_LOWEST;
+    idleThread->ProcessorIndex = procIndex;
+    threadLists[procIndex].IdleThread = idleThread;
+    threadLists[procIndex].CurrentThread = idleThread;
 
     // Start tasking!
+    fpu_trap_next_use();
     interrupts_enable();
-    tasking_exec(proc->Index);
+    spinlock_lock(&threadLists[procIndex].RunQueueLock);
+    tasking_exec(procIndex, false);
 }
 
 void tasking_init(void) {
@@ -404,6 +1282,7 @@ void tasking_init(void) {
     asm volatile ("mov %%esp, %0" : "=r"(kernelStack));
 #endif
     gdt_tss_set_kernel_stack(NULL, kernelStack);
+    percpu_get()->KernelStack = kernelStack;
 
     // Initialize system calls.
     syscalls_init();
@@ -411,15 +1290,43 @@ void tasking_init(void) {
     // Create thread lists for processors.
     threadLists = (tasking_proc_t*)kheap_alloc(sizeof(tasking_proc_t) * smp_get_proc_count());
     memset(threadLists, 0, sizeof(tasking_proc_t) * smp_get_proc_count());
+    for (uint32_t i = 0; i < smp_get_proc_count(); i++) {
+        threadLists[i].ActiveQueue = &threadLists[i].RunQueues[0];
+        threadLists[i].ExpiredQueue = &threadLists[i].RunQueues[1];
+
+        // Run queues are hit from every processor during wakeups and balancing, so waiters queue up.
+        spinlock_init(&threadLists[i].RunQueueLock, LOCK_TYPE_MCS);
+        spinlock_set_name_index(&threadLists[i].RunQueueLock, "RunQueueLock", i);
+    }
+    percpu_get()->Tasking = &threadLists[0];
+
+    // Set up stack pool and deferred work.
+    stacks_init();
+    softirq_init();
+    hrtimer_init();
+    rcu_init();
+    schedtrace_init();
+
+    // Set up FPU. Threads get their FPU state loaded on first use.
+    fpu_init();
+    exceptions_install_handler(EXCEPTION_DEVICE_NOT_AVAILABLE, tasking_fpu_handler);
+
+    // Add gate used by threads to yield the processor.
+    idt_open_interrupt_gate(idt_get_bsp(), TASKING_YIELD_INTERRUPT, (uintptr_t)_tasking_yield_interrupt);
 
     // Create main kernel process.
     kprintf("Creating kernel process...\n");
     tasking_process_create(NULL, "kernel", false, "kernel_main", kernel_main_thread, 0, 0, 0);
     threadLists[0].CurrentThread = kernelProcess->MainThread;
-    kernelProcess->MainThread->SchedNext = kernelProcess->MainThread;
-    kernelProcess->MainThread->SchedPrev = kernelProcess->MainThread;
+
+    // Create idle thread for the BSP.
+    thread_t *idleThread = tasking_thread_create_kernel("core_idle", kernel_idle_thread, 0, 0, 0);
+    idleThread->BasePriority = idleThread->Priority = TASKING_PRIORITY_LOWEST;
+    threadLists[0].IdleThread = idleThread;
 
     // Start tasking on BSP!
+    fpu_trap_next_use();
     interrupts_enable();
-    tasking_exec(0);
+    spinlock_lock(&threadLists[0].RunQueueLock);
+    tasking_exec(0, false);
 }
@@ -0,0 +1,157 @@
+/*
+ * File: workqueue.c
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <main.h>
+#include <kprint.h>
+#include <string.h>
+#include <kernel/multitasking/workqueue.h>
+
+#include <kernel/tasking.h>
+#include <kernel/timer.h>
+#include <kernel/interrupts/smp.h>
+#include <kernel/memory/kheap.h>
+
+// Shared queue for general deferred work, with one thread per processor.
+static workqueue_t *systemWorkqueue = NULL;
+
+void work_init(work_item_t *item, work_func_t func, void *context) {
+    item->Next = NULL;
+    item->Func = func;
+    item->Context = context;
+    item->DueTick = 0;
+    item->Queued = false;
+}
+
+static void workqueue_add_ready(workqueue_t *queue, work_item_t *item) {
+    item->Next = NULL;
+    if (queue->Tail != NULL)
+        queue->Tail->Next = item;
+    else
+        queue->Head = item;
+    queue->Tail = item;
+}
+
+static void workqueue_worker_thread(uintptr_t queueAddress, uintptr_t arg1, uintptr_t arg2) {
+    workqueue_t *queue = (workqueue_t*)queueAddress;
+    while (true) {
+        spinlock_lock(&queue->Lock);
+
+        // Move delayed items that are due onto the ready list.
+        uint64_t currentTick = timer_ticks();
+        while (queue->Delayed != NULL && queue->Delayed->DueTick <= currentTick) {
+            work_item_t *item = queue->Delayed;
+            queue->Delayed = item->Next;
+            workqueue_add_ready(queue, item);
+        }
+
+        // Take the next ready item.
+        work_item_t *item = queue->Head;
+        if (item != NULL) {
+            queue->Head = item->Next;
+            if (queue->Head == NULL)
+                queue->Tail = NULL;
+        }
+
+        // With nothing ready, sleep until the first delayed item is due or more work comes in.
+        uint32_t timeoutMs = SYNC_WAIT_FOREVER;
+        if (item == NULL && queue->Delayed != NULL)
+            timeoutMs = (uint32_t)(queue->Delayed->DueTick - currentTick);
+        spinlock_release(&queue->Lock);
+
+        if (item == NULL) {
+            semaphore_wait(&queue->WorkSignal, 1, timeoutMs);
+            continue;
+        }
+
+        // Clear queued flag before running so the item can be submitted again.
+        work_func_t func = item->Func;
+        void *context = item->Context;
+        item->Queued = false;
+        func(context);
+    }
+}
+
+workqueue_t *workqueue_create(char *name, uint32_t threadCount) {
+    workqueue_t *queue = (workqueue_t*)kheap_alloc(sizeof(workqueue_t));
+    memset(queue, 0, sizeof(workqueue_t));
+    queue->Name = name;
+    spinlock_set_name(&queue->Lock, name);
+    queue->ThreadCount = threadCount;
+    semaphore_init(&queue->WorkSignal, 0, threadCount);
+
+    // Start worker threads.
+    for (uint32_t i = 0; i < threadCount; i++)
+        tasking_thread_schedule(tasking_thread_create_kernel(name, workqueue_worker_thread, (uintptr_t)queue, 0, 0));
+    return queue;
+}
+
+workqueue_t *workqueue_get_system(void) {
+    return systemWorkqueue;
+}
+
+bool workqueue_submit_delayed(workqueue_t *queue, work_item_t *item, uint32_t delayMs) {
+    // Items already waiting aren't queued again.
+    if (!__sync_bool_compare_and_swap(&item->Queued, false, true))
+        return false;
+
+    // No queue means the system queue, so delayed work still goes through the delayed list.
+    if (queue == NULL)
+        queue = systemWorkqueue;
+
+    // Without a queue yet, run the work now. Delayed work can't be honored, so it is refused.
+    if (queue == NULL) {
+        item->Queued = false;
+        if (delayMs != 0)
+            return false;
+        item->Func(item->Context);
+        return true;
+    }
+
+    spinlock_lock(&queue->Lock);
+    if (delayMs == 0)
+        workqueue_add_ready(queue, item);
+    else {
+        // Insert in due tick order.
+        item->DueTick = timer_ticks() + delayMs;
+        work_item_t **link = &queue->Delayed;
+        while (*link != NULL && (*link)->DueTick <= item->DueTick)
+            link = &(*link)->Next;
+        item->Next = *link;
+        *link = item;
+    }
+    spinlock_release(&queue->Lock);
+
+    // Wake a worker. For delayed items this lets it shorten its wait.
+    semaphore_signal(&queue->WorkSignal, 1);
+    return true;
+}
+
+bool workqueue_submit(workqueue_t *queue, work_item_t *item) {
+    return workqueue_submit_delayed(queue, item, 0);
+}
+
+void workqueue_init(void) {
+    systemWorkqueue = workqueue_create("kworker", smp_get_proc_count());
+    kprintf("WORKQUEUE: Started system workqueue with %u threads.\n", systemWorkqueue->ThreadCount);
+}
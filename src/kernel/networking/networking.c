@@ -29,13 +29,15 @@
 
 #include <kernel/lock.h>
 #include <kernel/memory/kheap.h>
+#include <kernel/multitasking/rcu.h>
 #include <kernel/tasking.h>
 
 #include <kernel/networking/layers/l2-ethernet.h>
 #include <kernel/networking/protocols/arp.h>
 
-// Network device linked list.
+// Network device linked list. Readers walk it under RCU, the lock only serializes registration.
 net_device_t *NetDevices = NULL;
+static lock_t netDevicesLock = LOCK_INIT_NAMED(LOCK_TYPE_SPIN, "netDevicesLock");
 
 
 void dumphex(const void* data, size_t size) {
@@ -88,14 +90,15 @@ void networking_handle_packet(net_device_t *netDevice, void *data, uint16_t leng
     if (netDevice->CurrentRxPacket == NULL)
         netDevice->CurrentRxPacket = packet;
 
-    // Release lock.
+    // Release lock and wake up worker.
     spinlock_release(&netDevice->CurrentRxPacketLock);
+    semaphore_signal(&netDevice->RxPacketSemaphore, 1);
 }
 
 static void networking_packet_process_thread(net_device_t *netDevice) {
     while (true) {
-        // Wait until we have a packet ready.
-        while (netDevice->CurrentRxPacket == NULL);
+        // Sleep until we have a packet ready.
+        semaphore_wait(&netDevice->RxPacketSemaphore, 1, SYNC_WAIT_FOREVER);
 
         // Process packet here.
        // kprintf("process\n");
@@ -119,22 +122,27 @@ static void networking_packet_process_thread(net_device_t *netDevice) {
 }
 
 void networking_register_device(net_device_t *netDevice) {
-    // If there aren't any devices at all, add as first device.
+    // Devices are never unregistered, so the receive lock can be tracked by name.
+    spinlock_set_name(&netDevice->CurrentRxPacketLock, "CurrentRxPacketLock");
+
+    // If there aren't any devices at all, add as first device. Links are set up before the device is published.
+    spinlock_lock(&netDevicesLock);
     if (NetDevices == NULL) {
-        NetDevices = netDevice;
         netDevice->Next = netDevice;
         netDevice->Prev = netDevice;
+        rcu_assign_pointer(NetDevices, netDevice);
     }
     else { // Add to end of list.
         netDevice->Next = NetDevices;
-        NetDevices->Prev->Next = netDevice;
         netDevice->Prev = NetDevices->Prev;
+        rcu_assign_pointer(NetDevices->Prev->Next, netDevice);
         NetDevices->Prev = netDevice;
     }
+    spinlock_release(&netDevicesLock);
     kprintf("NET: Registered device %s!\n", netDevice->Name != NULL ? netDevice->Name : "unknown");
 
     // Start up packet reception thread.
-    tasking_thread_schedule_proc(tasking_thread_create_kernel("net_worker", networking_packet_process_thread, (uintptr_t)netDevice, 0, 0), 0);
+    tasking_thread_schedule(tasking_thread_create_kernel("net_worker", networking_packet_process_thread, (uintptr_t)netDevice, 0, 0));
 
     // This is where our test packet stuff will be for now.
     // Just send some garbage to prove it works in Wireshark.
@@ -161,17 +169,19 @@ void networking_register_device(net_device_t *netDevice) {
 }
 
 void networking_print_devices(void) {
-    net_device_t *netDevice = NetDevices;
-    net_device_t *firstDevice = NetDevices;
+    rcu_read_lock();
+    net_device_t *netDevice = rcu_dereference(NetDevices);
+    net_device_t *firstDevice = netDevice;
     kprintf("NET: List of networking devices:\n");
     while (netDevice != NULL) {
         kprintf("NET:    Device %s\n", netDevice->Name != NULL ? netDevice->Name : "unknown");
 
         // Move to next device.
-        netDevice = netDevice->Next;
+        netDevice = rcu_dereference(netDevice->Next);
         if (netDevice == firstDevice)
             break;
     }
+    rcu_read_unlock();
 }
 
 void networking_init(void) {
@@ -0,0 +1,98 @@
+/*
+ * File: percpu.c
+ * 
+ * Copyright (c) 2017-2018 Sydney Erickson, John Davis
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <main.h>
+#include <io.h>
+#include <kprint.h>
+#include <string.h>
+#include <kernel/percpu.h>
+
+#include <kernel/gdt.h>
+#include <kernel/interrupts/lapic.h>
+#include <kernel/interrupts/smp.h>
+#include <kernel/memory/kheap.h>
+
+// The BSP's block is static, as it's needed before the heap is up.
+static percpu_t bspPercpu;
+
+// Blocks for all processors, by index. Only filled in once SMP is up.
+static percpu_t **percpuBlocks = NULL;
+static uint32_t percpuBlockCount = 0;
+
+percpu_t *percpu_get_proc(uint32_t index) {
+    if (percpuBlocks == NULL)
+        return (index == bspPercpu.Index) ? &bspPercpu : NULL;
+    return (index < percpuBlockCount) ? percpuBlocks[index] : NULL;
+}
+
+static void percpu_load(percpu_t *percpu) {
+#ifdef X86_64
+    // Point GS base at the block. The user's base waits in KERNEL_GS_BASE, and entry stubs
+    // swap the two with swapgs when coming from or going back to user mode.
+    cpu_msr_write(PERCPU_MSR_GS_BASE, (uintptr_t)percpu);
+    cpu_msr_write(PERCPU_MSR_KERNEL_GS_BASE, 0);
+#else
+    // Point this processor's per-CPU segment at the block and load it into GS.
+    gdt_set_percpu(gdt_get(), (uintptr_t)percpu, sizeof(percpu_t));
+    asm volatile ("mov %0, %%gs" : : "r"((uint32_t)GDT_PERCPU_OFFSET));
+#endif
+}
+
+void percpu_init_ap(uint32_t index, uint32_t apicId) {
+    if (percpuBlocks == NULL || index >= percpuBlockCount)
+        panic("PERCPU: Processor %u out of range!\n", index);
+
+    // Create block for this processor.
+    percpu_t *percpu = (percpu_t*)kheap_alloc(sizeof(percpu_t));
+    memset(percpu, 0, sizeof(percpu_t));
+    percpu->Self = percpu;
+    percpu->Index = index;
+    percpu->ApicId = apicId;
+    percpuBlocks[index] = percpu;
+    percpu_load(percpu);
+}
+
+void percpu_init_smp(void) {
+    // Create table of blocks before any APs are started.
+    percpuBlockCount = smp_get_proc_count();
+    percpuBlocks = (percpu_t**)kheap_alloc(sizeof(percpu_t*) * percpuBlockCount);
+    memset(percpuBlocks, 0, sizeof(percpu_t*) * percpuBlockCount);
+
+    // Fill in the BSP's real index and LAPIC ID.
+    smp_proc_t *proc = smp_get_proc(lapic_id());
+    if (proc != NULL) {
+        bspPercpu.Index = proc->Index;
+        bspPercpu.ApicId = proc->ApicId;
+    }
+    percpuBlocks[bspPercpu.Index] = &bspPercpu;
+}
+
+void percpu_init_bsp(void) {
+    // The BSP is index 0 until SMP is up and gives it its real index and LAPIC ID.
+    memset(&bspPercpu, 0, sizeof(percpu_t));
+    bspPercpu.Self = &bspPercpu;
+    bspPercpu.Index = 0;
+    percpu_load(&bspPercpu);
+    kprintf("PERCPU: BSP data at 0x%p.\n", &bspPercpu);
+}
@@ -24,30 +24,178 @@
 
 #include <main.h>
 #include <tools.h>
+#include <io.h>
 #include <kprint.h>
 #include <kernel/timer.h>
 
 #include <driver/pit.h>
+#include <kernel/cpuid.h>
+#include <kernel/interrupts/interrupts.h>
 #include <kernel/interrupts/ioapic.h>
 #include <kernel/interrupts/irqs.h>
+#include <kernel/interrupts/lapic.h>
+#include <kernel/hrtimer.h>
+#include <kernel/percpu.h>
+#include <kernel/tasking.h>
 
 // Variable to hold the amount of ticks since the OS started.
 static uint64_t ticks = 0;
 
+// Tickless state. Once the TSC is calibrated it becomes the clock, and the LAPIC timer
+// only fires when the scheduler asks for it.
+static bool tickless = false;
+static bool tscDeadline = false;
+static uint32_t lapicRate = 0;
+static uint64_t tscPerTick = 0;
+static uint64_t tscBase = 0;
+static uint64_t tscBaseTicks = 0;
+
 // Return the number of ticks elapsed.
 uint64_t timer_ticks(void) {
+	if (tscPerTick != 0)
+		return tscBaseTicks + ((cpu_tsc_read() - tscBase) / tscPerTick);
 	return ticks;
 }
 
+// Return the time since boot in nanoseconds. This only has tick resolution until the TSC is calibrated.
+uint64_t timer_now_ns(void) {
+	if (tscPerTick != 0) {
+		uint64_t cycles = cpu_tsc_read() - tscBase;
+		return ((tscBaseTicks + (cycles / tscPerTick)) * TIMER_NS_PER_MS) + (((cycles % tscPerTick) * TIMER_NS_PER_MS) / tscPerTick);
+	}
+	return ticks * TIMER_NS_PER_MS;
+}
+
+// Returns true if the LAPIC timer is driven by timer_set_next_event() instead of firing every tick.
+bool timer_tickless(void) {
+	return tickless;
+}
+
+// Returns the number of TSC cycles per tick, or 0 if the TSC isn't calibrated.
+uint64_t timer_tsc_rate(void) {
+	return tscPerTick;
+}
+
+// Converts TSC cycles to nanoseconds without overflowing for large counts. Cycles are returned as-is if the TSC isn't calibrated.
+uint64_t timer_tsc_to_ns(uint64_t cycles) {
+	if (tscPerTick == 0)
+		return cycles;
+	return ((cycles / tscPerTick) * TIMER_NS_PER_MS) + (((cycles % tscPerTick) * TIMER_NS_PER_MS) / tscPerTick);
+}
+
+// Arms the current processor's timer to fire in the specified number of ticks.
+void timer_set_next_event(uint32_t ms) {
+	if (!tickless)
+		return;
+	if (ms == 0)
+		ms = 1;
+
+	if (tscDeadline)
+		lapic_timer_arm_deadline(cpu_tsc_read() + (ms * tscPerTick));
+	else
+		lapic_timer_arm(ms * lapicRate);
+	percpu_get()->TimerDeadline = timer_now_ns() + (ms * TIMER_NS_PER_MS);
+}
+
+// Arms the current processor's timer to fire at the specified time, with better than tick precision where possible.
+void timer_set_next_event_ns(uint64_t deadlineNs) {
+	if (!tickless)
+		return;
+
+	uint64_t now = timer_now_ns();
+	uint64_t delta = (deadlineNs > now) ? (deadlineNs - now) : 0;
+	if (delta > TIMER_MAX_EVENT_NS)
+		delta = TIMER_MAX_EVENT_NS;
+
+	if (tscDeadline)
+		lapic_timer_arm_deadline(cpu_tsc_read() + ((delta * tscPerTick) / TIMER_NS_PER_MS));
+	else {
+		uint32_t count = (uint32_t)((delta * lapicRate) / TIMER_NS_PER_MS);
+		lapic_timer_arm((count > 0) ? count : 1);
+	}
+	percpu_get()->TimerDeadline = now + delta;
+}
+
+static bool timer_tsc_usable(void) {
+	// Only use the TSC as a clock if it runs at a constant rate.
+	uint32_t unused, result;
+	if (!cpuid_query(CPUID_GETFEATURES, &unused, &unused, &unused, &result) || !(result & CPUID_FEAT_EDX_TSC))
+		return false;
+	if (!cpuid_query(CPUID_INTELADVANCEDPOWER, &unused, &unused, &unused, &result) || !(result & CPUID_FEAT_EDX_INVARIANT_TSC))
+		return false;
+	return true;
+}
+
+static uint64_t timer_tsc_cpuid_rate(void) {
+	// Get TSC cycles per ms from the crystal clock ratio, if the processor enumerates all of it.
+	uint32_t denominator, numerator, crystalHz, unused;
+	if (!cpuid_query(CPUID_GETTSCFREQUENCY, &denominator, &numerator, &crystalHz, &unused))
+		return 0;
+	if (denominator == 0 || numerator == 0 || crystalHz == 0)
+		return 0;
+	return (((uint64_t)crystalHz * numerator) / denominator) / 1000;
+}
+
+static void timer_calibrate(bool useTsc) {
+	// Time a single window on PIT channel 2, counting the LAPIC timer and TSC across it.
+	// The result is shared by every processor, as all LAPIC timers run off the same clock.
+	bool interrupts = interrupts_enabled();
+	interrupts_disable();
+	pit_oneshot_start(1000 / TIMER_CALIBRATE_MS);
+	uint64_t startTsc = cpu_tsc_read();
+	lapic_timer_count_start();
+	while (!pit_oneshot_expired());
+	uint32_t lapicCount = lapic_timer_count_stop();
+	uint64_t cycles = cpu_tsc_read() - startTsc;
+	if (interrupts)
+		interrupts_enable();
+
+	lapicRate = lapicCount / TIMER_CALIBRATE_MS;
+	kprintf("TIMER: LAPIC timer ticked %u times in %ums.\n", lapicCount, TIMER_CALIBRATE_MS);
+	if (!useTsc)
+		return;
+
+	// The crystal ratio from CPUID is exact, so it beats the measurement when present.
+	uint64_t cpuidRate = timer_tsc_cpuid_rate();
+	kprintf("TIMER: TSC ticked %llu times in %ums.\n", cycles, TIMER_CALIBRATE_MS);
+	if (cpuidRate != 0)
+		kprintf("TIMER: Using TSC rate of %llu cycles per ms from CPUID.\n", cpuidRate);
+
+	// Switch clock over to the TSC.
+	tscBaseTicks = ticks;
+	tscBase = cpu_tsc_read();
+	tscPerTick = (cpuidRate != 0) ? cpuidRate : (cycles / TIMER_CALIBRATE_MS);
+}
+
+// Callback for the LAPIC timer on APs. Every processor runs its own hrtimers and scheduler tick.
+static bool timer_callback_ap(irq_regs_t *regs, uint8_t irqNum, uint32_t procIndex) {
+	// The one-shot timer has fired, so it needs arming again. Run any expired timers before the scheduler looks at what's next.
+	percpu_get()->TimerDeadline = 0;
+	hrtimer_run(procIndex);
+
+	// Charge tick to the running thread.
+	tasking_tick(regs, procIndex);
+	return true;
+}
+
 // Callback for timer on IRQ0.
 static bool timer_callback(irq_regs_t *regs, uint8_t irqNum, uint32_t procIndex) {	
-	// Increment the number of ticks.
+	// Increment the number of ticks. Only the BSP keeps the tick count.
 	ticks++;
+	return timer_callback_ap(regs, irqNum, procIndex);
+}
 
-	// Change tasks every 5ms.
-	if (ticks % 5 == 0)
-		tasking_tick(regs, procIndex);
-	return true;
+void timer_init_ap(void) {
+    // Handle this processor's timer interrupts.
+    irqs_install_handler(IRQ_TIMER, timer_callback_ap);
+
+    // Start LAPIC timer on AP with the BSP's calibration, as all LAPIC timers share the bus clock.
+    if (tickless) {
+        lapic_timer_start_oneshot(tscDeadline);
+        timer_set_next_event(1);
+    }
+    else
+        lapic_timer_start(lapicRate);
 }
 
 void timer_init(void) {
@@ -66,17 +214,27 @@ void timer_init(void) {
 
     // Are APICs supported?
     if (ioapic_supported()) {
-        // Get LAPIC timer rate.
-        uint32_t rate = lapic_timer_get_rate();
+        // Get LAPIC timer and TSC rates. Go tickless if the TSC can be used as the clock.
+        uint32_t unused, result;
+        tickless = timer_tsc_usable();
+        timer_calibrate(tickless);
+        tscDeadline = tickless && cpuid_query(CPUID_GETFEATURES, &unused, &unused, &result, &unused) && (result & CPUID_FEAT_ECX_TSC_DEAD);
 
         // Disconnect PIT interrupt from I/O APIC and start timer.
-        ioapic_disable_interrupt(ioapic_remap_interrupt(IRQ_TIMER), IRQ_OFFSET + IRQ_TIMER);
-        lapic_timer_start(rate);
+        ioapic_disable_interrupt(ioapic_remap_interrupt(IRQ_TIMER));
+        if (tickless) {
+            kprintf("TIMER: Using tickless mode with %s timer.\n", tscDeadline ? "TSC-deadline" : "one-shot");
+            lapic_timer_start_oneshot(tscDeadline);
+            timer_set_next_event(1);
+        }
+        else {
+            lapic_timer_start(lapicRate);
 
-        // Test LAPIC timer.
-        kprintf("TIMER: Waiting for response from LAPIC.\nTIMER: If the system hangs here, IRQs or the LAPIC are not working.\n");
-	    sleep(10);
-        kprintf("TIMER: LAPIC test passed!\n");
+            // Test LAPIC timer.
+            kprintf("TIMER: Waiting for response from LAPIC.\nTIMER: If the system hangs here, IRQs or the LAPIC are not working.\n");
+            sleep(10);
+            kprintf("TIMER: LAPIC test passed!\n");
+        }
     }
 
     kprintf("TIMER: Initialized!\n");
@@ -84,6 +84,13 @@ uint64_t cpu_msr_read(uint32_t msr) {
     return ((uint64_t)high << 32) | low;
 }
 
+// Read TSC.
+uint64_t cpu_tsc_read(void) {
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
 // Write MSR.
 void cpu_msr_write(uint32_t msr, uint64_t value) {
     asm volatile ("wrmsr" : : "a"((uint32_t)(value & 0xFFFFFFFF)), "d"((uint32_t)(value >> 32)), "c"(msr));
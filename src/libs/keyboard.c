@@ -29,6 +29,7 @@
 
 #include <driver/ps2/ps2_keyboard.h>
 #include <driver/usb/devices/hid/usb_keyboard.h>
+#include <kernel/multitasking/sync.h>
 
 struct key_mapping
 {
@@ -117,6 +118,9 @@ const struct key_mapping keyboard_layout_us[] = {
 
 keyboard_t *FirstKeyboard = NULL;
 
+// Signalled when a key or serial character arrives, so readers can sleep until there is input.
+static semaphore_t inputSemaphore;
+
 void keyboard_add(keyboard_t *keyboard) {
     keyboard->Next = FirstKeyboard;
     FirstKeyboard = keyboard;
@@ -144,3 +148,17 @@ char keyboard_get_ascii(uint16_t key) {
         return 0;
     return keyboard_layout_us[key].ascii;
 }
+
+void keyboard_input_signal(void) {
+    // Safe from IRQ handlers. Repeated signals collapse into one wakeup.
+    semaphore_signal(&inputSemaphore, 1);
+}
+
+bool keyboard_input_wait(uint32_t timeoutMs) {
+    // Callers must check for input before waiting, as a signal only means something may have arrived.
+    return semaphore_wait(&inputSemaphore, 1, timeoutMs);
+}
+
+void keyboard_init(void) {
+    semaphore_init(&inputSemaphore, 0, 1);
+}
@@ -29,7 +29,7 @@
 #include <kernel/lock.h>
 #include <string.h>
 
-lock_t kprintf_mutex = { };
+lock_t kprintf_mutex = LOCK_INIT_NAMED(LOCK_TYPE_SPIN, "kprintf_mutex");
 
 // Print a single character.
 void kputchar(char c)
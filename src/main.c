@@ -28,6 +28,7 @@
 #include <string.h>
 #include <kprint.h>
 #include <kernel/gdt.h>
+#include <kernel/percpu.h>
 #include <kernel/interrupts/interrupts.h>
 #include <kernel/acpi/acpi.h>
 #include <kernel/memory/pmm.h>
@@ -36,6 +37,10 @@
 #include <kernel/tasking.h>
 #include <kernel/timer.h>
 #include <kernel/interrupts/smp.h>
+#include <kernel/interrupts/smpcall.h>
+#include <kernel/interrupts/irqs.h>
+#include <kernel/interrupts/irqbalance.h>
+#include <kernel/interrupts/irqstat.h>
 #include <kernel/cpuid.h>
 #include <driver/vga.h>
 #include <driver/storage/floppy.h>
@@ -45,7 +50,12 @@
 #include <driver/ps2/ps2.h>
 #include <libs/keyboard.h>
 #include <driver/rtc.h>
+#include <kernel/lockstat.h>
+#include <kernel/multitasking/rcu.h>
+#include <kernel/multitasking/sync.h>
 #include <kernel/multitasking/syscalls.h>
+#include <kernel/multitasking/workqueue.h>
+#include <kernel/multitasking/schedtrace.h>
 
 #include <driver/usb/devices/usb_device.h>
 
@@ -88,8 +98,9 @@ void kernel_main() {
 	// Initialize VGA.
 	vga_init();
 
-	// Initialize the GDT.
+	// Initialize the GDT and the BSP's per-CPU data.
 	gdt_init_bsp();
+	percpu_init_bsp();
 
 	// Initialize memory system.
 	pmm_init();
@@ -103,8 +114,11 @@ void kernel_main() {
 	// Initialize timer.
     timer_init();
 
+	// Initialize input. Keyboards and serial wake the shell when input arrives.
+	keyboard_init();
 	kprintf("Initializing PS/2...\n");
 	ps2_init();
+	serial_enable_interrupts();
 
 	// Initialize SMP.
 	smp_init();
@@ -164,6 +178,9 @@ void kernel_late() {
 	kprintf("MAIN: Adding second process...\n"); 
 	//tasking_process_add(tasking_process_create("another one", tasking_thread_create("ring3", (uintptr_t)secondprocess_thread, 0, 0, 0), false));
 
+	// Start worker threads for deferred work.
+	workqueue_init();
+
 	acpi_late_init();
 	
 	// Initialize floppy.
@@ -202,6 +219,9 @@ void kernel_late() {
     // Ring serial terminals.
 	kprintf("\a");
 
+	// The shell sleeps until there is input, and should run as soon as there is.
+	tasking_thread_set_priority(tasking_thread_current(), TASKING_PRIORITY_INTERACTIVE);
+
 	char buffer[100];
 	while (true) {
 		kprintf("\e[96mroot@sydos ~:\e[0m ");
@@ -209,8 +229,11 @@ void kernel_late() {
 		uint16_t i = 0;
 		while (i < 98) {
 			uint16_t k = keyboard_get_last_key();
-			while (k == KEYBOARD_KEY_UNKNOWN && serial_received() == 0)
+			while (k == KEYBOARD_KEY_UNKNOWN && serial_received() == 0) {
+				// Sleep until a keyboard or serial IRQ signals input.
+				keyboard_input_wait(SYNC_WAIT_FOREVER);
 				k = keyboard_get_last_key();
+			}
 
 			if (serial_received() != 0) {
 				char c = serial_read();
@@ -256,9 +279,72 @@ void kernel_late() {
 
 		else if (strcmp(buffer, "uptime") == 0)
 			kprintf("Current uptime: %i milliseconds.\n", timer_ticks());
+		else if (strcmp(buffer, "cpuload") == 0) {
+			// Show how busy each processor has been.
+			for (uint32_t p = 0; p < smp_get_proc_count(); p++) {
+				uint64_t idleTicks, busyTicks;
+				tasking_get_proc_ticks(p, &idleTicks, &busyTicks);
+				uint64_t totalTicks = idleTicks + busyTicks;
+				uint32_t percent = (totalTicks > 0) ? (uint32_t)((busyTicks * 100) / totalTicks) : 0;
+				kprintf("CPU %u: %u%% busy (%llu ms busy, %llu ms idle)\n", p, percent, busyTicks, idleTicks);
+			}
+		}
+		else if (strcmp(buffer, "schedtrace") == 0)
+			schedtrace_print();
+		else if (strcmp(buffer, "schedtrace export") == 0)
+			schedtrace_export();
+		else if (strcmp(buffer, "schedtrace clear") == 0)
+			schedtrace_clear();
+		else if (strcmp(buffer, "smpcall") == 0)
+			smp_call_print_stats();
+		else if (strcmp(buffer, "lockstat") == 0)
+			lockstat_print();
+		else if (strcmp(buffer, "lockstat reset") == 0)
+			lockstat_reset();
+		else if (strcmp(buffer, "interrupts") == 0)
+			irqstat_print();
+		else if (strcmp(buffer, "interrupts reset") == 0)
+			irqstat_reset();
+		else if (strcmp(buffer, "interrupts export") == 0)
+			irqstat_export();
+		else if (strcmp(buffer, "irqaffinity") == 0)
+			irqs_print_affinity();
+		else if (strncmp(buffer, "irqaffinity ", 12) == 0) {
+			// Get IRQ number, followed by a hex mask of processors.
+			char *str = buffer + 12;
+			uint32_t irq = 0;
+			while (*str >= '0' && *str <= '9')
+				irq = irq * 10 + (*str++ - '0');
+			while (*str == ' ')
+				str++;
+			if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X'))
+				str += 2;
+
+			smp_cpumask_t mask = 0;
+			while (true) {
+				char c = *str++;
+				if (c >= '0' && c <= '9')
+					mask = (mask << 4) | (c - '0');
+				else if (c >= 'a' && c <= 'f')
+					mask = (mask << 4) | (c - 'a' + 10);
+				else if (c >= 'A' && c <= 'F')
+					mask = (mask << 4) | (c - 'A' + 10);
+				else
+					break;
+			}
+
+			if (irq < IRQ_VECTOR_COUNT && irqs_set_affinity(irq, mask))
+				kprintf("IRQ%u is now on CPU %u.\n", irq, irqs_get_target(irq));
+			else
+				kprintf("Unable to set affinity of IRQ%u to 0x%llX.\n", irq, mask);
+		}
+		else if (strcmp(buffer, "irqbalance on") == 0 || strcmp(buffer, "irqbalance off") == 0)
+			irq_balance_set_enabled(strcmp(buffer, "irqbalance on") == 0);
+		else if (strcmp(buffer, "schedtrace on") == 0 || strcmp(buffer, "schedtrace off") == 0)
+			schedtrace_set_enabled(strcmp(buffer, "schedtrace on") == 0);
 		else if (strcmp(buffer, "floppy") == 0) {
 				// Mount? floppy drive.
-			fat_init(storageDevices);
+			fat_init(rcu_dereference(storageDevices));
 		}
 
 		else if (strcmp(buffer, "corp") == 0)
@@ -24,6 +24,7 @@
 
 #include <main.h>
 #include <kernel/timer.h>
+#include <kernel/tasking.h>
 
 /**
  * Convert int to char array
@@ -99,10 +100,14 @@ uint32_t maxrand(uint32_t seed, uint32_t max) {
 // Sleep for the specified number of milliseconds.
 void sleep(uint32_t ms)
 {
-	// 1 tick = 1 ms.
+	// Put thread on the sleep queue if tasking is up.
+	if (tasking_thread_sleep(ms))
+		return;
+
+	// Otherwise spin. 1 tick = 1 ms.
 	uint64_t startTick = timer_ticks();
 	uint64_t endTick = startTick + ms;
-	uint32_t tick = timer_ticks();
+	uint64_t tick = timer_ticks();
 	while (tick < endTick)
 		tick = timer_ticks();
 }
\ No newline at end of file